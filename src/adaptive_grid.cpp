@@ -0,0 +1,456 @@
+#include "adaptive_grid.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "messages.hpp"
+
+using namespace std;
+
+
+AdaptiveForceGrid::AdaptiveForceGrid() {
+    n_bricks_ = Vec3i(0);
+    basis_ = Mat3d(0);
+    inverse_basis_ = Mat3d(0);
+    offset_ = Vec3d(0);
+    setPeriodic(false, false, false);
+    max_level_ = 0;
+    tolerance_ = 0;
+}
+
+
+void AdaptiveForceGrid::setNBricks(const Vec3i& n_bricks) {
+    n_bricks_ = n_bricks;
+    levels_.assign(nBricks(), -1);
+    first_samples_.assign(nBricks(), 0);
+}
+
+
+void AdaptiveForceGrid::setBasis(const vector<Vec3d>& brick_vectors) {
+    for (int i = 0; i < 3; i++) {
+        basis_.at(0, i) = brick_vectors[i].x;
+        basis_.at(1, i) = brick_vectors[i].y;
+        basis_.at(2, i) = brick_vectors[i].z;
+    }
+    inverse_basis_ = basis_.inverse();
+}
+
+
+void AdaptiveForceGrid::setOffset(const Vec3d& offset) {
+    offset_ = offset;
+}
+
+
+void AdaptiveForceGrid::setPeriodic(bool periodic_a, bool periodic_b, bool periodic_c) {
+    is_periodic_[0] = periodic_a;
+    is_periodic_[1] = periodic_b;
+    is_periodic_[2] = periodic_c;
+}
+
+
+void AdaptiveForceGrid::setRefinement(int max_level, double tolerance) {
+    max_level_ = max_level;
+    tolerance_ = tolerance;
+}
+
+
+// The samples of a brick are ordered with the last brick vector running fastest
+static inline int sampleIndex(int a, int b, int c, int resolution) {
+    return (a * (resolution + 1) + b) * (resolution + 1) + c;
+}
+
+
+vector<Vec3d> AdaptiveForceGrid::brickPoints(int brick, int resolution) const {
+    Vec3d corner(brick / (n_bricks_.y * n_bricks_.z), (brick / n_bricks_.z) % n_bricks_.y,
+                 brick % n_bricks_.z);
+    vector<Vec3d> points;
+    points.reserve((resolution + 1) * (resolution + 1) * (resolution + 1));
+    for (int a = 0; a <= resolution; ++a) {
+        for (int b = 0; b <= resolution; ++b) {
+            for (int c = 0; c <= resolution; ++c) {
+                Vec3d local = corner + Vec3d(a, b, c) / resolution;
+                points.push_back(offset_ + basis_.multiply(local));
+            }
+        }
+    }
+    return points;
+}
+
+
+void AdaptiveForceGrid::refineBrick(const Sampler& sampler, int brick, int& resolution,
+                                    vector<Vec3d>& forces, vector<double>& energies,
+                                    const vector<Vec3d>& center_forces,
+                                    const vector<double>& center_energies) const {
+    // The old samples and the centers of the cells, if given, are reused
+    int fine_resolution = 2 * resolution;
+    vector<Vec3d> fine_points = brickPoints(brick, fine_resolution);
+    vector<Vec3d> fine_forces(fine_points.size());
+    vector<double> fine_energies(fine_points.size());
+    vector<Vec3d> missing_points;
+    vector<int> missing_indices;
+    for (int a = 0; a <= fine_resolution; ++a) {
+        for (int b = 0; b <= fine_resolution; ++b) {
+            for (int c = 0; c <= fine_resolution; ++c) {
+                int index = sampleIndex(a, b, c, fine_resolution);
+                if (a % 2 == 0 && b % 2 == 0 && c % 2 == 0) {
+                    int old_index = sampleIndex(a / 2, b / 2, c / 2, resolution);
+                    fine_forces[index] = forces[old_index];
+                    fine_energies[index] = energies[old_index];
+                } else if (a % 2 == 1 && b % 2 == 1 && c % 2 == 1 && !center_forces.empty()) {
+                    int center_index = ((a / 2) * resolution + b / 2) * resolution + c / 2;
+                    fine_forces[index] = center_forces[center_index];
+                    fine_energies[index] = center_energies[center_index];
+                } else {
+                    missing_points.push_back(fine_points[index]);
+                    missing_indices.push_back(index);
+                }
+            }
+        }
+    }
+    vector<Vec3d> missing_forces(missing_points.size());
+    vector<double> missing_energies(missing_points.size());
+    sampler(missing_points, missing_forces, missing_energies);
+    for (unsigned int m = 0; m < missing_indices.size(); ++m) {
+        fine_forces[missing_indices[m]] = missing_forces[m];
+        fine_energies[missing_indices[m]] = missing_energies[m];
+    }
+    forces.swap(fine_forces);
+    energies.swap(fine_energies);
+    resolution = fine_resolution;
+}
+
+
+void AdaptiveForceGrid::storeBricks(int first_brick, int last_brick,
+                                    vector<vector<Vec3d>>& brick_forces,
+                                    vector<vector<double>>& brick_energies) {
+    // Store the samples of the bricks one after another
+    forces_.clear();
+    energies_.clear();
+    for (int brick = first_brick; brick < last_brick; ++brick) {
+        first_samples_[brick] = forces_.size();
+        forces_.insert(forces_.end(), brick_forces[brick - first_brick].begin(),
+                       brick_forces[brick - first_brick].end());
+        energies_.insert(energies_.end(), brick_energies[brick - first_brick].begin(),
+                         brick_energies[brick - first_brick].end());
+    }
+}
+
+
+void AdaptiveForceGrid::build(const Sampler& sampler, int first_brick, int last_brick) {
+    int n_built = last_brick - first_brick;
+    vector<vector<Vec3d>> brick_forces(n_built);
+    vector<vector<double>> brick_energies(n_built);
+    levels_.assign(nBricks(), -1);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int brick = first_brick; brick < last_brick; ++brick) {
+        int level = 0;
+        int resolution = base_resolution_;
+        vector<Vec3d> forces;
+        vector<double> energies;
+        vector<Vec3d> points = brickPoints(brick, resolution);
+        forces.resize(points.size());
+        energies.resize(points.size());
+        sampler(points, forces, energies);
+
+        while (level < max_level_) {
+            // The error of the interpolation is largest around the centers of the cells,
+            // where they are compared with the real force
+            vector<Vec3d> fine_points = brickPoints(brick, 2 * resolution);
+            int fine_resolution = 2 * resolution;
+            vector<Vec3d> centers;
+            for (int a = 0; a < resolution; ++a) {
+                for (int b = 0; b < resolution; ++b) {
+                    for (int c = 0; c < resolution; ++c) {
+                        centers.push_back(fine_points[sampleIndex(2*a + 1, 2*b + 1, 2*c + 1, fine_resolution)]);
+                    }
+                }
+            }
+            vector<Vec3d> center_forces(centers.size());
+            vector<double> center_energies(centers.size());
+            sampler(centers, center_forces, center_energies);
+            double max_error = 0;
+            int center = 0;
+            for (int a = 0; a < resolution; ++a) {
+                for (int b = 0; b < resolution; ++b) {
+                    for (int c = 0; c < resolution; ++c) {
+                        Vec3d interpolated(0);
+                        for (int corner = 0; corner < 8; ++corner) {
+                            interpolated += forces[sampleIndex(a + (corner >> 2), b + ((corner >> 1) & 1),
+                                                               c + (corner & 1), resolution)];
+                        }
+                        interpolated = interpolated / 8;
+                        max_error = max(max_error, (center_forces[center] - interpolated).len());
+                        center++;
+                    }
+                }
+            }
+            if (max_error <= tolerance_) {
+                break;
+            }
+            refineBrick(sampler, brick, resolution, forces, energies, center_forces, center_energies);
+            level++;
+        }
+        levels_[brick] = level;
+        brick_forces[brick - first_brick].swap(forces);
+        brick_energies[brick - first_brick].swap(energies);
+    }
+    storeBricks(first_brick, last_brick, brick_forces, brick_energies);
+}
+
+
+int AdaptiveForceGrid::brickIndex(int a, int b, int c) const {
+    int indices[3] = {a, b, c};
+    const int n_bricks[3] = {n_bricks_.x, n_bricks_.y, n_bricks_.z};
+    for (int i = 0; i < 3; ++i) {
+        if (is_periodic_[i]) {
+            indices[i] -= n_bricks[i] * (int)floor(double(indices[i]) / n_bricks[i]);
+        } else if (indices[i] < 0 || indices[i] >= n_bricks[i]) {
+            return -1;
+        }
+    }
+    return (indices[0] * n_bricks_.y + indices[1]) * n_bricks_.z + indices[2];
+}
+
+
+void AdaptiveForceGrid::balance(const Sampler& sampler, int first_brick, int last_brick) {
+    // Raise the levels until no brick is more than one level coarser than the bricks
+    // sharing a face, an edge or a corner with it. All the processes know the levels,
+    // so they find the same ones.
+    vector<int> targets = levels_;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int brick = 0; brick < nBricks(); ++brick) {
+            int a = brick / (n_bricks_.y * n_bricks_.z);
+            int b = (brick / n_bricks_.z) % n_bricks_.y;
+            int c = brick % n_bricks_.z;
+            for (int neighbour = 0; neighbour < 27; ++neighbour) {
+                int other = brickIndex(a + neighbour / 9 - 1, b + (neighbour / 3) % 3 - 1,
+                                       c + neighbour % 3 - 1);
+                if (other >= 0 && targets[other] - 1 > targets[brick]) {
+                    targets[brick] = targets[other] - 1;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    int n_built = last_brick - first_brick;
+    vector<vector<Vec3d>> brick_forces(n_built);
+    vector<vector<double>> brick_energies(n_built);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int brick = first_brick; brick < last_brick; ++brick) {
+        int resolution = base_resolution_ << levels_[brick];
+        int n_samples = (resolution + 1) * (resolution + 1) * (resolution + 1);
+        vector<Vec3d> forces(forces_.begin() + first_samples_[brick],
+                             forces_.begin() + first_samples_[brick] + n_samples);
+        vector<double> energies(energies_.begin() + first_samples_[brick],
+                                energies_.begin() + first_samples_[brick] + n_samples);
+        for (int level = levels_[brick]; level < targets[brick]; ++level) {
+            refineBrick(sampler, brick, resolution, forces, energies, vector<Vec3d>(), vector<double>());
+        }
+        brick_forces[brick - first_brick].swap(forces);
+        brick_energies[brick - first_brick].swap(energies);
+    }
+    levels_.swap(targets);
+    storeBricks(first_brick, last_brick, brick_forces, brick_energies);
+}
+
+
+void AdaptiveForceGrid::conformFaces() {
+    // The samples on the boundary of a brick are replaced by the interpolation of the
+    // coarsest brick touching them, so the force is continuous between the bricks. The
+    // coarser bricks are finished first, and a brick takes the samples only from coarser
+    // ones, so the bricks of one level can be done in parallel.
+    for (int level = 1; level <= max_level_; ++level) {
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int brick = 0; brick < nBricks(); ++brick) {
+            if (levels_[brick] != level) {
+                continue;
+            }
+            int corner[3] = {brick / (n_bricks_.y * n_bricks_.z), (brick / n_bricks_.z) % n_bricks_.y,
+                             brick % n_bricks_.z};
+            int resolution = base_resolution_ << level;
+            for (int a = 0; a <= resolution; ++a) {
+                for (int b = 0; b <= resolution; ++b) {
+                    for (int c = 0; c <= resolution; ++c) {
+                        int sample[3] = {a, b, c};
+                        bool on_boundary = false;
+                        for (int i = 0; i < 3; ++i) {
+                            on_boundary |= (sample[i] == 0 || sample[i] == resolution);
+                        }
+                        if (!on_boundary) {
+                            continue;
+                        }
+                        // The bricks touching the sample are the ones next to the faces it's on
+                        int coarsest = -1;
+                        Vec3d coarsest_local;
+                        for (int neighbour = 0; neighbour < 27; ++neighbour) {
+                            int offset[3] = {neighbour / 9 - 1, (neighbour / 3) % 3 - 1, neighbour % 3 - 1};
+                            bool touches = true;
+                            for (int i = 0; i < 3; ++i) {
+                                touches &= (offset[i] == 0 || (offset[i] < 0 && sample[i] == 0) ||
+                                            (offset[i] > 0 && sample[i] == resolution));
+                            }
+                            int other = touches ? brickIndex(corner[0] + offset[0], corner[1] + offset[1],
+                                                             corner[2] + offset[2]) : -1;
+                            if (other < 0 || levels_[other] >= level ||
+                                (coarsest >= 0 && levels_[other] >= levels_[coarsest])) {
+                                continue;
+                            }
+                            coarsest = other;
+                            coarsest_local = Vec3d(double(a) / resolution - offset[0],
+                                                   double(b) / resolution - offset[1],
+                                                   double(c) / resolution - offset[2]);
+                        }
+                        if (coarsest >= 0) {
+                            int index = first_samples_[brick] + sampleIndex(a, b, c, resolution);
+                            interpolateBrick(coarsest, coarsest_local, forces_[index], energies_[index]);
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+#if MPI_BUILD
+void AdaptiveForceGrid::gather(const vector<int>& brick_begins, MPI_Comm universe) {
+    int n_processes = brick_begins.size() - 1;
+    vector<int> counts(n_processes), displacements(n_processes);
+    for (int p = 0; p < n_processes; ++p) {
+        displacements[p] = brick_begins[p];
+        counts[p] = brick_begins[p + 1] - brick_begins[p];
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, static_cast<void*>(levels_.data()),
+                   counts.data(), displacements.data(), MPI_INT, universe);
+
+    // The samples of each process are one block
+    vector<Vec3d> forces;
+    vector<double> energies;
+    int n_samples = 0;
+    for (int p = 0; p < n_processes; ++p) {
+        displacements[p] = n_samples;
+        for (int brick = brick_begins[p]; brick < brick_begins[p + 1]; ++brick) {
+            int points = (base_resolution_ << levels_[brick]) + 1;
+            first_samples_[brick] = n_samples;
+            n_samples += points * points * points;
+        }
+        counts[p] = n_samples - displacements[p];
+    }
+    forces.resize(n_samples);
+    energies.resize(n_samples);
+    static_assert(sizeof(Vec3d) == 3 * sizeof(double), "Vec3d is sent as three doubles");
+    MPI_Allgatherv(static_cast<void*>(energies_.data()), energies_.size(), MPI_DOUBLE,
+                   static_cast<void*>(energies.data()), counts.data(), displacements.data(),
+                   MPI_DOUBLE, universe);
+    for (int p = 0; p < n_processes; ++p) {
+        displacements[p] *= 3;
+        counts[p] *= 3;
+    }
+    MPI_Allgatherv(static_cast<void*>(forces_.data()), 3 * forces_.size(), MPI_DOUBLE,
+                   static_cast<void*>(forces.data()), counts.data(), displacements.data(),
+                   MPI_DOUBLE, universe);
+    forces_.swap(forces);
+    energies_.swap(energies);
+}
+#endif
+
+
+vector<int> AdaptiveForceGrid::levelCounts() const {
+    vector<int> counts(max_level_ + 1, 0);
+    for (int level : levels_) {
+        if (level >= 0) {
+            counts[level]++;
+        }
+    }
+    return counts;
+}
+
+
+int AdaptiveForceGrid::findBrick(const Vec3d& position, Vec3d& local) const {
+    local = inverse_basis_.multiply(position - offset_);
+    double* components[3] = {&local.x, &local.y, &local.z};
+    const int n_bricks[3] = {n_bricks_.x, n_bricks_.y, n_bricks_.z};
+    int brick[3];
+    for (int a = 0; a < 3; ++a) {
+        double whole = floor(*components[a]);
+        brick[a] = whole;
+        if (is_periodic_[a]) {
+            brick[a] -= n_bricks[a] * (int)floor(double(brick[a]) / n_bricks[a]);
+            *components[a] -= whole;
+            continue;
+        }
+        // Outside the grid the edge brick is extrapolated
+        if (brick[a] < 0 || brick[a] >= n_bricks[a]) {
+            warning("Position outside of grid borders %f, %f, %f!",
+                    position.x, position.y, position.z);
+            brick[a] = min(max(brick[a], 0), n_bricks[a] - 1);
+        }
+        *components[a] -= brick[a];
+    }
+    return (brick[0] * n_bricks_.y + brick[1]) * n_bricks_.z + brick[2];
+}
+
+
+void AdaptiveForceGrid::interpolate(const Vec3d& position, Vec3d& force, double& energy) const {
+    Vec3d local;
+    int brick = findBrick(position, local);
+    interpolateBrick(brick, local, force, energy);
+}
+
+
+void AdaptiveForceGrid::interpolateBrick(int brick, Vec3d local, Vec3d& force, double& energy) const {
+    int resolution = base_resolution_ << levels_[brick];
+
+    // Find the cell of the brick and how far we are inside it
+    double* components[3] = {&local.x, &local.y, &local.z};
+    int cell[3];
+    double d[3];
+    for (int a = 0; a < 3; ++a) {
+        double scaled = *components[a] * resolution;
+        cell[a] = min(max((int)floor(scaled), 0), resolution - 1);
+        d[a] = scaled - cell[a];
+    }
+
+    // Trilinear interpolation like in ForceGrid
+    const Vec3d* f = &forces_[first_samples_[brick]];
+    const double* e = &energies_[first_samples_[brick]];
+    force = Vec3d(0);
+    energy = 0;
+    for (int corner = 0; corner < 8; ++corner) {
+        int i = corner >> 2;
+        int j = (corner >> 1) & 1;
+        int k = corner & 1;
+        double weight = (i ? d[0] : 1 - d[0]) * (j ? d[1] : 1 - d[1]) * (k ? d[2] : 1 - d[2]);
+        int index = sampleIndex(cell[0] + i, cell[1] + j, cell[2] + k, resolution);
+        force += weight * f[index];
+        energy += weight * e[index];
+    }
+}
+
+
+void AdaptiveForceGrid::addHessian(const Vec3d& position, Mat3d& hessian) const {
+    // As in ForceGrid, with central differences over one cell of the brick at position
+    Vec3d local;
+    int resolution = base_resolution_ << levels_[findBrick(position, local)];
+    Mat3d force_diff;
+    Vec3d force_plus, force_minus;
+    double energy;
+    for (int b = 0; b < 3; ++b) {
+        Vec3d step = basis_.getColumn(b) / resolution;
+        interpolate(position + step, force_plus, energy);
+        interpolate(position - step, force_minus, energy);
+        Vec3d diff = (force_minus - force_plus) / 2;
+        force_diff.at(0, b) = diff.x;
+        force_diff.at(1, b) = diff.y;
+        force_diff.at(2, b) = diff.z;
+    }
+    Mat3d grid_hessian = force_diff.multiply(inverse_basis_);
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            hessian.at(a, b) += resolution * (grid_hessian.at(a, b) + grid_hessian.at(b, a)) / 2;
+        }
+    }
+}
@@ -0,0 +1,113 @@
+/*
+ * adaptive_grid.hpp
+ *
+ * AdaptiveForceGrid class samples the force and energy on a grid whose
+ * resolution adapts to how fast the force changes, so that the far field
+ * takes little memory while the samples close to the atoms stay dense.
+ *
+ */
+
+#pragma once
+
+#if MPI_BUILD
+    #include <mpi.h>
+#endif
+
+#include <functional>
+#include <vector>
+
+#include "matrices.hpp"
+#include "vectors.hpp"
+
+using namespace std;
+
+/** \brief A force grid made of bricks that are each refined as far as needed.
+ *
+ * The grid is a uniform array of bricks, which are indexed directly, so the
+ * lookup takes constant time. Each brick is a uniform grid of its own with
+ * 2 * 2^level cells along each brick vector. A brick is refined while the
+ * force at the centers of its cells differs from the interpolated one by more
+ * than the tolerance, up to the maximum level. The bricks are then refined
+ * further until the levels of neighbouring bricks differ by at most one, and
+ * the samples on the boundary of each brick are replaced by the interpolation
+ * of the coarsest brick touching them. The faces of the bricks thus conform,
+ * so the force doesn't jump between bricks of different levels.
+ */
+
+class AdaptiveForceGrid {
+ public:
+    // Evaluates the force and energy at each of the positions
+    typedef function<void(const vector<Vec3d>& positions, vector<Vec3d>& forces,
+                          vector<double>& energies)> Sampler;
+
+    AdaptiveForceGrid();
+    ~AdaptiveForceGrid() {};
+
+    void setNBricks(const Vec3i& n_bricks);
+    // Sets the edges of a brick
+    void setBasis(const vector<Vec3d>& brick_vectors);
+    // Sets the position of the corner of brick (0, 0, 0)
+    void setOffset(const Vec3d& offset);
+    // Sets the periodicity along each brick vector
+    void setPeriodic(bool periodic_a, bool periodic_b, bool periodic_c);
+    // Sets the maximum level of refinement and the tolerance of the force
+    void setRefinement(int max_level, double tolerance);
+
+    // Returns the number of bricks
+    int nBricks() const { return n_bricks_.x * n_bricks_.y * n_bricks_.z; }
+    // Samples the bricks first_brick, ..., last_brick - 1 in parallel with sampler,
+    // which must be thread safe. The other bricks are left empty.
+    void build(const Sampler& sampler, int first_brick, int last_brick);
+    // Refines the bricks first_brick, ..., last_brick - 1 so that the levels of neighbouring
+    // bricks differ by at most one. The levels of all the bricks must be known.
+    void balance(const Sampler& sampler, int first_brick, int last_brick);
+    // Makes the samples on the boundaries of the bricks match the coarser neighbours.
+    // All the bricks must be built and balanced.
+    void conformFaces();
+#if MPI_BUILD
+    // Gathers the bricks built by each process to all the processes of universe.
+    // Process p must have built the bricks brick_begins[p], ..., brick_begins[p + 1] - 1.
+    void gather(const vector<int>& brick_begins, MPI_Comm universe);
+#endif
+    // Returns the number of samples and the number of the bricks on each level
+    size_t nSamples() const { return energies_.size(); }
+    vector<int> levelCounts() const;
+
+    // Calculates the interpolated force and energy at the given position
+    void interpolate(const Vec3d& position, Vec3d& force, double& energy) const;
+    // Adds the second derivatives of the energy at the given position to hessian
+    void addHessian(const Vec3d& position, Mat3d& hessian) const;
+
+ private:
+    // Returns the brick containing position and the position in the units of the brick
+    // vectors relative to the corner of the brick
+    int findBrick(const Vec3d& position, Vec3d& local) const;
+    // Returns the brick at the given brick coordinates, -1 if outside the grid
+    int brickIndex(int a, int b, int c) const;
+    // Returns the positions of the samples of a brick on a resolution
+    vector<Vec3d> brickPoints(int brick, int resolution) const;
+    // Halves the spacing of the samples of a brick. The forces and energies at the centers
+    // of the cells are sampled unless given.
+    void refineBrick(const Sampler& sampler, int brick, int& resolution, vector<Vec3d>& forces,
+                     vector<double>& energies, const vector<Vec3d>& center_forces,
+                     const vector<double>& center_energies) const;
+    // Stores the samples of the bricks first_brick, ..., last_brick - 1 one after another
+    void storeBricks(int first_brick, int last_brick, vector<vector<Vec3d>>& brick_forces,
+                     vector<vector<double>>& brick_energies);
+    // Interpolates a brick at the position local in the units of the brick vectors
+    void interpolateBrick(int brick, Vec3d local, Vec3d& force, double& energy) const;
+
+    static const int base_resolution_ = 2;  // Cells along each brick vector on level 0
+
+    Vec3i n_bricks_;  // The number of bricks along each brick vector
+    Mat3d basis_;  // The brick vectors as columns
+    Mat3d inverse_basis_;
+    Vec3d offset_;
+    bool is_periodic_[3];
+    int max_level_;
+    double tolerance_;
+    vector<int> levels_;  // The level of each brick, -1 for the ones not built
+    vector<int> first_samples_;  // The index of the first sample of each brick
+    vector<Vec3d> forces_;  // The samples of all the bricks one after another
+    vector<double> energies_;
+};
@@ -0,0 +1,240 @@
+#include "coulomb_tree.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+
+constexpr double CoulombTree::rebuild_distance_;
+
+
+// Adds the traceless quadrupole q (3 a b^T - a.b I) to quadrupole, symmetrised over a and b
+static void addQuadrupole(double q, const Vec3d& a, const Vec3d& b, double* quadrupole) {
+    double a_b = a.dot(b);
+    quadrupole[0] += q * (3 * a.x * b.x - a_b);
+    quadrupole[1] += q * (3 * a.y * b.y - a_b);
+    quadrupole[2] += q * (3 * a.z * b.z - a_b);
+    quadrupole[3] += q * 1.5 * (a.x * b.y + a.y * b.x);
+    quadrupole[4] += q * 1.5 * (a.x * b.z + a.z * b.x);
+    quadrupole[5] += q * 1.5 * (a.y * b.z + a.z * b.y);
+}
+
+
+void CoulombTree::build(const vector<Vec3d>& positions, const vector<int>& atoms,
+                        const vector<double>& charges) {
+    atoms_ = atoms;
+    charges_ = charges;
+    positions_.resize(atoms_.size());
+    for (unsigned int k = 0; k < atoms_.size(); ++k) {
+        positions_[k] = positions[atoms_[k]];
+    }
+    built_positions_ = positions_;
+    nodes_.clear();
+    if (atoms_.empty()) {
+        return;
+    }
+
+    // The bounding boxes are needed for splitting, so the root is fitted first
+    Node root;
+    root.begin = 0;
+    root.end = atoms_.size();
+    root.first_child = 0;
+    root.n_children = 0;
+    nodes_.push_back(root);
+    refit();
+    split(0, 0);
+    refit();
+}
+
+
+void CoulombTree::split(int node_i, int depth) {
+    const int begin = nodes_[node_i].begin;
+    const int end = nodes_[node_i].end;
+    if (end - begin <= leaf_size_ || depth >= max_depth_) {
+        return;
+    }
+
+    // Sort the atoms to the octants of the bounding box
+    const Vec3d center = nodes_[node_i].center;
+    vector<int> octants(end - begin);
+    int counts[8] = {0};
+    for (int k = begin; k < end; ++k) {
+        const Vec3d& position = positions_[k];
+        int octant = (position.x > center.x) + 2*(position.y > center.y) + 4*(position.z > center.z);
+        octants[k - begin] = octant;
+        counts[octant]++;
+    }
+    int offsets[8];
+    offsets[0] = begin;
+    for (int o = 1; o < 8; ++o) {
+        offsets[o] = offsets[o - 1] + counts[o - 1];
+    }
+    int child_begins[8];
+    copy(offsets, offsets + 8, child_begins);
+    vector<int> sorted_atoms(end - begin);
+    vector<double> sorted_charges(end - begin);
+    vector<Vec3d> sorted_positions(end - begin);
+    for (int k = begin; k < end; ++k) {
+        int target = offsets[octants[k - begin]]++ - begin;
+        sorted_atoms[target] = atoms_[k];
+        sorted_charges[target] = charges_[k];
+        sorted_positions[target] = positions_[k];
+    }
+    copy(sorted_atoms.begin(), sorted_atoms.end(), atoms_.begin() + begin);
+    copy(sorted_charges.begin(), sorted_charges.end(), charges_.begin() + begin);
+    copy(sorted_positions.begin(), sorted_positions.end(), positions_.begin() + begin);
+
+    // Atoms on top of each other can't be split
+    for (int o = 0; o < 8; ++o) {
+        if (counts[o] == end - begin) {
+            return;
+        }
+    }
+
+    // The children of a node are stored one after another, so they are all added
+    // before splitting them further
+    int first_child = nodes_.size();
+    for (int o = 0; o < 8; ++o) {
+        if (counts[o] > 0) {
+            Node child;
+            child.begin = child_begins[o];
+            child.end = child_begins[o] + counts[o];
+            child.first_child = 0;
+            child.n_children = 0;
+            child.center = center;
+            nodes_.push_back(child);
+        }
+    }
+    nodes_[node_i].first_child = first_child;
+    nodes_[node_i].n_children = nodes_.size() - first_child;
+    for (int c = first_child; c < first_child + nodes_[node_i].n_children; ++c) {
+        // The box of the child is needed for its own split
+        Node& child = nodes_[c];
+        Vec3d low = positions_[child.begin];
+        Vec3d high = low;
+        for (int k = child.begin; k < child.end; ++k) {
+            low = Vec3d(min(low.x, positions_[k].x), min(low.y, positions_[k].y), min(low.z, positions_[k].z));
+            high = Vec3d(max(high.x, positions_[k].x), max(high.y, positions_[k].y), max(high.z, positions_[k].z));
+        }
+        child.center = 0.5 * (low + high);
+        split(c, depth + 1);
+    }
+}
+
+
+void CoulombTree::refit() {
+    // The children are always after their parent
+    for (int n = nodes_.size() - 1; n >= 0; --n) {
+        Node& node = nodes_[n];
+        if (node.n_children == 0) {
+            node.low = positions_[node.begin];
+            node.high = node.low;
+            for (int k = node.begin; k < node.end; ++k) {
+                const Vec3d& position = positions_[k];
+                node.low = Vec3d(min(node.low.x, position.x), min(node.low.y, position.y), min(node.low.z, position.z));
+                node.high = Vec3d(max(node.high.x, position.x), max(node.high.y, position.y), max(node.high.z, position.z));
+            }
+            node.center = 0.5 * (node.low + node.high);
+            node.charge = 0;
+            node.dipole = Vec3d(0);
+            fill(node.quadrupole, node.quadrupole + 6, 0.0);
+            for (int k = node.begin; k < node.end; ++k) {
+                Vec3d r = positions_[k] - node.center;
+                node.charge += charges_[k];
+                node.dipole += charges_[k] * r;
+                addQuadrupole(charges_[k], r, r, node.quadrupole);
+            }
+        } else {
+            node.low = nodes_[node.first_child].low;
+            node.high = nodes_[node.first_child].high;
+            for (int c = node.first_child; c < node.first_child + node.n_children; ++c) {
+                const Node& child = nodes_[c];
+                node.low = Vec3d(min(node.low.x, child.low.x), min(node.low.y, child.low.y), min(node.low.z, child.low.z));
+                node.high = Vec3d(max(node.high.x, child.high.x), max(node.high.y, child.high.y), max(node.high.z, child.high.z));
+            }
+            node.center = 0.5 * (node.low + node.high);
+            node.charge = 0;
+            node.dipole = Vec3d(0);
+            fill(node.quadrupole, node.quadrupole + 6, 0.0);
+            for (int c = node.first_child; c < node.first_child + node.n_children; ++c) {
+                // Moments of the child moved to the center of the node
+                const Node& child = nodes_[c];
+                Vec3d shift = child.center - node.center;
+                node.charge += child.charge;
+                node.dipole += child.dipole + child.charge * shift;
+                for (int m = 0; m < 6; ++m) {
+                    node.quadrupole[m] += child.quadrupole[m];
+                }
+                addQuadrupole(1.0, shift, child.dipole, node.quadrupole);
+                addQuadrupole(1.0, child.dipole, shift, node.quadrupole);
+                addQuadrupole(child.charge, shift, shift, node.quadrupole);
+            }
+        }
+        node.radius = 0.5 * (node.high - node.low).len();
+    }
+}
+
+
+void CoulombTree::update(const vector<Vec3d>& positions) {
+    double max_shift_sqr = 0;
+    for (unsigned int k = 0; k < atoms_.size(); ++k) {
+        positions_[k] = positions[atoms_[k]];
+        max_shift_sqr = max(max_shift_sqr, (positions_[k] - built_positions_[k]).lensqr());
+    }
+    if (max_shift_sqr > rebuild_distance_ * rebuild_distance_) {
+        vector<int> atoms(atoms_);
+        vector<double> charges(charges_);
+        build(positions, atoms, charges);
+    } else {
+        refit();
+    }
+}
+
+
+double CoulombTree::evalField(const Vec3d& point, int exclude, Vec3d& field) const {
+    if (nodes_.empty()) {
+        return 0;
+    }
+    double potential = 0;
+    // At most seven siblings wait on each level
+    int stack[8 * (max_depth_ + 1)];
+    int n_stack = 0;
+    stack[n_stack++] = 0;
+    while (n_stack > 0) {
+        const Node& node = nodes_[stack[--n_stack]];
+        Vec3d d = point - node.center;
+        double d_sqr = d.lensqr();
+        if (node.radius * node.radius < theta_sqr_ * d_sqr) {
+            // Far enough for the moments of the node
+            double inv_d = 1.0 / sqrt(d_sqr);
+            double inv_d2 = inv_d * inv_d;
+            double inv_d3 = inv_d * inv_d2;
+            double inv_d5 = inv_d3 * inv_d2;
+            const double* quad = node.quadrupole;
+            Vec3d quad_d(quad[0]*d.x + quad[3]*d.y + quad[4]*d.z,
+                         quad[3]*d.x + quad[1]*d.y + quad[5]*d.z,
+                         quad[4]*d.x + quad[5]*d.y + quad[2]*d.z);
+            double p_d = node.dipole.dot(d);
+            double d_quad_d = d.dot(quad_d);
+            potential += node.charge * inv_d + p_d * inv_d3 + 0.5 * d_quad_d * inv_d5;
+            field += (node.charge * inv_d3 + 3 * p_d * inv_d5 + 2.5 * d_quad_d * inv_d5 * inv_d2) * d
+                     - inv_d3 * node.dipole - inv_d5 * quad_d;
+        } else if (node.n_children == 0) {
+            for (int k = node.begin; k < node.end; ++k) {
+                if (atoms_[k] == exclude) {
+                    continue;
+                }
+                Vec3d r_vec = point - positions_[k];
+                double inv_r = 1.0 / r_vec.len();
+                potential += charges_[k] * inv_r;
+                field += charges_[k] * inv_r * inv_r * inv_r * r_vec;
+            }
+        } else {
+            for (int c = node.first_child; c < node.first_child + node.n_children; ++c) {
+                stack[n_stack++] = c;
+            }
+        }
+    }
+    return potential;
+}
@@ -0,0 +1,72 @@
+/*
+ * coulomb_tree.hpp
+ *
+ * CoulombTree class is a Barnes-Hut octree of point charges, which gives the
+ * electrostatic potential and field of N charges at a point in O(log N) time
+ * instead of summing over all of them.
+ *
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "vectors.hpp"
+
+using namespace std;
+
+/** \brief A Barnes-Hut octree of point charges.
+ *
+ * Each node holds the charge, the dipole and the quadrupole moment of its atoms
+ * around the center of its bounding box. A node is used as a whole if its radius is less
+ * than theta times its distance from the point, otherwise its children are
+ * opened, so theta controls the accuracy (0 < theta < 1). As the atoms move,
+ * the boxes and moments are refitted to the new positions, which keeps the
+ * result accurate, and the tree is only rebuilt once some atom has moved
+ * further than the rebuild distance.
+ */
+
+class CoulombTree {
+public:
+    CoulombTree(): theta_sqr_(0) {};
+    CoulombTree(double theta): theta_sqr_(theta * theta) {};
+
+    // builds the tree over the charges of the atoms (indices to positions)
+    void build(const vector<Vec3d>& positions, const vector<int>& atoms,
+               const vector<double>& charges);
+    // moves the atoms to new positions, rebuilding the tree if they have moved far
+    void update(const vector<Vec3d>& positions);
+    // returns the potential and adds the field of the charges at point to field, the
+    // atom exclude (an index to positions) is left out
+    double evalField(const Vec3d& point, int exclude, Vec3d& field) const;
+    bool empty() const { return atoms_.empty(); };
+
+private:
+    struct Node {
+        Vec3d low, high;  // The bounding box
+        Vec3d center;
+        double radius;  // Half of the diagonal of the bounding box
+        double charge;
+        Vec3d dipole;  // Around center
+        double quadrupole[6];  // Traceless, around center (xx, yy, zz, xy, xz, yz)
+        int begin, end;  // The range of the atoms in the tree order
+        int first_child, n_children;  // The children are stored one after another
+    };
+
+    // splits the atoms of the node to its children recursively
+    void split(int node_i, int depth);
+    // recomputes the boxes and moments of all the nodes from the positions
+    void refit();
+
+    static const int leaf_size_ = 8;
+    static const int max_depth_ = 24;
+    static constexpr double rebuild_distance_ = 0.5;  // In Å
+
+    double theta_sqr_;
+    vector<Node> nodes_;
+    // The atoms in the tree order
+    vector<int> atoms_;  // Indices to the positions
+    vector<double> charges_;
+    vector<Vec3d> positions_;
+    vector<Vec3d> built_positions_;  // The positions when the tree was last built
+};
@@ -8,8 +8,6 @@ using namespace std;
 
 
 CubeReader::CubeReader(const string& filepath) {
-    voxel_vectors_.assign(3, Vec3d(0));
-    
     // open file access and read metadata
     cube_file_.exceptions(ifstream::failbit | ifstream::badbit);
     cube_file_.open(filepath);
@@ -68,15 +66,6 @@ void CubeReader::readVolumetricData(vector<double>& volumetric_data) {
 }
 
 
-void CubeReader::storeToDataGrid(DataGrid<double>& data_grid, const Vec3d& offset) {
-    vector<double> volumetric_data = readVolumetricData();
-    data_grid.setNGrid(n_voxels_);
-    data_grid.setBasis(voxel_vectors_);
-    data_grid.setOrigin(origin_ + offset);
-    data_grid.swapValues(volumetric_data);
-}
-
-
 bool CubeReader::isVoxelsOrthogonal() const {
     return ( abs(voxel_vectors_[0].y) + abs(voxel_vectors_[0].z) + \
         abs(voxel_vectors_[1].x) + abs(voxel_vectors_[1].z) + \
@@ -137,3 +126,89 @@ bool CubeReader::readMetadata() {
     
     return true;
 }
+
+
+CubeWriter::CubeWriter(const string& filepath) {
+    comment_lines_ = "Written by MechAFM\n";
+    cube_file_ = fopen(filepath.c_str(), "w");
+    if (cube_file_ == NULL) {
+        throw runtime_error("Could not open the cube file " + filepath + " for writing.");
+    }
+}
+
+
+CubeWriter::~CubeWriter() {
+    if (cube_file_ != NULL) {
+        fclose(cube_file_);
+    }
+}
+
+
+void CubeWriter::setAtoms(const vector<int>& atom_numbers, const vector<Vec3d>& atom_positions) {
+    atom_numbers_ = atom_numbers;
+    atom_positions_ = atom_positions;
+}
+
+
+void CubeWriter::writeDataGrid(const DataGrid<double>& data_grid) {
+    const Vec3i& n_grid = data_grid.getNGrid();
+    const Mat3d& basis = data_grid.getBasis();
+    Vec3d origin = data_grid.getOrigin() / bohr_to_angst;
+    
+    // write the comment lines and the grid metadata (positive counts mean Bohr)
+    fprintf(cube_file_, "%s\n", comment_lines_.c_str());
+    fprintf(cube_file_, "%5d %12.6f %12.6f %12.6f\n", (int)atom_numbers_.size(), origin.x, origin.y, origin.z);
+    const int n_voxels[3] = {n_grid.x, n_grid.y, n_grid.z};
+    for (int i = 0; i < 3; i++) {
+        Vec3d voxel_vector = basis.getColumn(i) / bohr_to_angst;
+        fprintf(cube_file_, "%5d %12.6f %12.6f %12.6f\n", n_voxels[i], voxel_vector.x, voxel_vector.y, voxel_vector.z);
+    }
+    for (unsigned int ia = 0; ia < atom_numbers_.size(); ia++) {
+        Vec3d position = atom_positions_[ia] / bohr_to_angst;
+        fprintf(cube_file_, "%5d %12.6f %12.6f %12.6f %12.6f\n", atom_numbers_[ia],
+                (double)atom_numbers_[ia], position.x, position.y, position.z);
+    }
+    
+    // format the x slabs in parallel and write them in order, six values per line
+    // and a line break at the end of each z column as in the usual cube files
+    vector<string> slabs(n_grid.x);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int ix = 0; ix < n_grid.x; ix++) {
+        char value[32];
+        string& slab = slabs[ix];
+        slab.reserve(n_grid.y * n_grid.z * 14);
+        for (int iy = 0; iy < n_grid.y; iy++) {
+            for (int iz = 0; iz < n_grid.z; iz++) {
+                snprintf(value, sizeof(value), " %12.5E", data_grid.at(ix, iy, iz));
+                slab += value;
+                if (iz % 6 == 5 || iz == n_grid.z - 1) {
+                    slab += '\n';
+                }
+            }
+        }
+    }
+    for (const auto& slab : slabs) {
+        fwrite(slab.data(), 1, slab.size(), cube_file_);
+    }
+}
+
+
+int atomicNumber(const string& type) {
+    static const char* elements[] = {"H", "He",
+        "Li", "Be", "B", "C", "N", "O", "F", "Ne",
+        "Na", "Mg", "Al", "Si", "P", "S", "Cl", "Ar",
+        "K", "Ca", "Sc", "Ti", "V", "Cr", "Mn", "Fe", "Co", "Ni", "Cu", "Zn",
+        "Ga", "Ge", "As", "Se", "Br", "Kr",
+        "Rb", "Sr", "Y", "Zr", "Nb", "Mo", "Tc", "Ru", "Rh", "Pd", "Ag", "Cd",
+        "In", "Sn", "Sb", "Te", "I", "Xe",
+        "Cs", "Ba", "La", "Ce", "Pr", "Nd", "Pm", "Sm", "Eu", "Gd", "Tb", "Dy",
+        "Ho", "Er", "Tm", "Yb", "Lu", "Hf", "Ta", "W", "Re", "Os", "Ir", "Pt",
+        "Au", "Hg", "Tl", "Pb", "Bi", "Po", "At", "Rn"};
+    const int n_elements = sizeof(elements) / sizeof(elements[0]);
+    for (int i = 0; i < n_elements; i++) {
+        if (type == elements[i]) {
+            return i + 1;
+        }
+    }
+    return 0;
+}
@@ -3,16 +3,20 @@
  * 
  * CubeReader class represents a read access to the volumetric data of a cube file
  * and contains the metadata of the file and the atom types and positions.
+ * CubeWriter class writes a DataGrid with the atom types and positions to a cube file.
  * 
  */
 
 #pragma once
 
+#include <cstdio>
 #include <fstream>
+#include <string>
 #include <vector>
 
 #include "data_grid.hpp"
 #include "vectors.hpp"
+#include "volume_io.hpp"
 
 const double bohr_to_angst = 0.52917721092;
 
@@ -24,24 +28,26 @@ using namespace std;
  * and contains the metadata of the file and the atom types and positions.
  */
 
-class CubeReader {
+class CubeReader: public VolumeReader {
 public:
     CubeReader(const string& filepath);
     ~CubeReader() { cube_file_.close(); };
     
-    const Vec3i& getNVoxels() const { return n_voxels_; };
     //TODO: return voxel_vectors in either Bohr or Angstrom
-    const vector<Vec3d>& getVoxelVectors() const { return voxel_vectors_; };
     Vec3d getVoxelSpacing() const;
-    const Vec3d& getOrigin() const { return origin_; };
     int getNAtoms() const { return n_atoms_; };
     
     // allocates a vector and returns it after filling it with volumetric data from the file
-    vector<double> readVolumetricData();
+    vector<double> readVolumetricData() override;
     // stores the volumetric data from the file to the preallocated vector given as a reference
     void readVolumetricData(vector<double>& volumetric_data);
-    // stores all contents to a DataGrid object
-    void storeToDataGrid(DataGrid<double>& data_grid, const Vec3d& offset = Vec3d(0.0));
+
+protected:
+    // the values of the cube files are already in atomic units
+    double unitConversion(VolumeQuantity quantity) const override {
+        (void)quantity;
+        return 1.0;
+    };
 
 private:
     bool isVoxelsOrthogonal() const;
@@ -50,10 +56,36 @@ private:
     ifstream cube_file_;
     int volumetric_data_pos_;
     string comment_lines_;
-    Vec3i n_voxels_;
-    vector<Vec3d> voxel_vectors_;
-    Vec3d origin_;
     int n_atoms_;
     vector<int> atom_numbers_;
+};
+
+
+/** \brief A cube file writer.
+ *  
+ * Writes the volumetric data of a DataGrid to a cube file together with
+ * the atom types and positions. Lengths are written in Bohr.
+ */
+
+class CubeWriter {
+public:
+    CubeWriter(const string& filepath);
+    ~CubeWriter();
+    
+    // sets the two comment lines at the beginning of the file
+    void setComment(const string& line1, const string& line2) { comment_lines_ = line1 + '\n' + line2; };
+    // sets the atoms written to the file (positions in Angstrom)
+    void setAtoms(const vector<int>& atom_numbers, const vector<Vec3d>& atom_positions);
+    // writes the metadata and the data grid to the file
+    void writeDataGrid(const DataGrid<double>& data_grid);
+
+private:
+    FILE* cube_file_;
+    string comment_lines_;
+    vector<int> atom_numbers_;
     vector<Vec3d> atom_positions_;
 };
+
+
+// Returns the atomic number of an atom type by its element symbol (0 if not an element)
+int atomicNumber(const string& type);
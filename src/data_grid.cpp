@@ -38,66 +38,10 @@ void DataGrid<T>::swapValues(vector<T>& values_to_swap) {
 
 
 template<typename T>
-void DataGrid<T>::rotateCoordAxes(const string& new_coord_sequence) {
-    Vec3i new_n_grid;
-    Mat3d new_basis;
-    Vec3d new_origin;
-    int new_index;
-    vector<T> new_values;
-    new_values.resize(values_.size());
-    
-    if (new_coord_sequence == "ZXY") {
-        new_n_grid.x = n_grid_.z;
-        new_n_grid.y = n_grid_.x;
-        new_n_grid.z = n_grid_.y;
-        Mat3d swap_matrix = Mat3d(0);
-        swap_matrix.at(2, 0) = 1;
-        swap_matrix.at(0, 1) = 1;
-        swap_matrix.at(1, 2) = 1;
-        new_basis = swap_matrix.transpose().multiply(basis_.multiply(swap_matrix));
-        new_origin.x = origin_.z;
-        new_origin.y = origin_.x;
-        new_origin.z = origin_.y;
-        
-        for (int ix = 0; ix < new_n_grid.x; ix++) {
-            for (int iy = 0; iy < new_n_grid.y; iy++) {
-                for (int iz = 0; iz < new_n_grid.z; iz++) {
-                    new_index = ix*new_n_grid.y*new_n_grid.z + iy*new_n_grid.z + iz;
-                    new_values[new_index] = values_[index(iy, iz, ix)];
-                }
-            }
-        }
-    }
-    else if (new_coord_sequence == "YZX") {
-        new_n_grid.x = n_grid_.y;
-        new_n_grid.y = n_grid_.z;
-        new_n_grid.z = n_grid_.x;
-        Mat3d swap_matrix = Mat3d(0);
-        swap_matrix.at(1, 0) = 1;
-        swap_matrix.at(2, 1) = 1;
-        swap_matrix.at(0, 2) = 1;
-        new_basis = swap_matrix.transpose().multiply(basis_.multiply(swap_matrix));
-        new_origin.x = origin_.y;
-        new_origin.y = origin_.z;
-        new_origin.z = origin_.x;
-        
-        for (int ix = 0; ix < new_n_grid.x; ix++) {
-            for (int iy = 0; iy < new_n_grid.y; iy++) {
-                for (int iz = 0; iz < new_n_grid.z; iz++) {
-                    new_index = ix*new_n_grid.y*new_n_grid.z + iy*new_n_grid.z + iz;
-                    new_values[new_index] = values_[index(iz, ix, iy)];
-                }
-            }
-        }
-    }
-    else {
-        throw "The coordinate sequence for rotateCoordAxes must be either ZXY or YZX.";
-    }
-    
-    n_grid_ = new_n_grid;
-    basis_ = new_basis;
-    origin_ = new_origin;
-    values_.swap(new_values);
+void DataGrid<T>::transformCoordinates(const Mat3d& frame) {
+    // The values stay in place, only the grid vectors and the origin are transformed
+    setBasis(frame.multiply(basis_));
+    origin_ = frame.multiply(origin_);
 }
 
 
@@ -32,10 +32,13 @@ public:
     void initValues(int nx, int ny, int nz, const T& value);
     void scaleValues(double scaling_factor);
     void swapValues(vector<T>& values_to_swap);
-    void rotateCoordAxes(const string& new_coord_sequence);
+    // Expresses the grid in the frame whose axes are the rows of frame (values are not moved)
+    void transformCoordinates(const Mat3d& frame);
     
     // Returns reference to value at given grid indices
     T& at(int ix, int iy, int iz) { return values_[index(ix, iy, iz)]; };
+    // Returns constant reference to value at given grid indices
+    const T& at(int ix, int iy, int iz) const { return values_[index(ix, iy, iz)]; };
     // at() with periodic boundary conditions
     T& atPBC(int ix, int iy, int iz);
     // Returns reference to value at given internal storage index
@@ -60,7 +63,7 @@ public:
     void setOrigin(const Vec3d& origin);
     
 private:
-    inline int index(int ix, int iy, int iz) { return ix*n_grid_.y*n_grid_.z + iy*n_grid_.z + iz; };
+    inline int index(int ix, int iy, int iz) const { return ix*n_grid_.y*n_grid_.z + iy*n_grid_.z + iz; };
 
     bool is_orthogonal_basis_; // Determines whether the basis vectors of data grid are orthogonal
     Vec3i n_grid_; // The number of grid points along each basis vector
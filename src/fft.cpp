@@ -1,7 +1,9 @@
 #include "fft.hpp"
 
 #include <cmath>
+#include <cstdlib>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
 #include "matrices.hpp"
@@ -92,3 +94,59 @@ void ffti_data_grid(const DataGrid<dcomplex>& data_grid_in, DataGrid<double>& da
     basis = k_basis.multiply(n_grid_scaling).inverse().transpose();
     data_grid_out.setBasis(basis);
 }
+
+
+// Maps the frequencies of an axis of n_in points to an axis of n_out points. Returns the
+// target indices and weights of each source index, dropped frequencies have none. The
+// Nyquist frequency of an even axis is split evenly to the positive and negative frequency,
+// and frequencies that land on the Nyquist frequency of an even target axis are summed.
+static vector<vector<pair<int, double>>> map_frequencies(int n_in, int n_out) {
+    vector<vector<pair<int, double>>> mapping(n_in);
+    for (int i = 0; i < n_in; i++) {
+        vector<pair<int, double>> frequencies;
+        if (2*i == n_in) {
+            frequencies.push_back(make_pair(i, 0.5));
+            frequencies.push_back(make_pair(-i, 0.5));
+        } else {
+            frequencies.push_back(make_pair((i > n_in/2) ? i - n_in : i, 1.0));
+        }
+        for (const auto& frequency : frequencies) {
+            if (2*abs(frequency.first) <= n_out) {
+                int target = (frequency.first + n_out) % n_out;
+                mapping[i].push_back(make_pair(target, frequency.second));
+            }
+        }
+    }
+    return mapping;
+}
+
+
+void resample_kspace_data_grid(const DataGrid<dcomplex>& data_grid_in, const Vec3i& n_grid_out,
+                               DataGrid<dcomplex>& data_grid_out) {
+    const Vec3i& n_grid_in = data_grid_in.getNGrid();
+    vector<vector<pair<int, double>>> map_x = map_frequencies(n_grid_in.x, n_grid_out.x);
+    vector<vector<pair<int, double>>> map_y = map_frequencies(n_grid_in.y, n_grid_out.y);
+    vector<vector<pair<int, double>>> map_z = map_frequencies(n_grid_in.z, n_grid_out.z);
+    
+    // The inverse FFT is scaled with the number of grid points, so scale the coefficients
+    // with the ratio of the grid sizes to keep the values in real space.
+    double scaling = double(n_grid_out.x) * n_grid_out.y * n_grid_out.z /
+                     (double(n_grid_in.x) * n_grid_in.y * n_grid_in.z);
+    data_grid_out.initValues(n_grid_out.x, n_grid_out.y, n_grid_out.z, dcomplex(0.0, 0.0));
+    data_grid_out.setBasis(data_grid_in.getBasis());
+    for (int ix = 0; ix < n_grid_in.x; ix++) {
+        for (int iy = 0; iy < n_grid_in.y; iy++) {
+            for (int iz = 0; iz < n_grid_in.z; iz++) {
+                const dcomplex& value = data_grid_in.at(ix, iy, iz);
+                for (const auto& tx : map_x[ix]) {
+                    for (const auto& ty : map_y[iy]) {
+                        for (const auto& tz : map_z[iz]) {
+                            data_grid_out.at(tx.first, ty.first, tz.first) +=
+                                    scaling * tx.second * ty.second * tz.second * value;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
@@ -32,3 +32,14 @@ void fft_data_grid(const DataGrid<double>& data_grid_in, DataGrid<dcomplex>& dat
  *  changes grid basis from k-space to real space.
  */
 void ffti_data_grid(const DataGrid<dcomplex>& data_grid_in, DataGrid<double>& data_grid_out);
+
+
+/** \brief Resamples data_grid_in given in k-space to a grid of n_grid_out points
+ * 
+ *  The Fourier coefficients are copied to the frequencies that exist on both grids.
+ *  The other frequencies are dropped when down-sampling and zero when up-sampling, so the
+ *  inverse FFT of data_grid_out is the trigonometric interpolation of the periodic data.
+ *  The basis in k-space is the same for both grids since they span the same cell.
+ */
+void resample_kspace_data_grid(const DataGrid<dcomplex>& data_grid_in, const Vec3i& n_grid_out,
+                               DataGrid<dcomplex>& data_grid_out);
@@ -12,14 +12,22 @@ using namespace std;
 
 
 ForceGrid::ForceGrid() {
-    is_periodic_ = false;
+    setPeriodic(false);
     is_orthogonal_basis_ = false;
     n_grid_ = Vec3i(0);
     basis_ = Mat3d(0);
+    inverse_basis_ = Mat3d(0);
     offset_ = Vec3d(0);
 }
 
 
+void ForceGrid::setPeriodic(bool periodic_a, bool periodic_b, bool periodic_c) {
+    is_periodic_[0] = periodic_a;
+    is_periodic_[1] = periodic_b;
+    is_periodic_[2] = periodic_c;
+}
+
+
 void ForceGrid::setNGrid(const Vec3i& n_grid) {
     n_grid_.x = n_grid.x;
     n_grid_.y = n_grid.y;
@@ -35,6 +43,7 @@ void ForceGrid::setBasis(const vector<Vec3d>& basis_vectors) {
     }
     
     is_orthogonal_basis_ = basis_.isDiagonal();
+    inverse_basis_ = basis_.inverse();
 }
 
 
@@ -46,6 +55,7 @@ void ForceGrid::setBasis(const Mat3d& basis_matrix) {
     }
     
     is_orthogonal_basis_ = basis_.isDiagonal();
+    inverse_basis_ = basis_.inverse();
 }
 
 
@@ -55,6 +65,7 @@ void ForceGrid::setSpacing(const Vec3d& spacing) {
     basis_.at(0, 0) = spacing.x;
     basis_.at(1, 1) = spacing.y;
     basis_.at(2, 2) = spacing.z;
+    inverse_basis_ = basis_.inverse();
 }
 
 
@@ -93,8 +104,8 @@ void ForceGrid::interpolate(const Vec3d& position, Vec3d& force, double& energy)
 
     // Find the surrounding grid points as array indices and retrieve the force values
     Vec3i current_grid_point;
-    vector<Vec3d> force_samples(8);
-    vector<double> energy_samples(8);
+    Vec3d force_samples[8];
+    double energy_samples[8];
     for (int i = 0; i < 2; ++i) {
         current_grid_point.x = grid_point.x + i;
         for (int j = 0; j < 2; ++j) {
@@ -126,7 +137,7 @@ void ForceGrid::interpolate(const Vec3d& position, Vec3d& force, double& energy)
     }
     else {
         Vec3d pos_in_grid_basis;
-        pos_in_grid_basis = basis_.inverse().multiply(position - offset_);
+        pos_in_grid_basis = inverse_basis_.multiply(position - offset_);
         d.x = pos_in_grid_basis.x - grid_point.x;
         d.y = pos_in_grid_basis.y - grid_point.y;
         d.z = pos_in_grid_basis.z - grid_point.z;
@@ -155,6 +166,32 @@ void ForceGrid::interpolate(const Vec3d& position, Vec3d& force, double& energy)
 }
 
 
+void ForceGrid::addHessian(const Vec3d& position, Mat3d& hessian) const {
+    // The interpolated force is piecewise linear, so the derivatives are taken with
+    // central differences over one grid step along each basis vector. The columns of
+    // force_diff are then H * basis vector, from which H is solved.
+    Mat3d force_diff;
+    Vec3d force_plus, force_minus;
+    double energy;
+    for (int b = 0; b < 3; ++b) {
+        Vec3d step = basis_.getColumn(b);
+        interpolate(position + step, force_plus, energy);
+        interpolate(position - step, force_minus, energy);
+        Vec3d diff = (force_minus - force_plus) / 2;
+        force_diff.at(0, b) = diff.x;
+        force_diff.at(1, b) = diff.y;
+        force_diff.at(2, b) = diff.z;
+    }
+    Mat3d grid_hessian = force_diff.multiply(inverse_basis_);
+    // Symmetrize to remove the asymmetry caused by the finite differences
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            hessian.at(a, b) += (grid_hessian.at(a, b) + grid_hessian.at(b, a)) / 2;
+        }
+    }
+}
+
+
 Vec3i ForceGrid::getGridPoint(const Vec3d& pos) const {
     Vec3i grid_point;
     
@@ -170,49 +207,30 @@ Vec3i ForceGrid::getGridPoint(const Vec3d& pos) const {
     // must be transformed into the basis defined by the basis vectors of the grid.
     else {
         Vec3d pos_in_grid_basis;
-        pos_in_grid_basis = basis_.inverse().multiply(pos - offset_);
+        pos_in_grid_basis = inverse_basis_.multiply(pos - offset_);
         grid_point.x = floor(pos_in_grid_basis.x);
         grid_point.y = floor(pos_in_grid_basis.y);
         grid_point.z = floor(pos_in_grid_basis.z);
     }
     
     // If grid_point is outside the grid inform the user and take the edge point instead.
-    // If force grid is periodic, ignore the point being outside the grid.
-    if (not is_periodic_) {
-        // Check if grid_point.x is outside the grid
-        if (grid_point.x < 0) {
-            warning("Position outside of grid borders %f, %f, %f!",
-                    pos.x, pos.y, pos.z);
-            grid_point.x = 0;
+    // Along the periodic directions, ignore the point being outside the grid.
+    int* components[3] = {&grid_point.x, &grid_point.y, &grid_point.z};
+    const int n_grid[3] = {n_grid_.x, n_grid_.y, n_grid_.z};
+    for (int a = 0; a < 3; ++a) {
+        if (is_periodic_[a]) {
+            continue;
         }
-        else if (grid_point.x >= n_grid_.x) {
+        if (*components[a] < 0) {
             warning("Position outside of grid borders %f, %f, %f!",
                     pos.x, pos.y, pos.z);
-            grid_point.x = n_grid_.x - 1;
+            *components[a] = 0;
         }
-        
-        // Check if grid_point.y is outside the grid
-        if (grid_point.y < 0) {
+        else if (*components[a] >= n_grid[a] - 1) {
+            // The last grid point has no cell after it to interpolate in
             warning("Position outside of grid borders %f, %f, %f!",
                     pos.x, pos.y, pos.z);
-            grid_point.y = 0;
-        }
-        else if (grid_point.y >= n_grid_.y) {
-            warning("Position outside of grid borders %f, %f, %f!",
-                    pos.x, pos.y, pos.z);
-            grid_point.y = n_grid_.y - 1;
-        }
-        
-        // Check if grid_point.z is outside the grid
-        if (grid_point.z < 0) {
-            warning("Position outside of grid borders %f, %f, %f!",
-                    pos.x, pos.y, pos.z);
-            grid_point.z = 0;
-        }
-        else if (grid_point.z >= n_grid_.z) {
-            warning("Position outside of grid borders %f, %f, %f!",
-                    pos.x, pos.y, pos.z);
-            grid_point.z = n_grid_.z - 1;
+            *components[a] = n_grid[a] - 2;
         }
     }
     
@@ -221,31 +239,20 @@ Vec3i ForceGrid::getGridPoint(const Vec3d& pos) const {
 
 
 int ForceGrid::getGridPointIndex(const Vec3i& grid_point) const {
-    int index = 0;
-    
-    // Check if the grid_point is outside the grid and react accordingly
-    if (grid_point.x < 0 || grid_point.y < 0 || grid_point.z < 0
-       || grid_point.x >= n_grid_.x || grid_point.y >= n_grid_.y
-       || grid_point.z >= n_grid_.z) {
-        
-        if (is_periodic_) {
-            Vec3i pbc_grid_point = pbcGridPoint(grid_point);
-            index = pbc_grid_point.x * n_grid_.y * n_grid_.z
-                    + pbc_grid_point.y * n_grid_.z + pbc_grid_point.z;
-        }
-        else {
-            error("Invalid grid point %d, %d, %d (limit: %d, %d, %d)",
-                grid_point.x, grid_point.y, grid_point.z,
-                n_grid_.x, n_grid_.y, n_grid_.z);
-        }
-    }
+    // Wrap the grid point along the periodic directions
+    Vec3i pbc_grid_point = pbcGridPoint(grid_point);
     
-    else {
-        index = grid_point.x * n_grid_.y * n_grid_.z
-                + grid_point.y * n_grid_.z + grid_point.z;
+    // Check if the grid_point is still outside the grid
+    if (pbc_grid_point.x < 0 || pbc_grid_point.y < 0 || pbc_grid_point.z < 0
+       || pbc_grid_point.x >= n_grid_.x || pbc_grid_point.y >= n_grid_.y
+       || pbc_grid_point.z >= n_grid_.z) {
+        error("Invalid grid point %d, %d, %d (limit: %d, %d, %d)",
+            grid_point.x, grid_point.y, grid_point.z,
+            n_grid_.x, n_grid_.y, n_grid_.z);
     }
     
-    return index;
+    return pbc_grid_point.x * n_grid_.y * n_grid_.z
+           + pbc_grid_point.y * n_grid_.z + pbc_grid_point.z;
 }
 
 
@@ -254,19 +261,19 @@ Vec3i ForceGrid::pbcGridPoint(const Vec3i& grid_point) const {
     int n;
     
     // Check if grid_point.x is outside the grid
-    if ((grid_point.x < 0) || (grid_point.x >= n_grid_.x)) {
+    if (is_periodic_[0] && ((grid_point.x < 0) || (grid_point.x >= n_grid_.x))) {
         n = floor(double(grid_point.x)/n_grid_.x);
         pbc_grid_point.x -= n*n_grid_.x;
     }
     
     // Check if grid_point.y is outside the grid
-    if ((grid_point.y < 0) || (grid_point.y >= n_grid_.y)) {
+    if (is_periodic_[1] && ((grid_point.y < 0) || (grid_point.y >= n_grid_.y))) {
         n = floor(double(grid_point.y)/n_grid_.y);
         pbc_grid_point.y -= n*n_grid_.y;
     }
     
     // Check if grid_point.z is outside the grid
-    if ((grid_point.z < 0) || (grid_point.z >= n_grid_.z)) {
+    if (is_periodic_[2] && ((grid_point.z < 0) || (grid_point.z >= n_grid_.z))) {
         n = floor(double(grid_point.z)/n_grid_.z);
         pbc_grid_point.z -= n*n_grid_.z;
     }
@@ -17,7 +17,9 @@ class ForceGrid {
     ForceGrid();
     ~ForceGrid() {};
     
-    void setPeriodic(bool is_periodic) { is_periodic_ = is_periodic; };
+    void setPeriodic(bool is_periodic) { setPeriodic(is_periodic, is_periodic, is_periodic); };
+    // Sets the periodicity along each basis vector separately
+    void setPeriodic(bool periodic_a, bool periodic_b, bool periodic_c);
     void setNGrid(const Vec3i& n_grid);
     void setBasis(const vector<Vec3d>& basis_vectors);
     void setBasis(const Mat3d& basis_matrix);
@@ -31,6 +33,8 @@ class ForceGrid {
     
     // Calculates the interpolated force and energy at the given position
     void interpolate(const Vec3d& position, Vec3d& force, double& energy) const;
+    // Adds the second derivatives of the energy at the given position to hessian
+    void addHessian(const Vec3d& position, Mat3d& hessian) const;
 
  private:
     // Returns the grid point matching for the given position
@@ -39,12 +43,13 @@ class ForceGrid {
     int getGridPointIndex(const Vec3i& grid_point) const;
     Vec3i pbcGridPoint(const Vec3i& grid_point) const;
     
-    bool is_periodic_; // Determines whether the force grid has periodic boundary conditions
+    bool is_periodic_[3]; // Determines whether the force grid is periodic along each basis vector
     bool is_orthogonal_basis_; // Determines whether the basis vectors of force grid are orthogonal
     Vec3i n_grid_;  // The number of grid points along each basis vector
     Mat3d basis_;   // The basis in which each point of the force grid is represented.
                                     // If is_orthogonal_coord_ == true, this is a 3x3 diagonal matrix
                                     // and the diagonal elements define the spacing between grid points.
+    Mat3d inverse_basis_;  // Cached inverse of basis_ for the non-orthogonal lookups
     Vec3d offset_;  // The real position of grid point (0, 0, 0)
     vector<Vec3d> forces_;  // List of force samples
     vector<double> energies_;  // List of energy samples
@@ -14,19 +14,57 @@
 #define SIXTHRT2 1.12246204830937298142
 
 const double g_force_grid_margin = 1.5; // How wide of a margin force grid has around the simulation area when 'rigidgrid' is used
+const double g_frozen_grid_margin = 3.0; // How far the frozen grids reach around the initial positions of the moving atoms and the scan volume of the tip, in Å
+const int g_adaptive_grid_levels = 3; // How many times the adaptive force grid can halve its spacing
 const double g_gaussian_cutoff_value = 1.0e-10; // Relative value of a Gaussian after which the rest of the values further away are approximated to zero
 const double g_tip_gaussian_width = 0.5; // Width of the Gaussian charge distribution at the tip, in Å
+const int g_slab_tag = 0; // MPI tag of the rows of results sent to the root process
 
 // unit conversion factors
 const double g_hartree_to_eV = 27.211386;
 const double g_hartree_to_kJ = 2625.5002;
 const double g_hartree_to_kcal = 627.50961;
 
+// Cantilever stiffness conversion from N/m to energy / Å^2
+const double g_Nm_to_kcal = 1.4393264;
+const double g_Nm_to_kJ = 6.0221408;
+const double g_Nm_to_eV = 0.062415091;
+
+// Boltzmann constant in different units (per kelvin)
+const double g_kB_kcal = 0.0019872043;
+const double g_kB_kJ = 0.0083144626;
+const double g_kB_eV = 8.617333262e-5;
+
+
+// Defines the branches of an approach-retract cycle
+enum ScanBranch {APPROACH, RETRACT};
+
+// Defines the quantities of the output, in the order of the columns of the output files
+enum OutputField {
+    OUT_INDICES = 1 << 0,
+    OUT_POSITION = 1 << 1,
+    OUT_FX = 1 << 2,
+    OUT_FY = 1 << 3,
+    OUT_FZ = 1 << 4,
+    OUT_R_VEC = 1 << 5,
+    OUT_R = 1 << 6,
+    OUT_ANGLE = 1 << 7,
+    OUT_ENERGY = 1 << 8,
+    OUT_STEPS = 1 << 9,
+    OUT_STIFFNESS = 1 << 10,
+    OUT_THERMAL = 1 << 11,
+    OUT_FORCE = OUT_FX | OUT_FY | OUT_FZ,
+    OUT_ALL = (1 << 10) - 1  // All the columns that don't need a separate option
+};
 
 // Define a structure for easy processor communication
 struct OutputData {
     Vec3i indices;
     int minimisation_steps;
+    int branch;  // ScanBranch the data belongs to
+    int tip;  // Index of the tip the data belongs to
     double angle, tip_energy, r;
     Vec3d position, tip_force, r_vec;
+    Vec3d stiffness;  // Diagonal of the effective tip stiffness matrix
+    Vec3d thermal_force, thermal_variance;  // Mean and variance of the tip force at finite temperature
 };
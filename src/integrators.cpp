@@ -7,9 +7,7 @@
 
 void eulerStep(System& system, const double dt) {
     // Evaluate all the interactions
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(system.positions_, system.forces_, system.energies_);
-    }
+    system.evalInteractions(system.positions_, system.forces_, system.energies_);
 
     for (int i = 0; i < system.n_atoms_; ++i) {
         // Update the atom only if it's not fixed
@@ -28,9 +26,7 @@ void midpointStep(System& system, const double dt) {
     vector<double> e1(system.n_atoms_, 0), e2(system.n_atoms_, 0);
 
     // Step 1
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(system.positions_, f1, e1);
-    }
+    system.evalInteractions(system.positions_, f1, e1);
     for (int i = 0; i < system.n_atoms_; ++i) {
         if (system.fixed_[i] != 1) {
             p2[i] += dt/2 * system.velocities_[i];
@@ -39,9 +35,7 @@ void midpointStep(System& system, const double dt) {
     }
 
     // Step 2
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(p2, f2, e2);
-    }
+    system.evalInteractions(p2, f2, e2);
     // Update the system
     for (int i = 0; i < system.n_atoms_; ++i) {
         if (system.fixed_[i] != 1) {
@@ -63,9 +57,7 @@ void rk4Step(System& system, const double dt) {
     vector<double> e3(system.n_atoms_, 0), e4(system.n_atoms_, 0);
 
     // Step 1
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(system.positions_, f1, e1);
-    }
+    system.evalInteractions(system.positions_, f1, e1);
     for (int i = 0; i < system.n_atoms_; ++i) {
         if (system.fixed_[i] != 1) {
             p2[i] += dt/2 * system.velocities_[i];
@@ -74,9 +66,7 @@ void rk4Step(System& system, const double dt) {
     }
 
     // Step 2
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(p2, f2, e2);
-    }
+    system.evalInteractions(p2, f2, e2);
     for (int i = 0; i < system.n_atoms_; ++i) {
         if (system.fixed_[i] != 1) {
             p3[i] += dt/2 * v2[i];
@@ -85,9 +75,7 @@ void rk4Step(System& system, const double dt) {
     }
 
     // Step 3
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(p3, f3, e3);
-    }
+    system.evalInteractions(p3, f3, e3);
     for (int i = 0; i < system.n_atoms_; ++i) {
         if (system.fixed_[i] != 1) {
             p4[i] += dt * v3[i];
@@ -96,9 +84,7 @@ void rk4Step(System& system, const double dt) {
     }
 
     // Step 4
-    for (const auto& interaction : *system.interactions_) {
-        interaction->eval(p4, f4, e4);
-    }
+    system.evalInteractions(p4, f4, e4);
     // Update the system
     for (int i = 0; i < system.n_atoms_; ++i) {
         if (system.fixed_[i] != 1) {
@@ -1,6 +1,9 @@
 #include "interactions.hpp"
 
 #include <cmath>
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
 
 // debug only
 #include <iomanip>
@@ -9,9 +12,25 @@
 #include "fft.hpp"
 #include "force_grid.hpp"
 #include "globals.hpp"
+#include "kernels.hpp"
 #include "matrices.hpp"
 #include "vectors.hpp"
 
+// Adds the Hessian of a radial pair potential U(r) to hessian, given the pair
+// separation vector and the first and second derivatives of U at r
+void addRadialHessian(const Vec3d& r_vec, double du_dr, double d2u_dr2, Mat3d& hessian) {
+    double r = r_vec.len();
+    Vec3d r_unit = r_vec / r;
+    double r_vec_c[3] = {r_unit.x, r_unit.y, r_unit.z};
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            double rr = r_vec_c[a] * r_vec_c[b];
+            double delta = (a == b) ? 1.0 : 0.0;
+            hessian.at(a, b) += d2u_dr2 * rr + du_dr / r * (delta - rr);
+        }
+    }
+}
+
 void LJInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec3d r_vec = positions[atom_i1_] - (positions[atom_i2_] + pbc_shift_);
     double r_sqr = r_vec.lensqr();
@@ -26,6 +45,112 @@ void LJInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces,
     forces[atom_i2_] -= f;
 }
 
+void LJInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    if (atom_i1_ != 1 && atom_i2_ != 1) {
+        return;
+    }
+    Vec3d r_vec = positions[atom_i1_] - (positions[atom_i2_] + pbc_shift_);
+    double r_sqr = r_vec.lensqr();
+    double r = sqrt(r_sqr);
+    double r6 = r_sqr * r_sqr * r_sqr;
+    double term_a = es12_ / (r6*r6);
+    double term_b = es6_ / r6;
+    double du_dr = (-12*term_a + 6*term_b) / r;
+    double d2u_dr2 = (156*term_a - 42*term_b) / r_sqr;
+    addRadialHessian(r_vec, du_dr, d2u_dr2, hessian);
+}
+
+void LJTipSurfaceInteraction::addPair(int atom_i, double es6, double es12, Vec3d pbc_shift) {
+    atoms_.push_back(atom_i);
+    es6_.push_back(es6);
+    es12_.push_back(es12);
+    pbc_shifts_.push_back(pbc_shift);
+}
+
+void LJTipSurfaceInteraction::cacheFixedAtoms(const vector<Vec3d>& positions, const vector<int>& fixed) {
+    unsigned int n_moving = 0;
+    for (unsigned int i = 0; i < atoms_.size(); ++i) {
+        if (fixed[atoms_[i]] == 1) {
+            Vec3d position = positions[atoms_[i]] + pbc_shifts_[i];
+            fixed_x_.push_back(position.x);
+            fixed_y_.push_back(position.y);
+            fixed_z_.push_back(position.z);
+            fixed_es6_.push_back(es6_[i]);
+            fixed_es12_.push_back(es12_[i]);
+        } else {
+            atoms_[n_moving] = atoms_[i];
+            es6_[n_moving] = es6_[i];
+            es12_[n_moving] = es12_[i];
+            pbc_shifts_[n_moving] = pbc_shifts_[i];
+            n_moving++;
+        }
+    }
+    atoms_.resize(n_moving);
+    es6_.resize(n_moving);
+    es12_.resize(n_moving);
+    pbc_shifts_.resize(n_moving);
+}
+
+void LJTipSurfaceInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+    // Only the tip feels the forces of the fixed atoms
+    energies[1] += ljTipKernel(positions[1], fixed_x_.size(), fixed_x_.data(), fixed_y_.data(),
+                               fixed_z_.data(), fixed_es6_.data(), fixed_es12_.data(),
+                               nullptr, nullptr, nullptr, nullptr, forces[1]);
+    if (atoms_.empty()) {
+        return;
+    }
+
+    // Scratch arrays for the coordinates of the moving atoms and the results of each pair
+    static thread_local vector<double> buffer;
+    const int n = atoms_.size();
+    buffer.resize(7 * n);
+    double* x = buffer.data();
+    double* y = x + n;
+    double* z = y + n;
+    double* fx = z + n;
+    double* fy = fx + n;
+    double* fz = fy + n;
+    double* e = fz + n;
+    for (int i = 0; i < n; ++i) {
+        Vec3d position = positions[atoms_[i]] + pbc_shifts_[i];
+        x[i] = position.x;
+        y[i] = position.y;
+        z[i] = position.z;
+    }
+    energies[1] += ljTipKernel(positions[1], n, x, y, z, es6_.data(), es12_.data(),
+                               fx, fy, fz, e, forces[1]);
+    for (int i = 0; i < n; ++i) {
+        energies[atoms_[i]] += e[i];
+        forces[atoms_[i]] -= Vec3d(fx[i], fy[i], fz[i]);
+    }
+}
+
+void LJTipSurfaceInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    const int n_moving = atoms_.size();
+    for (int i = 0; i < n_moving + (int)fixed_x_.size(); ++i) {
+        Vec3d r_vec;
+        double es6, es12;
+        if (i < n_moving) {
+            r_vec = positions[1] - (positions[atoms_[i]] + pbc_shifts_[i]);
+            es6 = es6_[i];
+            es12 = es12_[i];
+        } else {
+            int j = i - n_moving;
+            r_vec = positions[1] - Vec3d(fixed_x_[j], fixed_y_[j], fixed_z_[j]);
+            es6 = fixed_es6_[j];
+            es12 = fixed_es12_[j];
+        }
+        double r_sqr = r_vec.lensqr();
+        double r = sqrt(r_sqr);
+        double r6 = r_sqr * r_sqr * r_sqr;
+        double term_a = es12 / (r6*r6);
+        double term_b = es6 / r6;
+        double du_dr = (-12*term_a + 6*term_b) / r;
+        double d2u_dr2 = (156*term_a - 42*term_b) / r_sqr;
+        addRadialHessian(r_vec, du_dr, d2u_dr2, hessian);
+    }
+}
+
 void MorseInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec3d r_vec = positions[atom_i1_] - (positions[atom_i2_] + pbc_shift_);
     double r = r_vec.len();
@@ -39,6 +164,18 @@ void MorseInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& force
     forces[atom_i2_] -= f;
 }
 
+void MorseInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    if (atom_i1_ != 1 && atom_i2_ != 1) {
+        return;
+    }
+    Vec3d r_vec = positions[atom_i1_] - (positions[atom_i2_] + pbc_shift_);
+    double r = r_vec.len();
+    double d_exp = exp(- a_ * (r - re_));
+    double du_dr = 2 * de_ * a_ * (d_exp - pow(d_exp, 2));
+    double d2u_dr2 = 2 * de_ * a_ * a_ * (2 * pow(d_exp, 2) - d_exp);
+    addRadialHessian(r_vec, du_dr, d2u_dr2, hessian);
+}
+
 void CoulombInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec3d r_vec = positions[atom_i1_] - positions[atom_i2_];
     double r = r_vec.len();
@@ -50,15 +187,220 @@ void CoulombInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& for
     forces[atom_i2_] -= f;
 }
 
-ElectrostaticPotentialInteraction::ElectrostaticPotentialInteraction(const DataGrid<double>& e_potential, double tip_charge, double gaussian_width) {
-    const Vec3i& n_grid = e_potential.getNGrid();
-    const Mat3d& basis = e_potential.getBasis();
-    const Vec3d& origin = e_potential.getOrigin();
+void CoulombInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    if (atom_i1_ != 1 && atom_i2_ != 1) {
+        return;
+    }
+    Vec3d r_vec = positions[atom_i1_] - positions[atom_i2_];
+    double r = r_vec.len();
+    double du_dr = -qq_ / (r*r);
+    double d2u_dr2 = 2 * qq_ / (r*r*r);
+    addRadialHessian(r_vec, du_dr, d2u_dr2, hessian);
+}
+
+// The trees of the moving atoms are updated by each thread separately
+static int maxThreads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+static int threadNumber() {
+#ifdef _OPENMP
+    return omp_get_thread_num();
+#else
+    return 0;
+#endif
+}
+
+TipTreeCoulombInteraction::TipTreeCoulombInteraction(const vector<Vec3d>& positions, const vector<int>& atoms,
+                                                     const vector<double>& charges, const vector<int>& fixed,
+                                                     double qq_tip, double theta):
+        atoms_(atoms), charges_(charges), qq_tip_(qq_tip), tree_(theta) {
+    for (unsigned int k = 0; k < atoms_.size(); ++k) {
+        if (fixed[atoms_[k]] != 1) {
+            moving_.push_back(k);
+        }
+    }
+    tree_.build(positions, atoms_, charges_);
+    if (!moving_.empty()) {
+        thread_trees_.assign(maxThreads(), tree_);
+    }
+}
+
+void TipTreeCoulombInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+    const CoulombTree* tree = &tree_;
+    if (!moving_.empty()) {
+        CoulombTree& thread_tree = thread_trees_[threadNumber()];
+        thread_tree.update(positions);
+        tree = &thread_tree;
+    }
+    Vec3d field(0);
+    double potential = tree->evalField(positions[1], -1, field);
+    energies[1] += qq_tip_ * potential;
+    forces[1] += qq_tip_ * field;
+    // Only the moving atoms need the reaction forces, which are summed directly
+    for (int k : moving_) {
+        Vec3d r_vec = positions[1] - positions[atoms_[k]];
+        double r = r_vec.len();
+        double e = qq_tip_ * charges_[k] / r;
+        energies[atoms_[k]] += e;
+        forces[atoms_[k]] -= e / (r*r) * r_vec;
+    }
+}
+
+void TipTreeCoulombInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    for (unsigned int k = 0; k < atoms_.size(); ++k) {
+        Vec3d r_vec = positions[1] - positions[atoms_[k]];
+        double r = r_vec.len();
+        double qq = qq_tip_ * charges_[k];
+        double du_dr = -qq / (r*r);
+        double d2u_dr2 = 2 * qq / (r*r*r);
+        addRadialHessian(r_vec, du_dr, d2u_dr2, hessian);
+    }
+}
+
+SurfaceTreeCoulombInteraction::SurfaceTreeCoulombInteraction(const vector<Vec3d>& positions, const vector<int>& atoms,
+                                                             const vector<double>& charges, const vector<int>& molecules,
+                                                             const vector<int>& fixed, double qbase, double theta):
+        atoms_(atoms), charges_(charges), molecule_trees_(atoms.size(), -1), qbase_(qbase) {
+    Trees trees;
+    trees.all = CoulombTree(theta);
+    trees.all.build(positions, atoms_, charges_);
+
+    // Gather the atoms of each molecule
+    unordered_map<int, vector<int>> molecule_atoms;
+    for (unsigned int k = 0; k < atoms_.size(); ++k) {
+        molecule_atoms[molecules[k]].push_back(k);
+        if (fixed[atoms_[k]] != 1) {
+            moving_.push_back(k);
+        }
+    }
+    for (const auto& molecule : molecule_atoms) {
+        if (molecule.second.size() < 2) {
+            continue;
+        }
+        vector<int> tree_atoms;
+        vector<double> tree_charges;
+        for (int k : molecule.second) {
+            molecule_trees_[k] = trees.molecules.size();
+            tree_atoms.push_back(atoms_[k]);
+            tree_charges.push_back(charges_[k]);
+        }
+        trees.molecules.emplace_back(theta);
+        trees.molecules.back().build(positions, tree_atoms, tree_charges);
+    }
+    thread_trees_.assign(maxThreads(), trees);
+}
+
+void SurfaceTreeCoulombInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+    if (moving_.empty()) {
+        return;
+    }
+    Trees& trees = thread_trees_[threadNumber()];
+    trees.all.update(positions);
+    for (auto& tree : trees.molecules) {
+        tree.update(positions);
+    }
+    // The forces on the fixed atoms aren't needed
+    for (int k : moving_) {
+        int atom_i = atoms_[k];
+        Vec3d field(0);
+        double potential = trees.all.evalField(positions[atom_i], atom_i, field);
+        if (molecule_trees_[k] >= 0) {
+            Vec3d molecule_field(0);
+            potential -= trees.molecules[molecule_trees_[k]].evalField(positions[atom_i], atom_i, molecule_field);
+            field -= molecule_field;
+        }
+        double qq = qbase_ * charges_[k];
+        energies[atom_i] += qq * potential;
+        forces[atom_i] += qq * field;
+    }
+}
+
+// Builds a periodic force grid from the energy given in k-space. The energy is obtained by
+// inverse FFT and each force component by inverse FFT of the gradient -2 pi i k E(k).
+// temp_kspace is used as temporary storage and must have the same size as energy_kspace.
+static shared_ptr<ForceGrid> buildForceGridFromKspace(const DataGrid<dcomplex>& energy_kspace,
+                                                      DataGrid<dcomplex>& temp_kspace,
+                                                      const Mat3d& basis, const Vec3d& origin) {
+    const Vec3i& n_grid = energy_kspace.getNGrid();
+    const int n_points = n_grid.x * n_grid.y * n_grid.z;
     
-    // Reserve storage space for the force
+    // Do inverse FFT of the energy
+    DataGrid<double> energy;
+    ffti_data_grid(energy_kspace, energy);
+    energy.setOrigin(origin);
+    
+    // The k-vectors of the grid points, the upper half of each axis has negative frequencies.
+    // The Nyquist frequency of an even axis has no pair of opposite sign, so its derivative
+    // would not be real and it is left out of the gradient.
+    const Mat3d& k_basis = energy_kspace.getBasis();
+    vector<Vec3d> ka_vectors(n_grid.x), kb_vectors(n_grid.y), kc_vectors(n_grid.z);
+    for (int ix = 0; ix < n_grid.x; ix++) {
+        ka_vectors[ix] = ix*k_basis.getColumn(0);
+        if (ix > n_grid.x/2)
+            ka_vectors[ix] = ka_vectors[ix] - n_grid.x*k_basis.getColumn(0);
+        if (2*ix == n_grid.x)
+            ka_vectors[ix] = Vec3d(0.0);
+    }
+    for (int iy = 0; iy < n_grid.y; iy++) {
+        kb_vectors[iy] = iy*k_basis.getColumn(1);
+        if (iy > n_grid.y/2)
+            kb_vectors[iy] = kb_vectors[iy] - n_grid.y*k_basis.getColumn(1);
+        if (2*iy == n_grid.y)
+            kb_vectors[iy] = Vec3d(0.0);
+    }
+    for (int iz = 0; iz < n_grid.z; iz++) {
+        kc_vectors[iz] = iz*k_basis.getColumn(2);
+        if (iz > n_grid.z/2)
+            kc_vectors[iz] = kc_vectors[iz] - n_grid.z*k_basis.getColumn(2);
+        if (2*iz == n_grid.z)
+            kc_vectors[iz] = Vec3d(0.0);
+    }
+    
+    // Calculate the components of the force one by one
     DataGrid<Vec3d> force(n_grid.x, n_grid.y, n_grid.z, Vec3d(0.0));
     force.setBasis(basis);
     force.setOrigin(origin);
+    DataGrid<double> temp_rspace;
+    temp_rspace.setOrigin(origin);
+    auto component = [](const Vec3d& v, int c) { return (c == 0) ? v.x : ((c == 1) ? v.y : v.z); };
+    for (int c = 0; c < 3; c++) {
+        for (int ix = 0; ix < n_grid.x; ix++) {
+            for (int iy = 0; iy < n_grid.y; iy++) {
+                for (int iz = 0; iz < n_grid.z; iz++) {
+                    temp_kspace.at(ix, iy, iz) = -2.0*PI*dcomplex(0.0, 1.0)*component(ka_vectors[ix], c)*energy_kspace.at(ix, iy, iz);
+                    temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*component(kb_vectors[iy], c)*energy_kspace.at(ix, iy, iz);
+                    temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*component(kc_vectors[iz], c)*energy_kspace.at(ix, iy, iz);
+                }
+            }
+        }
+        ffti_data_grid(temp_kspace, temp_rspace);
+        for (int ind = 0; ind < n_points; ind++) {
+            Vec3d& f = force.at(ind);
+            (c == 0 ? f.x : (c == 1 ? f.y : f.z)) = temp_rspace.at(ind);
+        }
+    }
+    
+    // Set up the force grid and move the energy and force values to it
+    shared_ptr<ForceGrid> force_grid = make_shared<ForceGrid>();
+    force_grid->setNGrid(n_grid);
+    force_grid->setBasis(basis);
+    force_grid->setOffset(origin);
+    force_grid->setPeriodic(true);
+    force_grid->swapForceValues(force);
+    force_grid->swapEnergyValues(energy);
+    return force_grid;
+}
+
+ElectrostaticPotentialInteraction::ElectrostaticPotentialInteraction(const DataGrid<double>& e_potential, double tip_charge, double gaussian_width):
+        tip_charge_(tip_charge) {
+    const Vec3i& n_grid = e_potential.getNGrid();
+    const Mat3d& basis = e_potential.getBasis();
+    const Vec3d& origin = e_potential.getOrigin();
     
     // Create Gaussian charge distribution of the tip
     DataGrid<double> rho_tip(n_grid.x, n_grid.y, n_grid.z, 0.0);
@@ -99,7 +441,7 @@ ElectrostaticPotentialInteraction::ElectrostaticPotentialInteraction(const DataG
             for (int iz = -z_cutoff; iz < z_cutoff; iz++) {
                 position = rho_tip.positionAt(ix, iy, iz);
                 r_sqr = position.lensqr();
-                rho_tip.atPBC(ix, iy, iz) += tip_charge * gaussian_norm_factor * exp(-0.5*r_sqr/gaussian_width_sqr);
+                rho_tip.atPBC(ix, iy, iz) += gaussian_norm_factor * exp(-0.5*r_sqr/gaussian_width_sqr);
             }
         }
     }
@@ -116,7 +458,7 @@ ElectrostaticPotentialInteraction::ElectrostaticPotentialInteraction(const DataG
             }
         }
         total_charge *= basis.determinant();
-        cout << "Total charge at tip: " << total_charge << endl;
+        cout << "Total charge of the unit tip charge distribution: " << total_charge << endl;
         
         cout << endl <<"========== End debug ==========" << endl << endl;
     }
@@ -145,102 +487,69 @@ ElectrostaticPotentialInteraction::ElectrostaticPotentialInteraction(const DataG
         }
     }
     
-    // To keep up with the progress, create a correctly named reference for the pot_kspace
-    DataGrid<dcomplex>& energy_kspace = pot_kspace;
-    
-    // rho_kspace is not needed anymore, so use it for temporary storage in k-space.
-    // Temporary storage is needed in real space also, but that we have to create.
-    DataGrid<dcomplex>& temp_kspace = rho_kspace;
-    DataGrid<double> temp_rspace;
-    temp_rspace.setOrigin(e_potential.getOrigin());
-    
-    // rho_tip is not needed anymore, so use the reserved memory for storing the energy
-    DataGrid<double>& energy = rho_tip;
-    energy.setOrigin(e_potential.getOrigin());
-    
-    // Do inverse FFT of rho_kspace * pot_kspace to obtain the energy
-    ffti_data_grid(energy_kspace, energy);
-    
-    // Calculate the components of the force one by one
-    vector<Vec3d> ka_vectors, kb_vectors, kc_vectors;
-    ka_vectors.reserve(n_grid.x);
-    kb_vectors.reserve(n_grid.y);
-    kc_vectors.reserve(n_grid.z);
-    for (int ix = 0; ix < n_grid.x; ix++) {
-        ka_vectors[ix] = ix*energy_kspace.getBasis().getColumn(0);
-        if (ix >= int(n_grid.x/2))
-            ka_vectors[ix] = ka_vectors[ix] - n_grid.x*energy_kspace.getBasis().getColumn(0);
-    }
-    for (int iy = 0; iy < n_grid.y; iy++) {
-        kb_vectors[iy] = iy*energy_kspace.getBasis().getColumn(1);
-        if (iy >= int(n_grid.y/2))
-            kb_vectors[iy] = kb_vectors[iy] - n_grid.y*energy_kspace.getBasis().getColumn(1);
-    }
-    for (int iz = 0; iz < n_grid.z; iz++) {
-        kc_vectors[iz] = iz*energy_kspace.getBasis().getColumn(2);
-        if (iz >= int(n_grid.z/2))
-            kc_vectors[iz] = kc_vectors[iz] - n_grid.z*energy_kspace.getBasis().getColumn(2);
-    }
-    
-    // Force x component
-    for (int ix = 0; ix < n_grid.x; ix++) {
-        for (int iy = 0; iy < n_grid.y; iy++) {
-            for (int iz = 0; iz < n_grid.z; iz++) {
-                temp_kspace.at(ix, iy, iz) = -2.0*PI*dcomplex(0.0, 1.0)*ka_vectors[ix].x*energy_kspace.at(ix, iy, iz);
-                temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*kb_vectors[iy].x*energy_kspace.at(ix, iy, iz);
-                temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*kc_vectors[iz].x*energy_kspace.at(ix, iy, iz);
-            }
-        }
+    // rho_tip is not needed anymore, so free its memory for the force grid.
+    // rho_kspace is not needed either, so use it for temporary storage in k-space.
+    {
+        vector<double> released;
+        rho_tip.swapValues(released);
     }
-    ffti_data_grid(temp_kspace, temp_rspace);
-    for (int ind = 0; ind < n_grid.x*n_grid.y*n_grid.z; ind++)
-        force.at(ind).x = temp_rspace.at(ind);
-    
-    // Force y component
-    for (int ix = 0; ix < n_grid.x; ix++) {
-        for (int iy = 0; iy < n_grid.y; iy++) {
-            for (int iz = 0; iz < n_grid.z; iz++) {
-                temp_kspace.at(ix, iy, iz) = -2.0*PI*dcomplex(0.0, 1.0)*ka_vectors[ix].y*energy_kspace.at(ix, iy, iz);
-                temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*kb_vectors[iy].y*energy_kspace.at(ix, iy, iz);
-                temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*kc_vectors[iz].y*energy_kspace.at(ix, iy, iz);
-            }
+    unit_force_grid_ = buildForceGridFromKspace(pot_kspace, rho_kspace, basis, origin);
+}
+
+void ElectrostaticPotentialInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+    Vec3d tip_force;
+    double tip_energy;
+    unit_force_grid_->interpolate(positions[1], tip_force, tip_energy);
+    forces[1] += tip_charge_ * tip_force;
+    energies[1] += tip_charge_ * tip_energy;
+}
+
+void ElectrostaticPotentialInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    Mat3d unit_hessian;
+    unit_force_grid_->addHessian(positions[1], unit_hessian);
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            hessian.at(a, b) += tip_charge_ * unit_hessian.at(a, b);
         }
     }
-    ffti_data_grid(temp_kspace, temp_rspace);
-    for (int ind = 0; ind < n_grid.x*n_grid.y*n_grid.z; ind++)
-        force.at(ind).y = temp_rspace.at(ind);
-    
-    // Force z component
+}
+
+DensityOverlapInteraction::DensityOverlapInteraction(const DataGrid<dcomplex>& sample_kspace, const DataGrid<double>& tip_density,
+                                                     const Vec3d& origin, double prefactor) {
+    const Vec3i& n_grid = tip_density.getNGrid();
+
+    // The overlap is the cross-correlation of the densities, so in k-space the
+    // energy is the sample density times the complex conjugate of the tip density.
+    // Scale the values with the volume unit from the integral.
+    DataGrid<dcomplex> energy_kspace;
+    fft_data_grid(tip_density, energy_kspace);
+    double scaling = prefactor * tip_density.getBasis().determinant();
     for (int ix = 0; ix < n_grid.x; ix++) {
         for (int iy = 0; iy < n_grid.y; iy++) {
             for (int iz = 0; iz < n_grid.z; iz++) {
-                temp_kspace.at(ix, iy, iz) = -2.0*PI*dcomplex(0.0, 1.0)*ka_vectors[ix].z*energy_kspace.at(ix, iy, iz);
-                temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*kb_vectors[iy].z*energy_kspace.at(ix, iy, iz);
-                temp_kspace.at(ix, iy, iz) += -2.0*PI*dcomplex(0.0, 1.0)*kc_vectors[iz].z*energy_kspace.at(ix, iy, iz);
+                dcomplex& value = energy_kspace.at(ix, iy, iz);
+                value = scaling * sample_kspace.at(ix, iy, iz) * conj(value);
             }
         }
     }
-    ffti_data_grid(temp_kspace, temp_rspace);
-    for (int ind = 0; ind < n_grid.x*n_grid.y*n_grid.z; ind++)
-        force.at(ind).z = temp_rspace.at(ind);
-    
-    // Set up force_grid_ and move the energy and force values to it 
-    force_grid_.setNGrid(n_grid);
-    force_grid_.setBasis(basis);
-    force_grid_.setOffset(origin);
-    force_grid_.setPeriodic(true);
-    force_grid_.swapForceValues(force);
-    force_grid_.swapEnergyValues(energy);
+
+    DataGrid<dcomplex> temp_kspace(n_grid.x, n_grid.y, n_grid.z, dcomplex(0.0));
+    temp_kspace.setBasis(energy_kspace.getBasis());
+    force_grid_ = buildForceGridFromKspace(energy_kspace, temp_kspace, tip_density.getBasis(), origin);
 }
 
-void ElectrostaticPotentialInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+void DensityOverlapInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec3d tip_force;
     double tip_energy;
-    force_grid_.interpolate(positions[1], tip_force, tip_energy);
+    force_grid_->interpolate(positions[1], tip_force, tip_energy);
     forces[1] += tip_force;
     energies[1] += tip_energy;
 }
 
+void DensityOverlapInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    force_grid_->addHessian(positions[1], hessian);
+}
+
 void GridInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec3d tip_force;
     double tip_energy;
@@ -249,6 +558,43 @@ void GridInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces
     energies[1] += tip_energy;
 }
 
+void GridInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    force_grid_.addHessian(positions[1], hessian);
+}
+
+void AdaptiveGridInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+    Vec3d tip_force;
+    double tip_energy;
+    grid_.interpolate(positions[1], tip_force, tip_energy);
+    forces[1] += tip_force;
+    energies[1] += tip_energy;
+}
+
+void AdaptiveGridInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    grid_.addHessian(positions[1], hessian);
+}
+
+void FrozenGridInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
+    Vec3d force;
+    double energy;
+    force_grid_->interpolate(positions[atom_i_], force, energy);
+    forces[atom_i_] += scale_ * force;
+    energies[atom_i_] += scale_ * energy;
+}
+
+void FrozenGridInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    if (atom_i_ != 1) {
+        return;
+    }
+    Mat3d atom_hessian;
+    force_grid_->addHessian(positions[1], atom_hessian);
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            hessian.at(a, b) += scale_ * atom_hessian.at(a, b);
+        }
+    }
+}
+
 void TipHarmonicInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec3d r_vec = positions[atom_i1_] - positions[atom_i2_];
     Vec2d r_2d = r_vec.getXY();
@@ -265,6 +611,32 @@ void TipHarmonicInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>&
     forces[atom_i2_] -= f;
 }
 
+void TipHarmonicInteraction::addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+    if (atom_i1_ != 1 && atom_i2_ != 1) {
+        return;
+    }
+    Vec3d r_vec = positions[atom_i1_] - positions[atom_i2_];
+    Vec2d r_2d = r_vec.getXY();
+    double r = r_2d.len();
+    // The spring only acts in the xy-plane. At zero separation the radial
+    // direction is undefined and the limit of an isotropic spring is used.
+    if (r < TOLERANCE) {
+        hessian.at(0, 0) += 2 * k_;
+        hessian.at(1, 1) += 2 * k_;
+        return;
+    }
+    double dr = r - r0_;
+    Vec2d r_unit = r_2d / r;
+    double r_vec_c[2] = {r_unit.x, r_unit.y};
+    for (int a = 0; a < 2; ++a) {
+        for (int b = 0; b < 2; ++b) {
+            double rr = r_vec_c[a] * r_vec_c[b];
+            double delta = (a == b) ? 1.0 : 0.0;
+            hessian.at(a, b) += 2 * k_ * rr + 2 * k_ * dr / r * (delta - rr);
+        }
+    }
+}
+
 void XYHarmonicInteraction::eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const {
     Vec2d r_2d = positions[atom_i_].getXY() - p0_;
     double r = r_2d.len();
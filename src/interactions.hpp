@@ -8,9 +8,12 @@
 #include <unordered_set>
 #include <vector>
 
+#include "adaptive_grid.hpp"
+#include "coulomb_tree.hpp"
 #include "data_grid.hpp"
 #include "force_grid.hpp"
 #include "globals.hpp"
+#include "matrices.hpp"
 #include "vectors.hpp"
 
 class System;
@@ -72,6 +75,12 @@ class Interaction {
     virtual void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const = 0;
     // Return whether the interaction is between the tip and the surface or not
     virtual bool isTipSurface() const = 0;
+    // Adds the second derivatives of the interaction energy with respect to the tip
+    // position to hessian. Interactions that don't involve the tip add nothing.
+    virtual void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const {
+        (void)positions;
+        (void)hessian;
+    };
  private:
 };
 
@@ -83,6 +92,7 @@ class LJInteraction: public Interaction {
     LJInteraction(int atom_i1, int atom_i2, double es6, double es12, Vec3d pbc_shift = Vec3d(0)):
         atom_i1_(atom_i1), atom_i2_(atom_i2), es6_(es6), es12_(es12), pbc_shift_(pbc_shift) {};
     void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
     bool isTipSurface() const override {
         // The interactions are build such that this holds
         return atom_i1_ == 1;
@@ -97,6 +107,36 @@ class LJInteraction: public Interaction {
 };
 
 
+// The Lennard-Jones interactions of the tip atom with the surface atoms evaluated
+// together by the vectorised kernel
+class LJTipSurfaceInteraction: public Interaction {
+ public:
+    LJTipSurfaceInteraction() {};
+    // Adds the pair of the tip atom with the surface atom atom_i
+    void addPair(int atom_i, double es6, double es12, Vec3d pbc_shift = Vec3d(0));
+    // Stores the positions of the fixed surface atoms, which are then neither read from
+    // the state vectors nor given forces and energies (fixed == 1 in System::fixed_)
+    void cacheFixedAtoms(const vector<Vec3d>& positions, const vector<int>& fixed);
+    int size() const { return atoms_.size() + fixed_x_.size(); };
+    void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
+    bool isTipSurface() const override {
+        return true;
+    }
+
+ private:
+    // The pairs with surface atoms that can move
+    vector<int> atoms_;  // Indices of the surface atoms in the state vectors
+    vector<double> es6_;
+    vector<double> es12_;
+    vector<Vec3d> pbc_shifts_;
+    // The pairs with fixed surface atoms, coordinates including the shifts
+    vector<double> fixed_x_, fixed_y_, fixed_z_;
+    vector<double> fixed_es6_;
+    vector<double> fixed_es12_;
+};
+
+
 class MorseInteraction: public Interaction {
  public:
     MorseInteraction():
@@ -104,6 +144,7 @@ class MorseInteraction: public Interaction {
     MorseInteraction(int atom_i1, int atom_i2, double de, double a, double re, Vec3d pbc_shift = Vec3d(0)):
         atom_i1_(atom_i1), atom_i2_(atom_i2), de_(de), a_(a), re_(re), pbc_shift_(pbc_shift) {};
     void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
     bool isTipSurface() const override {
         // The interactions are build such that this holds
         return atom_i1_ == 1;
@@ -125,6 +166,7 @@ class CoulombInteraction: public Interaction {
     CoulombInteraction(int atom_i1, int atom_i2, double qq):
         atom_i1_(atom_i1), atom_i2_(atom_i2), qq_(qq) {};
     void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
     bool isTipSurface() const override {
         // The interactions are build such that this holds
         return atom_i1_ == 1;
@@ -137,6 +179,61 @@ class CoulombInteraction: public Interaction {
 };
 
 
+// The Coulomb interaction of the tip atom with the charged surface atoms, where the
+// field at the tip is evaluated with a Barnes-Hut tree
+class TipTreeCoulombInteraction: public Interaction {
+ public:
+    // qq_tip is the Coulomb constant qbase times the charge of the tip and fixed tells
+    // which atoms don't move (fixed == 1 in System::fixed_)
+    TipTreeCoulombInteraction(const vector<Vec3d>& positions, const vector<int>& atoms,
+                              const vector<double>& charges, const vector<int>& fixed,
+                              double qq_tip, double theta);
+    void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
+    bool isTipSurface() const override {
+        return true;
+    }
+
+ private:
+    vector<int> atoms_;  // Atom indices in the state vectors
+    vector<double> charges_;
+    vector<int> moving_;  // The atoms that aren't fixed (indices to atoms_)
+    double qq_tip_;
+    CoulombTree tree_;
+    mutable vector<CoulombTree> thread_trees_;  // Updated by each thread if atoms move
+};
+
+
+// The Coulomb interactions between the charged surface atoms evaluated with Barnes-Hut
+// trees. Atoms of the same molecule don't interact, which is taken into account by
+// subtracting the field of the molecule from the field of all the atoms.
+class SurfaceTreeCoulombInteraction: public Interaction {
+ public:
+    // molecules gives the molecule of each atom and fixed tells which atoms don't move
+    // (fixed == 1 in System::fixed_)
+    SurfaceTreeCoulombInteraction(const vector<Vec3d>& positions, const vector<int>& atoms,
+                                  const vector<double>& charges, const vector<int>& molecules,
+                                  const vector<int>& fixed, double qbase, double theta);
+    void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    bool isTipSurface() const override {
+        return false;
+    }
+
+ private:
+    struct Trees {
+        CoulombTree all;
+        vector<CoulombTree> molecules;  // Molecules of more than one charged atom
+    };
+
+    vector<int> atoms_;  // Atom indices in the state vectors
+    vector<double> charges_;
+    vector<int> molecule_trees_;  // Tree of the molecule of each atom (-1 = none)
+    vector<int> moving_;  // The atoms that aren't fixed (indices to atoms_)
+    double qbase_;
+    mutable vector<Trees> thread_trees_;  // Each thread updates its own trees
+};
+
+
 /** \brief Represents interaction between tip and an electrostatic potential.
  * 
  * The ElectrostaticPotentialInteraction class is similar to the GridInteraction class,
@@ -146,6 +243,9 @@ class CoulombInteraction: public Interaction {
  * the tip and the electrostatic potential using FFT. For more information, see
  * the supplementary material of http://dx.doi.org/10.1103/PhysRevLett.113.226101
  * 
+ * The force grid is computed for a unit tip charge and scaled with the charge of
+ * the tip, so tips with different charges can share the same grid.
+ * 
  */ 
 class ElectrostaticPotentialInteraction: public Interaction {
  public:
@@ -155,12 +255,55 @@ class ElectrostaticPotentialInteraction: public Interaction {
      *  charge distribution at the tip.
      */
     ElectrostaticPotentialInteraction(const DataGrid<double>& e_potential, double tip_charge, double gaussian_width);
+    /**
+     *  Shares the unit charge force grid of an existing interaction for a tip
+     *  with charge tip_charge.
+     */
+    ElectrostaticPotentialInteraction(shared_ptr<const ForceGrid> unit_force_grid, double tip_charge):
+        unit_force_grid_(unit_force_grid), tip_charge_(tip_charge) {};
     void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
     bool isTipSurface() const override {
         return true;
     }
+    // Returns the force grid computed for a unit tip charge
+    shared_ptr<const ForceGrid> getUnitForceGrid() const { return unit_force_grid_; }
  private:
-    ForceGrid force_grid_; // Force grid containing samples of the energy and force on tip due to electrostatic potential
+    shared_ptr<const ForceGrid> unit_force_grid_; // Force grid containing samples of the energy and force on a unit charge due to electrostatic potential
+    double tip_charge_;
+};
+
+
+/** \brief Represents the Pauli repulsion between the tip and the sample.
+ *
+ * The repulsion is modelled by the overlap of the electron densities of the
+ * sample and the tip, E(R) = A * integral rho_sample(r)^B rho_tip(r - R) dr,
+ * see Ellner et al., ACS Nano 13, 786 (2019). The overlap is evaluated for all
+ * tip positions at once as a cross-correlation using FFT and stored to a force
+ * grid like for the ElectrostaticPotentialInteraction.
+ *
+ */
+class DensityOverlapInteraction: public Interaction {
+ public:
+    /**
+     *  sample_kspace is the FFT of rho_sample^B and tip_density is the density
+     *  of the tip on the same grid, with the tip atom at the grid origin and
+     *  wrapped periodically. prefactor is the constant A.
+     */
+    DensityOverlapInteraction(const DataGrid<complex<double>>& sample_kspace, const DataGrid<double>& tip_density,
+                              const Vec3d& origin, double prefactor);
+    /**
+     *  Shares the force grid of an existing interaction.
+     */
+    DensityOverlapInteraction(shared_ptr<const ForceGrid> force_grid): force_grid_(force_grid) {};
+    void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
+    bool isTipSurface() const override {
+        return true;
+    }
+    shared_ptr<const ForceGrid> getForceGrid() const { return force_grid_; }
+ private:
+    shared_ptr<const ForceGrid> force_grid_; // Force grid containing samples of the overlap energy and force
 };
 
 
@@ -168,6 +311,7 @@ class GridInteraction: public Interaction {
  public:
     GridInteraction(ForceGrid& fg): force_grid_(fg) {};
     void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
     bool isTipSurface() const override {
         return true;
     }
@@ -177,6 +321,45 @@ class GridInteraction: public Interaction {
 };
 
 
+class AdaptiveGridInteraction: public Interaction {
+ public:
+    AdaptiveGridInteraction(AdaptiveForceGrid& grid): grid_(grid) {};
+    void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
+    bool isTipSurface() const override {
+        return true;
+    }
+
+ private:
+    AdaptiveForceGrid grid_; // The adaptive grid containing the samples
+};
+
+
+/** \brief Represents the interactions of a single atom with the frozen atoms.
+ *
+ * The frozen atoms never move, so their interactions with an atom only depend
+ * on the position of the atom and are sampled to a force grid once. The grid
+ * is shared by the atoms of the same type, or by all the charged atoms when it
+ * holds the Coulomb interactions of a unit charge, which are scaled by the charge
+ * of the atom.
+ */
+class FrozenGridInteraction: public Interaction {
+ public:
+    FrozenGridInteraction(shared_ptr<const ForceGrid> force_grid, int atom_i, double scale):
+        force_grid_(force_grid), atom_i_(atom_i), scale_(scale) {};
+    void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
+    bool isTipSurface() const override {
+        return atom_i_ == 1;
+    }
+
+ private:
+    shared_ptr<const ForceGrid> force_grid_;
+    int atom_i_;  // Atom index in the state vectors
+    double scale_;
+};
+
+
 class TipHarmonicInteraction: public Interaction {
  public:
     TipHarmonicInteraction():
@@ -184,6 +367,7 @@ class TipHarmonicInteraction: public Interaction {
     TipHarmonicInteraction(int atom_i1, int atom_i2, double k, double r0):
         atom_i1_(atom_i1), atom_i2_(atom_i2), k_(k), r0_(r0) {};
     void eval(const vector<Vec3d>& positions, vector<Vec3d>& forces, vector<double>& energies) const override;
+    void addTipHessian(const vector<Vec3d>& positions, Mat3d& hessian) const override;
     bool isTipSurface() const override {
         return false;
     }
@@ -0,0 +1,134 @@
+#include "kernels.hpp"
+
+#include <stdexcept>
+#include <string>
+
+// The variants for wider vectors need the target attributes and CPU detection of GCC
+// and Clang on x86
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define X86_DISPATCH 1
+    #define KERNEL_BODY inline __attribute__((always_inline))
+#else
+    #define X86_DISPATCH 0
+    #define KERNEL_BODY inline
+#endif
+
+using namespace std;
+
+
+IsaVariant detectIsa() {
+#if X86_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return ISA_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return ISA_AVX2;
+    }
+#endif
+    return ISA_GENERIC;
+}
+
+
+static IsaVariant selected_isa = detectIsa();
+
+
+void selectIsa(IsaVariant isa) {
+    IsaVariant detected = detectIsa();
+    if (isa == ISA_AUTO) {
+        isa = detected;
+    }
+    // The variants are ordered from the most to the least portable
+    if (isa > detected) {
+        throw runtime_error(string("The processor doesn't support the ") + isaName(isa) +
+                            " variant of the kernels");
+    }
+    selected_isa = isa;
+}
+
+
+IsaVariant selectedIsa() {
+    return selected_isa;
+}
+
+
+const char* isaName(IsaVariant isa) {
+    switch (isa) {
+        case ISA_AUTO: return "auto";
+        case ISA_GENERIC: return "generic";
+        case ISA_AVX2: return "avx2";
+        case ISA_AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+
+// The bodies of the kernels are inlined into a function for each variant, which lets
+// the compiler vectorise them for the instruction set of that variant
+
+template<bool store_pairs>
+static KERNEL_BODY double ljTipBody(const Vec3d& tip, int n, const double* x, const double* y,
+                                    const double* z, const double* es6, const double* es12,
+                                    double* fx, double* fy, double* fz, double* e,
+                                    Vec3d& tip_force) {
+    const double tip_x = tip.x;
+    const double tip_y = tip.y;
+    const double tip_z = tip.z;
+    double sum_fx = 0, sum_fy = 0, sum_fz = 0, sum_e = 0;
+#pragma omp simd reduction(+:sum_fx, sum_fy, sum_fz, sum_e)
+    for (int i = 0; i < n; ++i) {
+        double dx = tip_x - x[i];
+        double dy = tip_y - y[i];
+        double dz = tip_z - z[i];
+        // One division per pair, which bounds the throughput
+        double inv_r_sqr = 1.0 / (dx*dx + dy*dy + dz*dz);
+        double inv_r6 = inv_r_sqr * inv_r_sqr * inv_r_sqr;
+        double term_a = es12[i] * inv_r6 * inv_r6;
+        double term_b = es6[i] * inv_r6;
+        double f_r = (12*term_a - 6*term_b) * inv_r_sqr;
+        if (store_pairs) {
+            fx[i] = f_r * dx;
+            fy[i] = f_r * dy;
+            fz[i] = f_r * dz;
+            e[i] = term_a - term_b;
+        }
+        sum_fx += f_r * dx;
+        sum_fy += f_r * dy;
+        sum_fz += f_r * dz;
+        sum_e += term_a - term_b;
+    }
+    tip_force += Vec3d(sum_fx, sum_fy, sum_fz);
+    return sum_e;
+}
+
+#define LJ_TIP_ARGS const Vec3d& tip, int n, const double* x, const double* y, const double* z, \
+                    const double* es6, const double* es12, double* fx, double* fy, double* fz, \
+                    double* e, Vec3d& tip_force
+#define LJ_TIP_CALL(store_pairs) \
+    ljTipBody<store_pairs>(tip, n, x, y, z, es6, es12, fx, fy, fz, e, tip_force)
+
+static double ljTipGeneric(LJ_TIP_ARGS) {
+    return (fx != nullptr) ? LJ_TIP_CALL(true) : LJ_TIP_CALL(false);
+}
+
+#if X86_DISPATCH
+__attribute__((target("avx2,fma")))
+static double ljTipAvx2(LJ_TIP_ARGS) {
+    return (fx != nullptr) ? LJ_TIP_CALL(true) : LJ_TIP_CALL(false);
+}
+
+__attribute__((target("avx512f,prefer-vector-width=512")))
+static double ljTipAvx512(LJ_TIP_ARGS) {
+    return (fx != nullptr) ? LJ_TIP_CALL(true) : LJ_TIP_CALL(false);
+}
+#endif
+
+double ljTipKernel(LJ_TIP_ARGS) {
+    switch (selected_isa) {
+#if X86_DISPATCH
+        case ISA_AVX512: return ljTipAvx512(tip, n, x, y, z, es6, es12, fx, fy, fz, e, tip_force);
+        case ISA_AVX2: return ljTipAvx2(tip, n, x, y, z, es6, es12, fx, fy, fz, e, tip_force);
+#endif
+        default: return ljTipGeneric(tip, n, x, y, z, es6, es12, fx, fy, fz, e, tip_force);
+    }
+}
@@ -0,0 +1,35 @@
+/*
+ * kernels.hpp
+ *
+ * The vectorised kernels are compiled for several instruction sets and the
+ * best variant supported by the processor is selected at startup, so that the
+ * same binary runs on every machine of a mixed cluster. Only the pair loops
+ * gain from wider vectors: the FFT passes and the force grid lookups ran no
+ * faster when compiled for AVX2 or AVX-512, so they have a single variant.
+ *
+ */
+
+#pragma once
+
+#include "vectors.hpp"
+
+using namespace std;
+
+// Defines the instruction set variants of the kernels
+enum IsaVariant {ISA_AUTO, ISA_GENERIC, ISA_AVX2, ISA_AVX512};
+
+// Returns the best variant supported by the processor
+IsaVariant detectIsa();
+// Selects the variant used by the kernels, ISA_AUTO selects the detected one. Throws
+// runtime_error if the processor doesn't support the variant.
+void selectIsa(IsaVariant isa);
+// Returns the variant used by the kernels
+IsaVariant selectedIsa();
+const char* isaName(IsaVariant isa);
+
+// Evaluates the Lennard-Jones pairs of the tip atom at tip with the n atoms at x, y, z.
+// Writes the force on the tip and the energy of each pair to fx, fy, fz and e unless they
+// are null, adds the total force on the tip to tip_force and returns the total energy.
+double ljTipKernel(const Vec3d& tip, int n, const double* x, const double* y, const double* z,
+                   const double* es6, const double* es12, double* fx, double* fy, double* fz,
+                   double* e, Vec3d& tip_force);
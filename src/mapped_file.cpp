@@ -0,0 +1,67 @@
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+
+
+MappedFile::MappedFile(const string& filepath): data_(nullptr), size_(0), mapped_(false) {
+#ifndef _WIN32
+    int fd = open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("No such file: " + filepath);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
+        throw runtime_error("Cannot read " + filepath + ": " + strerror(errno));
+    }
+    size_ = file_stat.st_size;
+    // Empty files can't be mapped, they are simply empty
+    if (size_ > 0) {
+        void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Cannot map " + filepath + ": " + strerror(errno));
+        }
+        // The file is read from start to end
+        madvise(map, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(map);
+        mapped_ = true;
+    }
+    close(fd);
+#else
+    FILE* fp = fopen(filepath.c_str(), "rb");
+    if (fp == NULL) {
+        throw runtime_error("No such file: " + filepath);
+    }
+    fseek(fp, 0, SEEK_END);
+    size_ = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buffer_.resize(size_);
+    if (size_ > 0 && fread(buffer_.data(), 1, size_, fp) != size_) {
+        fclose(fp);
+        throw runtime_error("Cannot read " + filepath);
+    }
+    fclose(fp);
+    data_ = buffer_.data();
+#endif
+}
+
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (mapped_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ * mapped_file.hpp
+ *
+ * MappedFile gives read access to the contents of a whole file. The file is
+ * memory mapped where possible, so large files are read by the page cache on
+ * demand instead of being copied. On Windows the file is read to memory.
+ *
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** \brief A read-only view of a whole file.
+ *
+ * Throws a runtime_error if the file can't be opened or mapped.
+ */
+
+class MappedFile {
+public:
+    MappedFile(const string& filepath);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; };
+    size_t size() const { return size_; };
+
+private:
+    const char* data_;
+    size_t size_;
+    bool mapped_;
+    vector<char> buffer_;  // Contents of the file when it isn't mapped
+};
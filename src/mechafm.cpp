@@ -20,11 +20,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#ifdef _WIN32
+    #include <windows.h>
+#endif
 #if MPI_BUILD
     #include <mpi.h>
 #endif
+#include <algorithm>
 #include <chrono>
+#include <utility>
+#include <vector>
 
 #include "globals.hpp"
 #include "messages.hpp"
@@ -44,6 +51,7 @@ void openUniverse(Simulation& simulation) {
 
     // How many points to compute the tip relaxation on
     simulation.n_total_ = 0;
+    simulation.n_hysteresis_ = 0;
     simulation.n_points_.x = floor(simulation.options_.area.x / options.dx) + 1;
     simulation.n_points_.y = floor(simulation.options_.area.y / options.dy) + 1;
     simulation.n_points_.z = floor((options.zhigh - options.zlow) / options.dz) + 1;
@@ -52,27 +60,52 @@ void openUniverse(Simulation& simulation) {
               simulation.n_points_.x, simulation.n_points_.y,
               simulation.n_points_.z, n);
 
+    // With multiple tips, each tip gets its own output folder [ONLY ON ROOT PROCESS]
+    int n_tips = options.tipatoms.size();
+    if (n_tips > 1 && simulation.rootProcess()) {
+        for (int t = 0; t < n_tips; ++t) {
+            string folder = simulation.tipOutputFolder(t);
+#ifdef _WIN32
+            CreateDirectory(folder.c_str(), NULL);
+#else
+            string dir_cmd = "mkdir -p " + folder;
+            system(dir_cmd.c_str());
+#endif
+        }
+    }
+
 #if MPI_BUILD
     MPI_Barrier(simulation.universe);
 #endif
 
-    // Open all the file streams (one for every z point) [ONLY ON ROOT PROCESS]
+    // Open all the file streams (one for every tip, branch and z point) [ONLY ON ROOT PROCESS]
     if (simulation.rootProcess()) {
-        simulation.fstreams_.reserve(simulation.n_points_.z + 1);
-        for (int i = 0; i <= simulation.n_points_.z - 1; ++i) {
-            z = options.zhigh - i*options.dz;
-            if (options.gzip) {
-                sprintf(outfile, "gzip -6 > %sscan-%06.3f.dat.gz",
-                        simulation.options_.outputfolder.c_str(), z);
-                simulation.fstreams_.push_back(popen(outfile, "w"));
-            }
-            else {
-                sprintf(outfile, "%sscan-%06.3f.dat",
-                        simulation.options_.outputfolder.c_str(), z);
-                simulation.fstreams_.push_back(fopen(outfile, "w"));
+        int n_branches = options.retract ? 2 : 1;
+        simulation.fstreams_.reserve(n_tips * n_branches * simulation.n_points_.z + 1);
+        for (int t = 0; t < n_tips; ++t) {
+            string folder = simulation.tipOutputFolder(t);
+            for (int b = 0; b < n_branches; ++b) {
+                const char* prefix = (b == RETRACT) ? "retract" : "scan";
+                for (int i = 0; i <= simulation.n_points_.z - 1; ++i) {
+                    z = options.zhigh - i*options.dz;
+                    if (options.gzip) {
+                        sprintf(outfile, "gzip -6 > %s%s-%06.3f.dat.gz",
+                                folder.c_str(), prefix, z);
+                        simulation.fstreams_.push_back(popen(outfile, "w"));
+                    }
+                    else {
+                        sprintf(outfile, "%s%s-%06.3f.dat",
+                                folder.c_str(), prefix, z);
+                        simulation.fstreams_.push_back(fopen(outfile, "w"));
+                    }
+                }
             }
         }
+        // The binary result stream, if any
+        simulation.openStream();
     }
+    // The relaxed structures are recorded by every process
+    simulation.openTrajectory();
 
     // Note the time
     simulation.time_start_ = chrono::system_clock::now();
@@ -96,7 +129,10 @@ void closeUniverse(Simulation& simulation) {
                 fclose(file);
             }
         }
+        // The end of the result stream tells that the files are complete
+        simulation.closeStream();
     }
+    simulation.closeTrajectory();
     return;
 }
 
@@ -120,20 +156,41 @@ void finalize(Simulation& simulation) {
     // Collect number of steps from all processes
     unsigned long nsum = 0;
 #if MPI_BUILD
-    MPI_Reduce(&simulation.n_total_, &nsum, 1, MPI_INT, MPI_SUM, simulation.root_process_,
+    MPI_Reduce(&simulation.n_total_, &nsum, 1, MPI_UNSIGNED_LONG, MPI_SUM, simulation.root_process_,
                                                                  simulation.universe);
 #else
     nsum += simulation.n_total_;
 #endif
 
+    // Collect number of hysteresis points from all processes
+    unsigned long hsum = 0;
+#if MPI_BUILD
+    MPI_Reduce(&simulation.n_hysteresis_, &hsum, 1, MPI_UNSIGNED_LONG, MPI_SUM,
+               simulation.root_process_, simulation.universe);
+#else
+    hsum += simulation.n_hysteresis_;
+#endif
+
     // Print some miscelleneous information
     pretty_print("Simulation run finished");
     pretty_print("Statistics:");
-    int n_points = (simulation.n_points_.x) * (simulation.n_points_.y) * (simulation.n_points_.z);
-    pretty_print("    Computed %d tip positions", n_points);
+    int n_tips = simulation.options_.tipatoms.size();
+    int n_points = n_tips * (simulation.n_points_.x) * (simulation.n_points_.y) * (simulation.n_points_.z);
+    int n_retract_points = 0;
+    if (simulation.options_.retract) {
+        n_retract_points = n_tips * (simulation.n_points_.x) * (simulation.n_points_.y) * (simulation.n_points_.z - 1);
+    }
+    pretty_print("    Computed %d tip positions", n_points + n_retract_points);
+    if (n_tips > 1) {
+        pretty_print("    For %d different tips", n_tips);
+    }
+    if (simulation.options_.retract) {
+        pretty_print("    Of which %d on the retract branch", n_retract_points);
+        pretty_print("    Approach and retract forces differ by more than ftol at %ld points", hsum);
+    }
     pretty_print("    Needed %ld minimization steps in total", nsum);
     pretty_print("    Which means approximately %.2f minimization steps per tip position",
-                                                                ((double) nsum / n_points));
+                                                                ((double) nsum / (n_points + n_retract_points)));
     pretty_print("    The simulation wall time is %.2f seconds", timesum.count());
     pretty_print("    The entire simulation took %.2f seconds", dtime.count());
     pretty_print("");
@@ -142,10 +199,17 @@ void finalize(Simulation& simulation) {
         FILE* fp = fopen(file_path.c_str(), "w");
         fprintf(fp, "Simulation run finished\n");
         fprintf(fp, "Statistics:\n");
-        fprintf(fp, "    Computed %d tip positions\n", n_points);
+        fprintf(fp, "    Computed %d tip positions\n", n_points + n_retract_points);
+        if (n_tips > 1) {
+            fprintf(fp, "    For %d different tips\n", n_tips);
+        }
+        if (simulation.options_.retract) {
+            fprintf(fp, "    Of which %d on the retract branch\n", n_retract_points);
+            fprintf(fp, "    Approach and retract forces differ by more than ftol at %ld points\n", hsum);
+        }
         fprintf(fp, "    Needed %ld minimization steps in total\n", nsum);
         fprintf(fp, "    Which means approximately %.2f minimization steps per tip position\n",
-                                                                ((double) nsum / n_points));
+                                                                ((double) nsum / (n_points + n_retract_points)));
         fprintf(fp, "    The simulation wall time is %.2f seconds\n", timesum.count());
         fprintf(fp, "    The entire simulation took %.2f seconds\n", dtime.count());
         fclose(fp);
@@ -154,17 +218,27 @@ void finalize(Simulation& simulation) {
 }
 
 // Initialize our parallel world
-void openParallelUniverse(int argc, char *argv[], Simulation& simulation) {
+void openParallelUniverse(int argc, char *argv[]) {
     (void)argc;
     (void)argv;
 #if MPI_BUILD
     // Start MPI
-    MPI_Init(&argc,&argv);
+    // The output is written and sent by one thread at a time
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_SERIALIZED, &provided);
+    if (provided < MPI_THREAD_SERIALIZED) {
+        fprintf(stderr, "+- ERROR: The MPI library doesn't support MPI_THREAD_SERIALIZED!\n");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 #endif
+    return;
+}
+
+// Join the universe of the simulation, which is set before with MPI
+void joinUniverse(Simulation& simulation) {
     // Determine the size of the universe and which process we are on
     simulation.root_process_ = 0;
 #if MPI_BUILD
-    simulation.universe = MPI_COMM_WORLD;
     MPI_Comm_rank(simulation.universe, &simulation.current_process_);
     MPI_Comm_size(simulation.universe, &simulation.n_processes_);
 #else
@@ -179,8 +253,8 @@ void openParallelUniverse(int argc, char *argv[], Simulation& simulation) {
     return;
 }
 
-// Terminate our parallel worlds
-void closeParallelUniverse(Simulation& simulation) {
+// Report how the work was shared in the universe of the simulation
+void leaveUniverse(Simulation& simulation) {
 
     // How many x,y points on each process
 #if MPI_BUILD
@@ -198,7 +272,11 @@ void closeParallelUniverse(Simulation& simulation) {
     for (int i = 0; i < simulation.n_processes_; ++i) {
         pretty_print("    Process %2d: %6d x,y points", i, pop[i]);
     }
+    return;
+}
 
+// Terminate our parallel worlds
+void closeParallelUniverse() {
 #if MPI_BUILD
     // Close MPI
     MPI_Finalize();
@@ -206,14 +284,10 @@ void closeParallelUniverse(Simulation& simulation) {
     return;
 }
 
-int main(int argc, char *argv[]) {
-    Simulation simulation;
-
-    // Set up the parallel routines
-    openParallelUniverse(argc, argv, simulation);
+// Run a scan whose input file and output folder are set
+void runScan(Simulation& simulation) {
 
     // Initialize the simulation
-    parseCommandLine(argc, argv, simulation);
     readInputFile(simulation);
     readXYZFile(simulation);
     readParameterFile(simulation);
@@ -222,12 +296,172 @@ int main(int argc, char *argv[]) {
     openUniverse(simulation);
     simulation.initialize();
     simulation.run();
+    simulation.writeVolumes();
     closeUniverse(simulation);
 
     // Some final thoughts
     finalize(simulation);
+    leaveUniverse(simulation);
+    return;
+}
+
+// Divide the processes between the groups in proportion to the costs of the scans they
+// start with, giving every group at least one process
+vector<int> groupSizes(const vector<CampaignScan>& scans, int n_groups, int n_processes) {
+    double cost_sum = 0;
+    for (int g = 0; g < n_groups; ++g) {
+        cost_sum += scans[g].cost;
+    }
+    vector<int> sizes(n_groups, 1);
+    vector<pair<double, int>> remainders(n_groups);
+    int n_spare = n_processes - n_groups;
+    int n_left = n_spare;
+    for (int g = 0; g < n_groups; ++g) {
+        double share = n_spare * scans[g].cost / cost_sum;
+        sizes[g] += floor(share);
+        n_left -= floor(share);
+        remainders[g] = make_pair(share - floor(share), -g);
+    }
+    // The processes left over go to the largest remainders
+    sort(remainders.rbegin(), remainders.rend());
+    for (int i = 0; i < n_left; ++i) {
+        sizes[-remainders[i].second] += 1;
+    }
+    return sizes;
+}
+
+// Run many scans in one job. The processes are split into groups that each run one scan
+// at a time, starting from the most expensive ones, and take the next scan in the queue
+// whenever they finish.
+void runCampaign(int argc, char *argv[]) {
+    int n_world = 1;
+    int world_process = 0;
+#if MPI_BUILD
+    MPI_Comm_rank(MPI_COMM_WORLD, &world_process);
+    MPI_Comm_size(MPI_COMM_WORLD, &n_world);
+#endif
+    if (world_process == 0) {
+        printBanner();
+    }
+    if (argc < 3) {
+        error("Specify a campaign file to be read!");
+    } else if (argc > 4) {
+        error("Too many command line arguments!");
+    }
+    // An error in one group has to stop the others as well
+    abortOnError(true);
+
+    vector<CampaignScan> scans = readCampaignFile(argv[2]);
+    stable_sort(scans.begin(), scans.end(),
+                [](const CampaignScan& a, const CampaignScan& b) { return a.cost > b.cost; });
+    int n_scans = scans.size();
+    int n_groups = min(n_scans, n_world);
+    if (argc == 4) {
+        n_groups = atoi(argv[3]);
+        if (n_groups < 1 || n_groups > min(n_scans, n_world)) {
+            error("The number of groups must be between 1 and %d!", min(n_scans, n_world));
+        }
+    }
+    vector<int> sizes = groupSizes(scans, n_groups, n_world);
+    int group = 0;
+    for (int first = 0; world_process >= first + sizes[group]; ++group) {
+        first += sizes[group];
+    }
+    pretty_print("Running a campaign of %d scans with %d groups of processes", n_scans, n_groups);
+    for (int g = 0; g < n_groups; ++g) {
+        pretty_print("    Group %2d: %4d processes", g, sizes[g]);
+    }
+    pretty_print("");
+    fflush(stdout);
+
+#if MPI_BUILD
+    MPI_Comm group_universe;
+    MPI_Comm_split(MPI_COMM_WORLD, group, world_process, &group_universe);
+    // The index of the next scan in the queue is kept on the root process and the groups
+    // take scans from it with atomic increments
+    int* next_scan;
+    MPI_Win queue;
+    MPI_Win_allocate((world_process == 0) ? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL,
+                     MPI_COMM_WORLD, &next_scan, &queue);
+    if (world_process == 0) {
+        MPI_Win_lock(MPI_LOCK_EXCLUSIVE, 0, 0, queue);
+        *next_scan = n_groups;
+        MPI_Win_unlock(0, queue);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+#endif
+
+    // Each group starts with the scan of the same number
+    int scan = group;
+    while (scan < n_scans) {
+        Simulation simulation;
+#if MPI_BUILD
+        simulation.universe = group_universe;
+#endif
+        joinUniverse(simulation);
+        setScanFiles(simulation, scans[scan].inputfile, scans[scan].outputfolder);
+        simulation.options_.campaign = true;
+
+        // The messages of the scan go to a log file in its output folder
+        FILE* log = NULL;
+        if (simulation.rootProcess()) {
+            string log_path = simulation.options_.outputfolder + "mechafm.log";
+            log = fopen(log_path.c_str(), "w");
+            if (log == NULL) {
+                error("Cannot open the log file %s!", log_path.c_str());
+            }
+            fprintf(stdout, "+- Group %d started the scan %s\n", group, scans[scan].inputfile.c_str());
+            fflush(stdout);
+            redirectMessages(log);
+        }
+        runScan(simulation);
+        if (simulation.rootProcess()) {
+            redirectMessages(NULL);
+            fclose(log);
+            fprintf(stdout, "+- Group %d finished the scan %s\n", group, scans[scan].inputfile.c_str());
+            fflush(stdout);
+        }
+
+        // Take the next scan from the queue
+#if MPI_BUILD
+        if (simulation.rootProcess()) {
+            int one = 1;
+            MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, queue);
+            MPI_Fetch_and_op(&one, &scan, MPI_INT, 0, 0, MPI_SUM, queue);
+            MPI_Win_unlock(0, queue);
+        }
+        MPI_Bcast(&scan, 1, MPI_INT, simulation.root_process_, group_universe);
+#else
+        ++scan;
+#endif
+    }
+
+#if MPI_BUILD
+    MPI_Win_free(&queue);
+    MPI_Comm_free(&group_universe);
+#endif
+    pretty_print("Campaign finished");
+    return;
+}
+
+int main(int argc, char *argv[]) {
+
+    // Set up the parallel routines
+    openParallelUniverse(argc, argv);
+
+    if (argc >= 2 && strcmp(argv[1], "--campaign") == 0) {
+        runCampaign(argc, argv);
+    } else {
+        Simulation simulation;
+#if MPI_BUILD
+        simulation.universe = MPI_COMM_WORLD;
+#endif
+        joinUniverse(simulation);
+        parseCommandLine(argc, argv, simulation);
+        runScan(simulation);
+    }
 
     // And stop the parallel routines properly
-    closeParallelUniverse(simulation);
+    closeParallelUniverse();
     return 0;
 }
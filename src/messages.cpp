@@ -9,6 +9,17 @@
 
 #include "globals.hpp"
 
+static FILE* message_stream = NULL;  // The redirected messages of this process, if any
+static bool abort_on_error = false;
+
+void redirectMessages(FILE* stream) {
+    message_stream = stream;
+}
+
+void abortOnError(bool abort) {
+    abort_on_error = abort;
+}
+
 void error(char* message, ...) {
     va_list arg;
     static char ws[LINE_LENGTH];
@@ -20,7 +31,14 @@ void error(char* message, ...) {
     MPI_Comm_rank(MPI_COMM_WORLD, &process);
 #endif
     fprintf(stderr, "+- ERROR (on process %d): %s\n", process, ws);
+    if (message_stream != NULL) {
+        fprintf(message_stream, "+- ERROR (on process %d): %s\n", process, ws);
+        fflush(message_stream);
+    }
 #if MPI_BUILD
+    if (abort_on_error) {
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
     MPI_Finalize();
 #endif
     exit(1);
@@ -36,7 +54,9 @@ void warning(char* message, ...) {
 #if MPI_BUILD
     MPI_Comm_rank(MPI_COMM_WORLD, &process);
 #endif
-    if (process == 0) {
+    if (message_stream != NULL) {
+        fprintf(message_stream, "+- WARNING: %s\n", ws);
+    } else if (process == 0) {
         fprintf(stderr, "+- WARNING: %s\n", ws);
     }
 }
@@ -51,7 +71,9 @@ void pretty_print(char* message, ...) {
 #if MPI_BUILD
     MPI_Comm_rank(MPI_COMM_WORLD, &process);
 #endif
-    if (process == 0) {
+    if (message_stream != NULL) {
+        fprintf(message_stream, "+- %s\n", ws);
+    } else if (process == 0) {
         fprintf(stdout, "+- %s\n", ws);
     }
 }
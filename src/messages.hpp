@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdio.h>
+
 #include "globals.hpp"
 
 // Prints an error message to the user and closes the program
@@ -8,3 +10,9 @@ void error(char* message, ...);
 void warning(char* message, ...);
 // Root process prints a message to the user
 void pretty_print(char* message, ...);
+// Sends the messages of this process to a stream instead of the output of the root
+// process, NULL restores the default
+void redirectMessages(FILE* stream);
+// Makes an error abort every process, which is needed when the processes do not all
+// run the same scan
+void abortOnError(bool abort);
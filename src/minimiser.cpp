@@ -48,11 +48,15 @@ int SDMinimisation(System& system, const InputOptions& options) {
         fill(system.energies_.begin(), system.energies_.end(), 0);
 
         // Evaluate all the interactions
-        for (const auto& interaction : *system.interactions_) {
-            interaction->eval(system.positions_, system.forces_, system.energies_);
-        }
+        system.updateSlowForces(n == 1);
+        system.evalInteractions(system.positions_, system.forces_, system.energies_);
         if (checkConvergence(system.forces_[1], system.energies_[1] - prev_tip_e, options)) {
-            break;
+            // Only accept the minimum once it's checked against fresh slow forces
+            if (system.slowForcesFresh()) {
+                break;
+            }
+            system.expireSlowForces();
+            continue;
         }
         for (int i = 0; i < system.n_atoms_; ++i) {
             // Update the atom only if it's not fixed
@@ -85,6 +89,7 @@ int FIREMinimisation(System& system, const InputOptions& options) {
         fill(system.forces_.begin(), system.forces_.end(), Vec3d(0));
         fill(system.energies_.begin(), system.energies_.end(), 0);
 
+        system.updateSlowForces(n_tot == 1);
         switch (options.integrator_type) {
             case EULER:
                 eulerStep(system, dt);
@@ -100,7 +105,12 @@ int FIREMinimisation(System& system, const InputOptions& options) {
         }
 
         if (checkConvergence(system.forces_[1], system.energies_[1] - prev_tip_e, options)) {
-            break;
+            // Only accept the minimum once it's checked against fresh slow forces
+            if (system.slowForcesFresh()) {
+                break;
+            }
+            system.expireSlowForces();
+            continue;
         }
 
         // Evaluate how we want to change the time step
@@ -0,0 +1,167 @@
+#include "npy_io.hpp"
+
+#include <stdexcept>
+
+using namespace std;
+
+
+// Returns the .npy header (magic string, version 1.0 and the array description)
+static string npyHeader(const vector<size_t>& shape) {
+    const uint16_t endian_test = 1;
+    const bool little_endian = *reinterpret_cast<const char*>(&endian_test) == 1;
+    string shape_str = "(";
+    for (size_t n : shape) {
+        shape_str += to_string(n) + ", ";
+    }
+    // 1D shapes need the trailing comma
+    shape_str.erase(shape_str.size() - (shape.size() == 1 ? 1 : 2));
+    shape_str += ")";
+    string dict = string("{'descr': '") + (little_endian ? "<" : ">") + "f8', "
+                  "'fortran_order': False, 'shape': " + shape_str + ", }";
+    // The whole header is padded with spaces to a multiple of 64 bytes and ends in a newline
+    const size_t preamble = 10;
+    size_t total = preamble + dict.size() + 1;
+    total = (total + 63) / 64 * 64;
+    dict.append(total - preamble - dict.size() - 1, ' ');
+    dict += '\n';
+    string header = "\x93NUMPY";
+    header += '\x01';
+    header += '\x00';
+    header += static_cast<char>(dict.size() & 0xff);
+    header += static_cast<char>((dict.size() >> 8) & 0xff);
+    return header + dict;
+}
+
+
+// Returns the lookup table of the CRC-32 checksum
+static vector<uint32_t> crcTable() {
+    vector<uint32_t> table(256);
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        table[i] = c;
+    }
+    return table;
+}
+
+
+// Updates a CRC-32 checksum (as used in zip files) with the given bytes
+static uint32_t crc32(uint32_t crc, const char* bytes, size_t n) {
+    static const vector<uint32_t> table = crcTable();
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) {
+        crc = table[(crc ^ static_cast<unsigned char>(bytes[i])) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+// Writes little endian integers of the zip records
+static void putU16(string& buffer, uint16_t value) {
+    buffer += static_cast<char>(value & 0xff);
+    buffer += static_cast<char>(value >> 8);
+}
+
+
+static void putU32(string& buffer, uint32_t value) {
+    putU16(buffer, value & 0xffff);
+    putU16(buffer, value >> 16);
+}
+
+
+void writeNpy(const string& filepath, const vector<size_t>& shape, const vector<double>& data) {
+    FILE* fp = fopen(filepath.c_str(), "wb");
+    if (fp == NULL) {
+        throw runtime_error("Could not open the npy file " + filepath + " for writing.");
+    }
+    string header = npyHeader(shape);
+    fwrite(header.data(), 1, header.size(), fp);
+    fwrite(data.data(), sizeof(double), data.size(), fp);
+    fclose(fp);
+}
+
+
+NpzWriter::NpzWriter(const string& filepath): offset_(0) {
+    npz_file_ = fopen(filepath.c_str(), "wb");
+    if (npz_file_ == NULL) {
+        throw runtime_error("Could not open the npz file " + filepath + " for writing.");
+    }
+}
+
+
+void NpzWriter::addArray(const string& name, const vector<size_t>& shape, const vector<double>& data) {
+    string header = npyHeader(shape);
+    const char* bytes = reinterpret_cast<const char*>(data.data());
+    size_t n_bytes = data.size() * sizeof(double);
+    if (header.size() + n_bytes + offset_ >= 0xffffffffu) {
+        throw runtime_error("The npz file would exceed 4 GB, use separate npy files instead.");
+    }
+    Member member;
+    member.name = name + ".npy";
+    member.crc = crc32(crc32(0, header.data(), header.size()), bytes, n_bytes);
+    member.size = header.size() + n_bytes;
+    member.offset = offset_;
+
+    // Local file header of a stored (uncompressed) member
+    string record;
+    putU32(record, 0x04034b50);
+    putU16(record, 20);  // version needed to extract
+    putU16(record, 0);  // flags
+    putU16(record, 0);  // compression: stored
+    putU16(record, 0);  // modification time
+    putU16(record, 0x21);  // modification date (1980-01-01)
+    putU32(record, member.crc);
+    putU32(record, member.size);  // compressed size
+    putU32(record, member.size);  // uncompressed size
+    putU16(record, member.name.size());
+    putU16(record, 0);  // extra field length
+    record += member.name;
+    fwrite(record.data(), 1, record.size(), npz_file_);
+    fwrite(header.data(), 1, header.size(), npz_file_);
+    fwrite(bytes, 1, n_bytes, npz_file_);
+    offset_ += record.size() + member.size;
+    members_.push_back(member);
+}
+
+
+NpzWriter::~NpzWriter() {
+    if (npz_file_ == NULL) {
+        return;
+    }
+    // Central directory and the end of central directory record
+    string directory;
+    for (const auto& member : members_) {
+        putU32(directory, 0x02014b50);
+        putU16(directory, 20);  // version made by
+        putU16(directory, 20);  // version needed to extract
+        putU16(directory, 0);  // flags
+        putU16(directory, 0);  // compression: stored
+        putU16(directory, 0);  // modification time
+        putU16(directory, 0x21);  // modification date
+        putU32(directory, member.crc);
+        putU32(directory, member.size);
+        putU32(directory, member.size);
+        putU16(directory, member.name.size());
+        putU16(directory, 0);  // extra field length
+        putU16(directory, 0);  // comment length
+        putU16(directory, 0);  // disk number
+        putU16(directory, 0);  // internal attributes
+        putU32(directory, 0);  // external attributes
+        putU32(directory, member.offset);
+        directory += member.name;
+    }
+    string end;
+    putU32(end, 0x06054b50);
+    putU16(end, 0);  // number of this disk
+    putU16(end, 0);  // disk where the central directory starts
+    putU16(end, members_.size());
+    putU16(end, members_.size());
+    putU32(end, directory.size());
+    putU32(end, offset_);
+    putU16(end, 0);  // comment length
+    fwrite(directory.data(), 1, directory.size(), npz_file_);
+    fwrite(end.data(), 1, end.size(), npz_file_);
+    fclose(npz_file_);
+}
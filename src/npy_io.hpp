@@ -0,0 +1,47 @@
+/*
+ * npy_io.hpp
+ * 
+ * Writers for the NumPy .npy and .npz file formats. The arrays are written as
+ * C ordered doubles without compression, so they can be memory mapped by numpy.
+ * 
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Writes a C ordered array of doubles with the given shape to an .npy file
+void writeNpy(const string& filepath, const vector<size_t>& shape, const vector<double>& data);
+
+
+/** \brief An .npz file writer.
+ *  
+ * Collects arrays to an uncompressed zip archive with one .npy member per array,
+ * which numpy.load returns as a dictionary-like object. The archive is finished
+ * when the writer is destroyed.
+ */
+
+class NpzWriter {
+public:
+    NpzWriter(const string& filepath);
+    ~NpzWriter();
+    
+    // adds an array with the given name and shape to the archive
+    void addArray(const string& name, const vector<size_t>& shape, const vector<double>& data);
+
+private:
+    // Metadata of a member needed for the central directory
+    struct Member {
+        string name;
+        uint32_t crc, size, offset;
+    };
+
+    FILE* npz_file_;
+    uint32_t offset_;  // Current position in the file
+    vector<Member> members_;
+};
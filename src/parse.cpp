@@ -7,9 +7,17 @@
     #include <windows.h>
 #endif
 
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
+
 #include "globals.hpp"
+#include "kernels.hpp"
+#include "mapped_file.hpp"
 #include "messages.hpp"
 #include "simulation.hpp"
+#include "stream_sink.hpp"
 #include "utility.hpp"
 #include "vectors.hpp"
 
@@ -26,38 +34,78 @@ bool checkForComments(char* line) {
     return moveon;
 }
 
+// Read all the names following the keyword on a line
+vector<string> readNameList(const char* line) {
+    vector<string> names;
+    char dump[LINE_LENGTH];
+    strcpy(dump, line);
+    // Skip the keyword itself
+    char* pch = strtok(dump, " \t\n\r\f");
+    pch = strtok(NULL, " \t\n\r\f");
+    while (pch != NULL) {
+        if (pch[0] == '#') {
+            break;
+        }
+        names.push_back(pch);
+        pch = strtok(NULL, " \t\n\r\f");
+    }
+    return names;
+}
+
+// Names of the output fields that can be given to output_fields, in the order of the columns
+struct OutputFieldName {
+    const char* name;
+    int fields;
+};
+static const OutputFieldName output_field_names[] = {
+    {"indices", OUT_INDICES}, {"position", OUT_POSITION}, {"fx", OUT_FX}, {"fy", OUT_FY},
+    {"fz", OUT_FZ}, {"r_vec", OUT_R_VEC}, {"r", OUT_R}, {"angle", OUT_ANGLE},
+    {"energy", OUT_ENERGY}, {"steps", OUT_STEPS}, {"force", OUT_FORCE}, {"all", OUT_ALL}
+};
+static const int n_output_columns = 10;  // The names before the groups
+
+// Print the banner of the program
+void printBanner() {
+    fprintf(stdout,"+ - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +\n");
+    fprintf(stdout,"|                   Mechanical AFM Model                      |\n");
+    fprintf(stdout,"|  Based on: P. Hapala et al, Phys. Rev. B, 90:085421 (2014)  |\n");
+    fprintf(stdout,"|                  This implementation by                     |\n");
+    fprintf(stdout,"|             Peter Spijker and Olli Keisanen                 |\n");
+    fprintf(stdout,"|          2014-2015 (c) Aalto University, Finland            |\n");
+    fprintf(stdout,"+ - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +\n");
+}
+
 // Read stuff from the command line
 void parseCommandLine(int argc, char* argv[], Simulation& simulation) {
     if (simulation.rootProcess()) {
-        fprintf(stdout,"+ - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +\n");
-        fprintf(stdout,"|                   Mechanical AFM Model                      |\n");
-        fprintf(stdout,"|  Based on: P. Hapala et al, Phys. Rev. B, 90:085421 (2014)  |\n");
-        fprintf(stdout,"|                  This implementation by                     |\n");
-        fprintf(stdout,"|             Peter Spijker and Olli Keisanen                 |\n");
-        fprintf(stdout,"|          2014-2015 (c) Aalto University, Finland            |\n");
-        fprintf(stdout,"+ - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - +\n");
+        printBanner();
     }
-    InputOptions& options = simulation.options_;
     if ((argc < 2) ) {
         error("Specify an input file to be read!");
     } else if (argc > 3) {
         error("Too many command line arguments!");
     }
+    setScanFiles(simulation, argv[1], (argc == 3) ? argv[2] : "");
+    simulation.options_.campaign = false;
+    return;
+}
+
+// Set the input file and the output folder of a scan and create the output folder
+void setScanFiles(Simulation& simulation, const string& inputfile, const string& outputfolder) {
+    InputOptions& options = simulation.options_;
     options.inputfolder = "";
     options.outputfolder = "";
-    if (argc >= 2) {
-        options.inputfile = argv[1];
+    options.inputfile = inputfile;
 #ifdef _WIN32
-        size_t path_split = options.inputfile.rfind("\\");
+    size_t path_split = options.inputfile.rfind("\\");
 #else
-        size_t path_split = options.inputfile.rfind("/");
+    size_t path_split = options.inputfile.rfind("/");
 #endif
-        if (path_split != string::npos) {
-            options.inputfolder = options.inputfile.substr(0, path_split + 1);
-        }
+    if (path_split != string::npos) {
+        options.inputfolder = options.inputfile.substr(0, path_split + 1);
     }
-    if (argc == 3) {
-        options.outputfolder = argv[2];
+    if (!outputfolder.empty()) {
+        options.outputfolder = outputfolder;
 #ifdef _WIN32
         if (options.outputfolder[options.outputfolder.size() - 1] != '\\') {
             options.outputfolder += '\\';
@@ -79,6 +127,118 @@ void parseCommandLine(int argc, char* argv[], Simulation& simulation) {
     return;
 }
 
+// Estimate the cost of a scan from the number of tip positions and the number of atoms
+// in its input files, without checking them
+static double estimateScanCost(const string& inputfile) {
+    FILE* fp = fopen(inputfile.c_str(), "r");
+    if (fp == NULL) {
+        error("The file %s does not exist!", inputfile.c_str());
+    }
+    string inputfolder = "";
+    size_t path_split = inputfile.rfind("/");
+    if (path_split != string::npos) {
+        inputfolder = inputfile.substr(0, path_split + 1);
+    }
+
+    // The defaults are those of readInputFile
+    string xyzfile = "";
+    Vec2d area(10);
+    double dx = 0.1, dy = 0.1, dz = 0.1, zlow = 6.0, zhigh = 10.0;
+    int n_tips = 1, n_branches = 1;
+    char keyword[NAME_LENGTH];
+    char value[NAME_LENGTH];
+    char line[LINE_LENGTH];
+    char dump[LINE_LENGTH];
+    while (fgets(line, LINE_LENGTH, fp) != NULL) {
+        if (checkForComments(line)) {
+            continue;
+        }
+        value[0] = '\0';
+        sscanf(line, "%s %s", keyword, value);
+        strlow(keyword);
+        if (strcmp(keyword, "xyzfile") == 0) {
+            xyzfile = inputfolder + value;
+        } else if (strcmp(keyword, "tipatom") == 0) {
+            n_tips = max<int>(readNameList(line).size(), 1);
+        } else if (strcmp(keyword, "area") == 0) {
+            sscanf(line, "%s %lf %lf", dump, &(area.x), &(area.y));
+        } else if (strcmp(keyword, "zhigh") == 0) {
+            zhigh = atof(value);
+        } else if (strcmp(keyword, "zlow") == 0) {
+            zlow = atof(value);
+        } else if (strcmp(keyword, "dx") == 0) {
+            dx = atof(value);
+        } else if (strcmp(keyword, "dy") == 0) {
+            dy = atof(value);
+        } else if (strcmp(keyword, "dz") == 0) {
+            dz = atof(value);
+        } else if (strcmp(keyword, "retract") == 0) {
+            n_branches = (strcmp(value, "on") == 0) ? 2 : 1;
+        }
+    }
+    fclose(fp);
+    if (dx <= 0 || dy <= 0 || dz <= 0) {
+        error("The grid spacing of %s must be positive!", inputfile.c_str());
+    }
+
+    // The atoms are counted from the lines of the xyz file, which is close enough
+    int n_atoms = 0;
+    fp = fopen(xyzfile.c_str(), "r");
+    if (fp != NULL) {
+        while (fgets(line, LINE_LENGTH, fp) != NULL) {
+            if (!checkForComments(line)) {
+                ++n_atoms;
+            }
+        }
+        fclose(fp);
+    }
+    double n_points = (floor(area.x / dx) + 1) * (floor(area.y / dy) + 1) *
+                      (floor((zhigh - zlow) / dz) + 1);
+    return n_points * n_tips * n_branches * max(n_atoms, 1);
+}
+
+// Read the scans of a campaign. Relative paths in the file are relative to its folder.
+vector<CampaignScan> readCampaignFile(const string& campaignfile) {
+    FILE* fp = fopen(campaignfile.c_str(), "r");
+    if (fp == NULL) {
+        error("The file %s does not exist!", campaignfile.c_str());
+    }
+    string campaignfolder = "";
+    size_t path_split = campaignfile.rfind("/");
+    if (path_split != string::npos) {
+        campaignfolder = campaignfile.substr(0, path_split + 1);
+    }
+
+    vector<CampaignScan> scans;
+    char inputfile[NAME_LENGTH];
+    char outputfolder[NAME_LENGTH];
+    char line[LINE_LENGTH];
+    while (fgets(line, LINE_LENGTH, fp) != NULL) {
+        if (checkForComments(line)) {
+            continue;
+        }
+        CampaignScan scan;
+        scan.cost = 0;
+        int n_read = sscanf(line, "%s %s %lf", inputfile, outputfolder, &scan.cost);
+        if (n_read < 2) {
+            error("Each line of the campaign file needs an input file and an output folder!");
+        }
+        scan.inputfile = (inputfile[0] == '/') ? inputfile : campaignfolder + inputfile;
+        scan.outputfolder = (outputfolder[0] == '/') ? outputfolder : campaignfolder + outputfolder;
+        if (n_read < 3) {
+            scan.cost = estimateScanCost(scan.inputfile);
+        } else if (scan.cost <= 0) {
+            error("The cost of the scan %s must be positive!", inputfile);
+        }
+        scans.push_back(scan);
+    }
+    fclose(fp);
+    if (scans.empty()) {
+        error("The campaign file %s contains no scans!", campaignfile.c_str());
+    }
+    return scans;
+}
+
 // A function to read an input file
 void readInputFile(Simulation& simulation) {
     InputOptions& options = simulation.options_;
@@ -91,7 +251,9 @@ void readInputFile(Simulation& simulation) {
     char tmp_coulomb[NAME_LENGTH], tmp_tip_dummy_coulomb[NAME_LENGTH], tmp_minterm[NAME_LENGTH];
     char tmp_gzip[NAME_LENGTH], tmp_statistics[NAME_LENGTH], tmp_units[NAME_LENGTH];
     char tmp_flexible[NAME_LENGTH], tmp_rigidgrid[NAME_LENGTH], tmp_normal[NAME_LENGTH];
+    char tmp_periodic_grid[NAME_LENGTH], tmp_frozen_grid[NAME_LENGTH];
     char tmp_use_external_potential[NAME_LENGTH], tmp_vdw_pbc[NAME_LENGTH];
+    char tmp_retract[NAME_LENGTH], tmp_stiffness[NAME_LENGTH];
 
     // Initialize the mandatory options
     options.xyzfile = "";
@@ -104,8 +266,17 @@ void readInputFile(Simulation& simulation) {
     options.planeatom = "";
     options.units = U_KCAL;
     sprintf(tmp_units, "%s" ,"kcal/mol");
-    options.e_potential_file = "";
+    options.e_potential_grid = Vec3i(0);
+    options.density_file = "";
+    options.pauli_a = 18.0;
+    options.pauli_b = 1.0;
+    options.stream_output = "";
+    options.progress_interval = 10;
+    options.status_file = false;
+    options.trajectory = false;
+    options.trajectory_columns.assign(1, Vec2i(-1, -1));
     options.coulomb = false;
+    options.coulomb_theta = 0;
     options.tip_dummy_coulomb = false;
     options.use_external_potential = false;
     options.area = Vec2d(10);
@@ -115,23 +286,44 @@ void readInputFile(Simulation& simulation) {
     options.dz = 0.1;
     options.zlow = 6.0;
     options.zhigh = 10.0;
+    options.retract = false;
+    options.stiffness = false;
+    options.temperature = 0;
+    options.thermal_replicas = 16;
+    options.thermal_steps = 1000;
+    options.thermal_equil = 200;
+    options.thermal_dt = 0.01;
+    options.friction = 1.0;
+    options.seed = 1;
+    options.volume_format = VOLUME_CUBE;
+    options.amplitude = 0.5;
+    options.k_cantilever = 1800;
+    options.f0 = 25000;
+    options.respa_interval = 1;
+    options.output_fields = OUT_ALL;
+    options.respa_cutoff = 8.0;
     options.vdw_pbc = false;
     options.cell_a = Vec3d(0);
     options.cell_b = Vec3d(0);
     options.cell_c = Vec3d(0);
-    options.normal = NORMAL_Z;
+    options.surface_normal = Vec3d(0, 0, 1);
+    options.scan_direction = Vec3d(0);
     sprintf(tmp_normal, "%s" ,"z");
     options.etol = 0.01;
     options.ftol = 0.01;
     options.dt = 0.001;
     options.maxsteps = 5000;
-    options.bufsize = 1000;
     options.gzip = true;
     options.statistics = false;
     options.flexible = false;
     options.rigidgrid = false;
+    options.periodic_grid = false;
+    options.grid_tolerance = 0;
+    options.frozen_grid = false;
+    options.frozen_grid_spacing = 0.2;
     options.minimiser_type = FIRE;
     options.integrator_type = MIDPOINT;
+    options.isa = ISA_AUTO;
 
     // Check if the file exists
     fp = fopen(options.inputfile.c_str(), "r");
@@ -153,11 +345,29 @@ void readInputFile(Simulation& simulation) {
         } else if (strcmp(keyword, "paramfile") == 0) {
             options.paramfile = options.inputfolder + value;
         } else if (strcmp(keyword, "e_potential_file") == 0) {
-            options.e_potential_file = options.inputfolder + value;
+            // Each line adds a potential with an optional weight
+            double weight = 1.0;
+            sscanf(line, "%s %s %lf", dump, dump, &weight);
+            options.e_potential_files.push_back(options.inputfolder + value);
+            options.e_potential_weights.push_back(weight);
+        } else if (strcmp(keyword, "e_potential_grid") == 0) {
+            sscanf(line, "%s %d %d %d", dump, &(options.e_potential_grid.x),
+                   &(options.e_potential_grid.y), &(options.e_potential_grid.z));
+        } else if (strcmp(keyword, "density_file") == 0) {
+            options.density_file = options.inputfolder + value;
+        } else if (strcmp(keyword, "tip_density_file") == 0) {
+            options.tip_density_files = readNameList(line);
+            for (string& file : options.tip_density_files) {
+                file = options.inputfolder + file;
+            }
+        } else if (strcmp(keyword, "pauli_a") == 0) {
+            options.pauli_a = atof(value);
+        } else if (strcmp(keyword, "pauli_b") == 0) {
+            options.pauli_b = atof(value);
         } else if (strcmp(keyword, "tipatom") == 0) {
-            options.tipatom = value;
+            options.tipatoms = readNameList(line);
         } else if (strcmp(keyword, "dummyatom") == 0) {
-            options.dummyatom = value;
+            options.dummyatoms = readNameList(line);
         } else if (strcmp(keyword, "area") == 0) {
             sscanf(line, "%s %lf %lf", dump, &(options.area.x), &(options.area.y));
         } else if (strcmp(keyword, "center") == 0) {
@@ -186,8 +396,87 @@ void readInputFile(Simulation& simulation) {
             options.dt = atof(value);
         } else if (strcmp(keyword, "maxsteps") == 0) {
             options.maxsteps = atoi(value);
+        } else if (strcmp(keyword, "temperature") == 0) {
+            options.temperature = atof(value);
+        } else if (strcmp(keyword, "thermal_replicas") == 0) {
+            options.thermal_replicas = atoi(value);
+        } else if (strcmp(keyword, "thermal_steps") == 0) {
+            options.thermal_steps = atoi(value);
+        } else if (strcmp(keyword, "thermal_equil") == 0) {
+            options.thermal_equil = atoi(value);
+        } else if (strcmp(keyword, "thermal_dt") == 0) {
+            options.thermal_dt = atof(value);
+        } else if (strcmp(keyword, "friction") == 0) {
+            options.friction = atof(value);
+        } else if (strcmp(keyword, "seed") == 0) {
+            options.seed = strtoul(value, NULL, 10);
+        } else if (strcmp(keyword, "volume_output") == 0) {
+            options.volume_output = readNameList(line);
+            for (auto& quantity : options.volume_output) {
+                if (quantity == "off") {
+                    options.volume_output.clear();
+                    break;
+                }
+                if (quantity != "fz" && quantity != "energy" && quantity != "df" &&
+                    quantity != "dx" && quantity != "dy" && quantity != "dz") {
+                    error("Unknown volume output %s! (options: fz, energy, df, dx, dy, dz)",
+                          quantity.c_str());
+                }
+            }
+        } else if (strcmp(keyword, "stream_output") == 0) {
+            options.stream_output = (strcmp(value, "off") == 0) ? "" : value;
+        } else if (strcmp(keyword, "progress_interval") == 0) {
+            options.progress_interval = atof(value);
+        } else if (strcmp(keyword, "status_file") == 0) {
+            if (strcmp(value, "on") == 0) {
+                options.status_file = true;
+            } else if (strcmp(value, "off") == 0) {
+                options.status_file = false;
+            } else {
+                error("Option %s must be either on or off!", keyword);
+            }
+        } else if (strcmp(keyword, "output_fields") == 0) {
+            options.output_fields = 0;
+            for (auto& field : readNameList(line)) {
+                bool found = false;
+                for (const auto& field_name : output_field_names) {
+                    if (field == field_name.name) {
+                        options.output_fields |= field_name.fields;
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    error("Unknown output field %s! (options: indices, position, force, fx, fy, fz, "
+                          "r_vec, r, angle, energy, steps, all)", field.c_str());
+                }
+            }
+            if (options.output_fields == 0) {
+                error("Option %s needs at least one field!", keyword);
+            }
+        } else if (strcmp(keyword, "volume_format") == 0) {
+            if (strcmp(value, "cube") == 0) {
+                options.volume_format = VOLUME_CUBE;
+            } else if (strcmp(value, "xsf") == 0) {
+                options.volume_format = VOLUME_XSF;
+            } else if (strcmp(value, "npy") == 0) {
+                options.volume_format = VOLUME_NPY;
+            } else if (strcmp(value, "npz") == 0) {
+                options.volume_format = VOLUME_NPZ;
+            } else {
+                error("Option %s must be either cube, xsf, npy or npz!", keyword);
+            }
+        } else if (strcmp(keyword, "amplitude") == 0) {
+            options.amplitude = atof(value);
+        } else if (strcmp(keyword, "k_cantilever") == 0) {
+            options.k_cantilever = atof(value);
+        } else if (strcmp(keyword, "f0") == 0) {
+            options.f0 = atof(value);
+        } else if (strcmp(keyword, "respa_interval") == 0) {
+            options.respa_interval = atoi(value);
+        } else if (strcmp(keyword, "respa_cutoff") == 0) {
+            options.respa_cutoff = atof(value);
         } else if (strcmp(keyword, "bufsize") == 0) {
-            options.bufsize = atoi(value);
+            // No longer used, the output is written as soon as each x row is complete
         } else if (strcmp(keyword, "gzip") == 0) {
             if (strcmp(value, "on") == 0) {
                 options.gzip = true;
@@ -220,6 +509,80 @@ void readInputFile(Simulation& simulation) {
             } else {
                 error("Option %s must be either on or off!", keyword);
             }
+        } else if (strcmp(keyword, "grid_tolerance") == 0) {
+            options.grid_tolerance = atof(value);
+        } else if (strcmp(keyword, "periodic_grid") == 0) {
+            if (strcmp(value, "on") == 0) {
+                options.periodic_grid = true;
+            } else if (strcmp(value, "off") == 0) {
+                options.periodic_grid = false;
+            } else {
+                error("Option %s must be either on or off!", keyword);
+            }
+        } else if (strcmp(keyword, "frozen_grid") == 0) {
+            if (strcmp(value, "on") == 0) {
+                options.frozen_grid = true;
+            } else if (strcmp(value, "off") == 0) {
+                options.frozen_grid = false;
+            } else {
+                error("Option %s must be either on or off!", keyword);
+            }
+        } else if (strcmp(keyword, "frozen_grid_spacing") == 0) {
+            options.frozen_grid_spacing = atof(value);
+        } else if (strcmp(keyword, "retract") == 0) {
+            if (strcmp(value, "on") == 0) {
+                options.retract = true;
+            } else if (strcmp(value, "off") == 0) {
+                options.retract = false;
+            } else {
+                error("Option %s must be either on or off!", keyword);
+            }
+        } else if (strcmp(keyword, "trajectory") == 0) {
+            if (strcmp(value, "on") == 0) {
+                options.trajectory = true;
+            } else if (strcmp(value, "off") == 0) {
+                options.trajectory = false;
+            } else {
+                error("Option %s must be either on or off!", keyword);
+            }
+        } else if (strcmp(keyword, "trajectory_columns") == 0) {
+            options.trajectory_columns.clear();
+            for (auto& column : readNameList(line)) {
+                Vec2i indices;
+                char separator;
+                if (column == "all") {
+                    options.trajectory_columns.clear();
+                    break;
+                } else if (column == "center") {
+                    options.trajectory_columns.push_back(Vec2i(-1, -1));
+                } else if (sscanf(column.c_str(), "%d%c%d", &indices.x, &separator, &indices.y) == 3 &&
+                           separator == ',' && indices.x >= 0 && indices.y >= 0) {
+                    options.trajectory_columns.push_back(indices);
+                } else {
+                    error("Invalid trajectory column %s! (options: x,y indices, center or all)",
+                          column.c_str());
+                }
+            }
+        } else if (strcmp(keyword, "trajectory_levels") == 0) {
+            options.trajectory_levels.clear();
+            for (auto& level : readNameList(line)) {
+                if (level == "all") {
+                    options.trajectory_levels.clear();
+                    break;
+                } else if (isint(const_cast<char*>(level.c_str())) && atoi(level.c_str()) >= 0) {
+                    options.trajectory_levels.push_back(atoi(level.c_str()));
+                } else {
+                    error("Invalid trajectory level %s! (options: z indices or all)", level.c_str());
+                }
+            }
+        } else if (strcmp(keyword, "stiffness") == 0) {
+            if (strcmp(value, "on") == 0) {
+                options.stiffness = true;
+            } else if (strcmp(value, "off") == 0) {
+                options.stiffness = false;
+            } else {
+                error("Option %s must be either on or off!", keyword);
+            }
         } else if (strcmp(keyword, "coulomb") == 0) {
             if (strcmp(value, "on") == 0) {
                 options.coulomb = true;
@@ -228,6 +591,8 @@ void readInputFile(Simulation& simulation) {
             } else {
                 error("Option %s must be either on or off!", keyword);
             }
+        } else if (strcmp(keyword, "coulomb_theta") == 0) {
+            options.coulomb_theta = atof(value);
         } else if (strcmp(keyword, "tip_dummy_coulomb") == 0) {
             if (strcmp(value, "on") == 0) {
                 options.tip_dummy_coulomb = true;
@@ -254,16 +619,24 @@ void readInputFile(Simulation& simulation) {
             }
         } else if(strcmp(keyword, "surface_normal") == 0) {
             strlow(value);
+            Vec3d& normal = options.surface_normal;
+            sprintf(tmp_normal, "%s", value);
             if (strcmp(value, "z") == 0) {
-                options.normal = NORMAL_Z;
+                normal = Vec3d(0, 0, 1);
             } else if (strcmp(value, "y") == 0) {
-                options.normal = NORMAL_Y;
+                normal = Vec3d(0, 1, 0);
             } else if (strcmp(value, "x") == 0) {
-                options.normal = NORMAL_X;
+                normal = Vec3d(1, 0, 0);
+            } else if (sscanf(line, "%s %lf %lf %lf", dump, &normal.x, &normal.y, &normal.z) == 4) {
+                sprintf(tmp_normal, "%-8.4f %-8.4f %-8.4f", normal.x, normal.y, normal.z);
             } else {
-                error("Option %s must be either X, Y or Z!", keyword);
+                error("Option %s must be either X, Y, Z or a vector!", keyword);
+            }
+        } else if (strcmp(keyword, "scan_direction") == 0) {
+            Vec3d& direction = options.scan_direction;
+            if (sscanf(line, "%s %lf %lf %lf", dump, &direction.x, &direction.y, &direction.z) != 4) {
+                error("Option %s must be a vector!", keyword);
             }
-            sprintf(tmp_normal, "%s", value);
         } else if (strcmp(keyword, "minterm") == 0) {
             if (strcmp(value, "e") == 0) {
                 options.minterm = MIN_E;
@@ -314,6 +687,18 @@ void readInputFile(Simulation& simulation) {
             } else {
                 error("Unrecognised integrator type!");
             }
+        } else if (strcmp(keyword, "isa") == 0) {
+            if (strcmp(value, "auto") == 0) {
+                options.isa = ISA_AUTO;
+            } else if (strcmp(value, "generic") == 0) {
+                options.isa = ISA_GENERIC;
+            } else if (strcmp(value, "avx2") == 0) {
+                options.isa = ISA_AVX2;
+            } else if (strcmp(value, "avx512") == 0) {
+                options.isa = ISA_AVX512;
+            } else {
+                error("Option %s must be either auto, generic, avx2 or avx512!", keyword);
+            }
         } else {
             error("Unknown option %s!", keyword);
         }
@@ -326,18 +711,55 @@ void readInputFile(Simulation& simulation) {
     if (options.paramfile == "") {
         error("Specify at least a parameter file!");
     }
-    if (options.tipatom == "") {
+    if (options.tipatoms.empty()) {
         error("Specify at least a tip atom!");
     }
-    if (options.dummyatom == "") {
+    if (options.dummyatoms.empty()) {
         error("Specify at least a dummy atom!");
     }
+    // Select the instruction set of the kernels, which can be forced for benchmarking
+    try {
+        selectIsa(options.isa);
+    } catch (runtime_error& e) {
+        error("%s!", e.what());
+    }
+    // A single dummy atom is shared by all the tips
+    if (options.dummyatoms.size() == 1) {
+        options.dummyatoms.resize(options.tipatoms.size(), options.dummyatoms[0]);
+    } else if (options.dummyatoms.size() != options.tipatoms.size()) {
+        error("Specify either one dummy atom or one dummy atom for each tip atom!");
+    }
+    // A single tip density is shared by all the tips
+    if (options.tip_density_files.size() == 1) {
+        options.tip_density_files.resize(options.tipatoms.size(), options.tip_density_files[0]);
+    } else if (!options.tip_density_files.empty() && options.tip_density_files.size() != options.tipatoms.size()) {
+        error("Specify either one tip density file or one for each tip atom!");
+    }
+    // Each tip writes its output to a folder named after the tip atom
+    for (unsigned int i = 0; i < options.tipatoms.size(); ++i) {
+        for (unsigned int j = 0; j < i; ++j) {
+            if (options.tipatoms[i] == options.tipatoms[j]) {
+                error("Tip atom %s is given multiple times!", options.tipatoms[i].c_str());
+            }
+        }
+    }
+    options.tipatom = options.tipatoms[0];
+    options.dummyatom = options.dummyatoms[0];
     if (options.minterm == NOT_SET) {
         error("Specify at least a minimization termination criterion (e, f, or ef)!");
     }
 
     fclose(fp);
 
+    // The scans of a campaign would mix their streams on the shared stdout
+    if (options.stream_output == "-" && options.campaign) {
+        error("Option stream_output - cannot be used in a campaign!");
+    }
+    // The messages must not end up in a result stream on stdout
+    if (options.stream_output == "-" && simulation.rootProcess()) {
+        StreamSink::detachStdout();
+    }
+
     // Set some useful thingies
     if (options.center == Vec2d(-1)){
         options.center = options.area / 2;
@@ -382,23 +804,128 @@ void readInputFile(Simulation& simulation) {
     } else {
         sprintf(tmp_rigidgrid, "%s", "off");
     }
+    if (options.periodic_grid) {
+        sprintf(tmp_periodic_grid, "%s", "on");
+    } else {
+        sprintf(tmp_periodic_grid, "%s", "off");
+    }
+    if (options.frozen_grid) {
+        sprintf(tmp_frozen_grid, "%s", "on");
+    } else {
+        sprintf(tmp_frozen_grid, "%s", "off");
+    }
+    if (options.retract) {
+        sprintf(tmp_retract, "%s", "on");
+    } else {
+        sprintf(tmp_retract, "%s", "off");
+    }
+    if (options.stiffness) {
+        sprintf(tmp_stiffness, "%s", "on");
+    } else {
+        sprintf(tmp_stiffness, "%s", "off");
+    }
+
+    // The optional quantities are written whenever they are computed
+    if (options.stiffness) {
+        options.output_fields |= OUT_STIFFNESS;
+    }
+    if (options.temperature > 0) {
+        options.output_fields |= OUT_THERMAL;
+    }
 
     // Do some sanity checking
     if ((options.rigidgrid) && (options.flexible)) {
         error("Cannot use a flexible molecule with a static force grid!");
     }
+    if (options.grid_tolerance < 0) {
+        error("Option grid_tolerance must be at least 0!");
+    }
+    if (options.periodic_grid && !(options.rigidgrid && options.vdw_pbc)) {
+        error("Option periodic_grid can only be used with rigidgrid and vdw_pbc!");
+    }
+    if (options.progress_interval <= 0) {
+        error("Option progress_interval must be greater than 0!");
+    }
+    if (options.frozen_grid && !options.flexible) {
+        error("Option frozen_grid can only be used with a flexible molecule!");
+    }
+    if (options.frozen_grid && options.vdw_pbc) {
+        error("Cannot use frozen grids with periodic vdW interactions!");
+    }
+    if (options.frozen_grid_spacing <= 0) {
+        error("Option frozen_grid_spacing must be greater than 0!");
+    }
     if (options.coulomb && options.use_external_potential) {
         error("Cannot use Coulomb interaction and external electrostatic potential at the same time!");
     }
     if (options.use_external_potential && options.flexible) {
         error("External potential can be used only for non-flexible systems!");
     }
-    if (options.use_external_potential && (options.e_potential_file == "")) {
+    if (options.use_external_potential && options.e_potential_files.empty()) {
         error("If you want to use external electrostatic potential, you must specify a file that contains it!");
     }
+    if (options.e_potential_grid != Vec3i(0) &&
+            (options.e_potential_grid.x < 1 || options.e_potential_grid.y < 1 || options.e_potential_grid.z < 1)) {
+        error("The grid of the external potential must have at least one point in each direction!");
+    }
+    if (options.density_file != "" && options.tip_density_files.empty()) {
+        error("The density overlap needs a tip density file as well as the sample density!");
+    }
+    if (options.density_file != "" && options.flexible) {
+        error("The density overlap can be used only for non-flexible systems!");
+    }
+    if (options.pauli_b <= 0) {
+        error("Option pauli_b must be positive!");
+    }
+    if (options.temperature < 0) {
+        error("The temperature must not be negative!");
+    }
+    if (options.temperature > 0) {
+        if (options.thermal_replicas < 1 || options.thermal_steps < 1 || options.thermal_equil < 0) {
+            error("Thermal sampling needs at least one replica and one sampling step!");
+        }
+        if (options.thermal_dt <= 0 || options.friction <= 0) {
+            error("The thermal time step and friction must be positive!");
+        }
+    }
+    if (options.amplitude <= 0 || options.k_cantilever <= 0) {
+        error("The oscillation amplitude and the cantilever stiffness must be positive!");
+    }
+    if (options.respa_interval < 1) {
+        error("Option respa_interval must be at least 1!");
+    }
+    if (options.coulomb_theta < 0 || options.coulomb_theta >= 1) {
+        error("Option coulomb_theta must be at least 0 and less than 1!");
+    }
     if (options.vdw_pbc && options.coulomb) {
         error("Implementation of Coulomb interaction does not support any periodic boundary conditions! Use periodic external electrostatic potential instead.");
     }
+    // The scan frame has the surface normal as its z axis and the scan direction projected
+    // to the surface as its x axis. Without a scan direction, the axis after the one closest
+    // to the normal is used (y for x, z for y and x for z), which keeps the old axis
+    // permutations of surface_normal x and y.
+    if (options.surface_normal.len() < TOLERANCE) {
+        error("Option surface_normal must not be a zero vector!");
+    }
+    Vec3d normal = options.surface_normal.normalized();
+    Vec3d direction = options.scan_direction;
+    if (direction == Vec3d(0)) {
+        double n[3] = {fabs(normal.x), fabs(normal.y), fabs(normal.z)};
+        int axis = max_element(n, n + 3) - n;
+        direction = Vec3d((axis == 2), (axis == 0), (axis == 1));
+    }
+    direction = direction - direction.dot(normal) * normal;
+    if (direction.len() < 1.0e-6) {
+        error("Option scan_direction must not be parallel to the surface normal!");
+    }
+    Vec3d scan_x = direction.normalized();
+    Vec3d scan_y = normal.cross(scan_x);
+    const Vec3d* axes[3] = {&scan_x, &scan_y, &normal};
+    for (int a = 0; a < 3; ++a) {
+        options.frame.at(a, 0) = axes[a]->x;
+        options.frame.at(a, 1) = axes[a]->y;
+        options.frame.at(a, 2) = axes[a]->z;
+    }
     if (options.vdw_pbc && !options.use_external_potential) {
         if (options.cell_a == Vec3d(0) || options.cell_b == Vec3d(0) || options.cell_c == Vec3d(0))
             error("The unit cell vectors must be given if periodic vdW is used.");
@@ -410,8 +937,13 @@ void readInputFile(Simulation& simulation) {
     pretty_print("");
     pretty_print("xyzfile:                  %-s", options.xyzfile.c_str());
     pretty_print("paramfile:                %-s", options.paramfile.c_str());
-    pretty_print("tipatom:                  %-s", options.tipatom.c_str());
-    pretty_print("dummyatom:                %-s", options.dummyatom.c_str());
+    string tip_list = options.tipatoms[0], dummy_list = options.dummyatoms[0];
+    for (unsigned int i = 1; i < options.tipatoms.size(); ++i) {
+        tip_list += " " + options.tipatoms[i];
+        dummy_list += " " + options.dummyatoms[i];
+    }
+    pretty_print("tipatom:                  %-s", tip_list.c_str());
+    pretty_print("dummyatom:                %-s", dummy_list.c_str());
     pretty_print("");
     pretty_print("units:                    %-s", tmp_units);
     pretty_print("");
@@ -428,8 +960,12 @@ void readInputFile(Simulation& simulation) {
     pretty_print("dx:                       %-8.4f", options.dx);
     pretty_print("dy:                       %-8.4f", options.dy);
     pretty_print("dz:                       %-8.4f", options.dz);
+    pretty_print("retract:                  %-s", tmp_retract);
     pretty_print("");
     pretty_print("surface_normal:           %-s", tmp_normal);
+    if (options.scan_direction != Vec3d(0)) {
+        pretty_print("scan_direction:           %-8.4f %-8.4f %-8.4f", scan_x.x, scan_x.y, scan_x.z);
+    }
     pretty_print("vdw_pbc:                  %-s", tmp_vdw_pbc);
     if (options.vdw_pbc && !options.use_external_potential) {
         pretty_print("cell_a:                   %-8.4f %-8.4f %-8.4f", options.cell_a.x, options.cell_a.y, options.cell_a.z);
@@ -438,13 +974,50 @@ void readInputFile(Simulation& simulation) {
     }
     pretty_print("");
     pretty_print("coulomb:                  %-s", tmp_coulomb);
+    if (options.coulomb && options.coulomb_theta > 0) {
+        pretty_print("coulomb_theta:            %-8.4f", options.coulomb_theta);
+    }
     pretty_print("tip_dummy_coulomb:        %-s", tmp_tip_dummy_coulomb);
     pretty_print("use_external_potential:   %-s", tmp_use_external_potential);
-    if (options.use_external_potential)
-        pretty_print("e_potential_file:         %-s", options.e_potential_file.c_str());
+    if (options.use_external_potential) {
+        for (unsigned int i = 0; i < options.e_potential_files.size(); ++i) {
+            pretty_print("e_potential_file:         %-s %-8.4f", options.e_potential_files[i].c_str(),
+                         options.e_potential_weights[i]);
+        }
+        if (options.e_potential_grid != Vec3i(0)) {
+            pretty_print("e_potential_grid:         %-8d %-8d %-8d", options.e_potential_grid.x,
+                         options.e_potential_grid.y, options.e_potential_grid.z);
+        }
+    }
+    if (options.density_file != "") {
+        string tip_density_list = options.tip_density_files[0];
+        for (unsigned int i = 1; i < options.tip_density_files.size(); ++i) {
+            tip_density_list += " " + options.tip_density_files[i];
+        }
+        pretty_print("density_file:             %-s", options.density_file.c_str());
+        pretty_print("tip_density_file:         %-s", tip_density_list.c_str());
+        pretty_print("pauli_a:                  %-8.4f", options.pauli_a);
+        pretty_print("pauli_b:                  %-8.4f", options.pauli_b);
+    }
     pretty_print("");
     pretty_print("flexible:                 %-s", tmp_flexible);
     pretty_print("rigidgrid:                %-s", tmp_rigidgrid);
+    if (options.rigidgrid && options.vdw_pbc) {
+        pretty_print("periodic_grid:            %-s", tmp_periodic_grid);
+    }
+    if (options.rigidgrid && options.grid_tolerance > 0) {
+        pretty_print("grid_tolerance:           %-8.4f", options.grid_tolerance);
+    }
+    if (options.flexible) {
+        pretty_print("frozen_grid:              %-s", tmp_frozen_grid);
+    }
+    if (options.frozen_grid) {
+        pretty_print("frozen_grid_spacing:      %-8.4f", options.frozen_grid_spacing);
+    }
+    if (options.flexible && options.respa_interval > 1) {
+        pretty_print("respa_interval:           %-8d", options.respa_interval);
+        pretty_print("respa_cutoff:             %-8.4f", options.respa_cutoff);
+    }
     pretty_print("");
     switch (options.minimiser_type) {
         case STEEPEST_DESCENT:
@@ -465,53 +1038,244 @@ void readInputFile(Simulation& simulation) {
             pretty_print("integrator:        %-s", "rk4");
             break;
     }
+    if (options.isa == ISA_AUTO) {
+        pretty_print("isa:               %-s (auto)", isaName(selectedIsa()));
+    } else {
+        pretty_print("isa:               %-s", isaName(selectedIsa()));
+    }
     pretty_print("");
-    pretty_print("bufsize:           %-8d", options.bufsize);
+    pretty_print("stiffness:         %-s", tmp_stiffness);
+    pretty_print("temperature:       %-8.4f", options.temperature);
+    if (options.temperature > 0) {
+        pretty_print("thermal_replicas:  %-8d", options.thermal_replicas);
+        pretty_print("thermal_steps:     %-8d", options.thermal_steps);
+        pretty_print("thermal_equil:     %-8d", options.thermal_equil);
+        pretty_print("thermal_dt:        %-8.4f", options.thermal_dt);
+        pretty_print("friction:          %-8.4f", options.friction);
+        pretty_print("seed:              %-lu", options.seed);
+    }
+    if (!options.volume_output.empty()) {
+        string volume_list = options.volume_output[0];
+        for (unsigned int i = 1; i < options.volume_output.size(); ++i) {
+            volume_list += " " + options.volume_output[i];
+        }
+        pretty_print("volume_output:     %-s", volume_list.c_str());
+        const char* volume_formats[] = {"cube", "xsf", "npy", "npz"};
+        pretty_print("volume_format:     %-s", volume_formats[options.volume_format]);
+        pretty_print("amplitude:         %-8.4f", options.amplitude);
+        pretty_print("k_cantilever:      %-8.4f", options.k_cantilever);
+        pretty_print("f0:                %-8.4f", options.f0);
+    }
+    string field_list;
+    for (int i = 0; i < n_output_columns; ++i) {
+        if (options.output_fields & output_field_names[i].fields) {
+            field_list += field_list.empty() ? "" : " ";
+            field_list += output_field_names[i].name;
+        }
+    }
+    pretty_print("output_fields:     %-s", field_list.c_str());
     pretty_print("gzip:              %-s", tmp_gzip);
+    if (!options.stream_output.empty()) {
+        pretty_print("stream_output:     %-s", options.stream_output.c_str());
+    }
+    if (options.trajectory) {
+        string column_list = options.trajectory_columns.empty() ? "all" : "";
+        for (const auto& column : options.trajectory_columns) {
+            column_list += column_list.empty() ? "" : " ";
+            column_list += (column.x < 0) ? string("center") :
+                           to_string(column.x) + "," + to_string(column.y);
+        }
+        string level_list = options.trajectory_levels.empty() ? "all" : "";
+        for (int level : options.trajectory_levels) {
+            level_list += (level_list.empty() ? "" : " ") + to_string(level);
+        }
+        pretty_print("trajectory:        %-s", "on");
+        pretty_print("trajectory_columns: %-s", column_list.c_str());
+        pretty_print("trajectory_levels: %-s", level_list.c_str());
+    }
     pretty_print("statistics:        %-s", tmp_statistics);
+    pretty_print("progress_interval: %-8.4f", options.progress_interval);
+    pretty_print("status_file:       %-s", options.status_file ? "on" : "off");
     pretty_print("");
     return;
 }
 
+// Atoms read from a part of an XYZ file
+struct XYZChunk {
+    vector<string> types;
+    vector<Vec3d> positions;
+    vector<double> charges;
+    vector<int> fixed;
+    const char* error_line = nullptr;  // The first line that couldn't be read
+};
+
+// Whitespace within a line
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// Returns the end of the line starting at line (the newline or end)
+static inline const char* lineEnd(const char* line, const char* end) {
+    const char* newline = static_cast<const char*>(memchr(line, '\n', end - line));
+    return newline != nullptr ? newline : end;
+}
+
+// Same as checkForComments, lines that are only whitespace are skipped as well
+static bool isXYZCommentLine(const char* line, const char* line_end) {
+    if (line == line_end || *line == '#' || *line == '%') {
+        return true;
+    }
+    while (line < line_end && isBlank(*line)) {
+        line++;
+    }
+    return line == line_end;
+}
+
+// Splits a line into at most max_tokens tokens and returns the number of tokens found
+static int tokenizeLine(const char* line, const char* line_end, int max_tokens,
+                        const char** tokens, const char** token_ends) {
+    int n_tokens = 0;
+    const char* p = line;
+    while (n_tokens < max_tokens) {
+        while (p < line_end && isBlank(*p)) {
+            p++;
+        }
+        if (p == line_end) {
+            break;
+        }
+        tokens[n_tokens] = p;
+        while (p < line_end && !isBlank(*p)) {
+            p++;
+        }
+        token_ends[n_tokens++] = p;
+    }
+    return n_tokens;
+}
+
+// Reads all the atom lines in [begin, end), which have n_columns columns
+static void readXYZChunk(const char* begin, const char* end, int n_columns, XYZChunk& chunk) {
+    const char* tokens[6];
+    const char* token_ends[6];
+    for (const char* line = begin; line < end;) {
+        const char* line_end = lineEnd(line, end);
+        if (!isXYZCommentLine(line, line_end)) {
+            bool valid = tokenizeLine(line, line_end, n_columns, tokens, token_ends) == n_columns;
+            double values[4] = {0, 0, 0, 0};
+            for (int c = 1; valid && c < n_columns && c < 5; ++c) {
+                valid = parseDouble(tokens[c], token_ends[c], values[c - 1]) == token_ends[c];
+            }
+            int fixed = 0;
+            if (valid && n_columns == 6) {
+                double fixed_value;
+                valid = parseDouble(tokens[5], token_ends[5], fixed_value) == token_ends[5];
+                fixed = static_cast<int>(fixed_value);
+            }
+            if (!valid) {
+                chunk.error_line = line;
+                return;
+            }
+            chunk.types.emplace_back(tokens[0], token_ends[0]);
+            chunk.positions.push_back(Vec3d(values[0], values[1], values[2]));
+            chunk.charges.push_back(values[3]);
+            chunk.fixed.push_back(fixed);
+        }
+        line = line_end + 1;
+    }
+}
+
 // Read the XYZ file
 void readXYZFile(Simulation& simulation) {
     InputOptions& options = simulation.options_;
     System& system = simulation.system;
 
-    FILE *fp;
-    bool firstline, realxyz;
-    char line[LINE_LENGTH], value[NAME_LENGTH];
-
-    // Read the file once, to determine the number of atoms
-    fp = fopen(options.xyzfile.c_str(), "r");
-    if (fp == NULL) {
-        error("No such file: %s!", options.xyzfile.c_str());
+    unique_ptr<MappedFile> file;
+    try {
+        file.reset(new MappedFile(options.xyzfile));
+    } catch (runtime_error& e) {
+        error("%s!", e.what());
     }
+    const char* begin = file->data();
+    const char* end = begin + file->size();
+
+    // If the first line contains an integer, it is most likely a proper XYZ file.
+    // Then the first two lines are the number of atoms and a comment.
+    bool realxyz = false;
     int n_atoms = 0;
-    firstline = true;
-    realxyz = false;
-    while (fgets(line, LINE_LENGTH, fp) != NULL) {
-        // Skip empty and commented lines
-        if (checkForComments(line)) {
+    const char* body = begin;
+    for (const char* line = begin; line < end; line = lineEnd(line, end) + 1) {
+        const char* line_end = lineEnd(line, end);
+        if (isXYZCommentLine(line, line_end)) {
             continue;
         }
-        // If the first line contains an integer, it is most likely a proper XYZ file
-        if (firstline) {
-            sscanf(line, "%s", value);
-            if (isint(value)) {
-                n_atoms = atoi(value);
-                realxyz = true;
-                break;
+        const char* token = line;
+        const char* token_end = line;
+        tokenizeLine(line, line_end, 1, &token, &token_end);
+        char value[NAME_LENGTH];
+        snprintf(value, NAME_LENGTH, "%.*s", static_cast<int>(token_end - token), token);
+        if (isint(value)) {
+            realxyz = true;
+            n_atoms = atoi(value);
+            for (int n = 0; n < 2 && body < end; ++n) {
+                body = lineEnd(body, end) + 1;
+            }
+        }
+        break;
+    }
+    body = min(body, end);
+
+    // Based on the first line with actual atom information, determine how many columns there are
+    int n_columns = 0;
+    for (const char* line = body; line < end; line = lineEnd(line, end) + 1) {
+        const char* line_end = lineEnd(line, end);
+        if (!isXYZCommentLine(line, line_end)) {
+            const char* tokens[7];
+            const char* token_ends[7];
+            n_columns = tokenizeLine(line, line_end, 7, tokens, token_ends);
+            if (n_columns < 4 || n_columns > 6) {
+                error("Invalid number of columns in the xyz file.");
             }
-            firstline = false;
+            break;
         }
-        // Otherwise continue reading the lines and count how many atoms we have
-        if (!firstline) {
-            // Count useful lines
-            n_atoms++;
+    }
+
+    // Read the file in chunks of whole lines in parallel
+    const size_t chunk_size = 1 << 20;
+    size_t n_chunks = (end - body) / chunk_size + 1;
+    vector<const char*> chunk_starts(n_chunks + 1, end);
+    chunk_starts[0] = body;
+    for (size_t c = 1; c < n_chunks; ++c) {
+        const char* start = max(body + c * chunk_size, chunk_starts[c - 1]);
+        chunk_starts[c] = min(lineEnd(start, end) + 1, end);
+    }
+    vector<XYZChunk> chunks(n_chunks);
+    if (n_columns > 0) {
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t c = 0; c < n_chunks; ++c) {
+            readXYZChunk(chunk_starts[c], chunk_starts[c + 1], n_columns, chunks[c]);
         }
     }
-    rewind(fp);
+
+    // The atoms are used up to the first line that couldn't be read. In a proper XYZ
+    // file any lines after the given number of atoms (eg. more frames) are ignored.
+    int n_read = 0;
+    const char* error_line = nullptr;
+    for (const auto& chunk : chunks) {
+        n_read += chunk.types.size();
+        if (chunk.error_line != nullptr) {
+            error_line = chunk.error_line;
+            break;
+        }
+    }
+    if (!realxyz) {
+        n_atoms = n_read;
+    }
+    if (n_read < n_atoms || (!realxyz && error_line != nullptr)) {
+        if (error_line != nullptr) {
+            int line_number = count(begin, error_line, '\n') + 1;
+            error("Could not read line %d of the xyz file!", line_number);
+        }
+        error("The xyz file has %d atoms instead of %d!", n_read, n_atoms);
+    }
 
     // Initialize the system and set the tip and dummy types which aren't
     // in the parameter file.
@@ -519,49 +1283,25 @@ void readXYZFile(Simulation& simulation) {
     system.types_[0] = options.dummyatom;
     system.types_[1] = options.tipatom;
 
-    // Read each line and store the data
-    int atom_i = 2;  // Start indexing from 2 so that we don't overwrite the tip or dummy
-    int n = 0, ncols = 0;
-    char dump[LINE_LENGTH], *pch;
-    firstline = true;
-    while (fgets(line, LINE_LENGTH, fp) != NULL) {
-        // If it is a real XYZ file, skip the first two lines
-        if ((realxyz) && (n < 2)) {
-            n++;
-            continue;
-        }
-        // Skip empty and commented lines
-        if (checkForComments(line)) {
-            continue;
-        }
-        // Based on the first line with actual atom information, determine how many columns there are
-        if (firstline) {
-            strcpy(dump, line);
-            pch = strtok(dump, " \t\n\r\f");
-            while (pch != NULL) {
-                pch = strtok(NULL, " \t\n\r\f");
-                ncols++;
+    // Store the data. Start indexing from 2 so that we don't overwrite the tip or dummy
+    vector<int> chunk_offsets(n_chunks + 1, 2);
+    for (size_t c = 0; c < n_chunks; ++c) {
+        chunk_offsets[c + 1] = chunk_offsets[c] + chunks[c].types.size();
+    }
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t c = 0; c < n_chunks; ++c) {
+        XYZChunk& chunk = chunks[c];
+        for (size_t a = 0; a < chunk.types.size(); ++a) {
+            int atom_i = chunk_offsets[c] + a;
+            if (atom_i >= n_atoms + 2) {
+                break;
             }
-            firstline = false;
-        }
-        char type[ATOM_LENGTH];
-        double x, y, z, q = 0;
-        int fixed = 0;
-        if (ncols == 4) {
-            sscanf(line, "%s %lf %lf %lf", type, &x, &y, &z);
-        } else if (ncols == 5) {
-            sscanf(line, "%s %lf %lf %lf %lf", type, &x, &y, &z, &q);
-        } else if (ncols == 6) {
-            sscanf(line, "%s %lf %lf %lf %lf %d", type, &x, &y, &z, &q, &fixed);
-        } else {
-            error("Invalid number of columns in the xyz file.");
-        }
-        system.types_[atom_i] = std::string(type);
-        system.positions_[atom_i] = Vec3d(x, y, z);
-        system.charges_[atom_i] = q;
-        // Keep atoms fixed if we're not flexible.
-        system.fixed_[atom_i] = options.flexible ? fixed : 1;
-        atom_i++;
+            system.types_[atom_i] = std::move(chunk.types[a]);
+            system.positions_[atom_i] = chunk.positions[a];
+            system.charges_[atom_i] = chunk.charges[a];
+            // Keep atoms fixed if we're not flexible.
+            system.fixed_[atom_i] = options.flexible ? chunk.fixed[a] : 1;
+        }
     }
 
     // Quickly check whether charges were read from the XYZ file
@@ -1,9 +1,24 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
 #include "simulation.hpp"
 
+using namespace std;
+
+// A scan of a campaign, which runs many scans in one job
+struct CampaignScan {
+    string inputfile;
+    string outputfolder;
+    double cost;  // Relative cost used for dividing the processes between the scans
+};
+
 bool checkForComments(char* line);
+void printBanner();
 void parseCommandLine(int argc, char* argv[], Simulation& simulation);
+void setScanFiles(Simulation& simulation, const string& inputfile, const string& outputfolder);
+vector<CampaignScan> readCampaignFile(const string& campaignfile);
 void readInputFile(Simulation& simulation);
 void readXYZFile(Simulation& simulation);
 void readParameterFile(Simulation& simulation);
@@ -0,0 +1,200 @@
+#include "progress.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#include "messages.hpp"
+
+using namespace std;
+
+
+// Formats seconds as h:mm:ss
+static string formatDuration(double seconds) {
+    long total = lround(max(seconds, 0.0));
+    char formatted[32];
+    sprintf(formatted, "%ld:%02ld:%02ld", total / 3600, (total / 60) % 60, total % 60);
+    return formatted;
+}
+
+
+void ProgressReporter::start(unsigned long total_points, int n_processes, int process,
+                             double interval, const string& status_file) {
+#ifdef _OPENMP
+    n_threads_ = omp_get_max_threads();
+#else
+    n_threads_ = 1;
+#endif
+    const size_t alignment = alignof(ThreadCounters);
+    thread_storage_.reset(new char[n_threads_ * sizeof(ThreadCounters) + alignment]);
+    uintptr_t address = reinterpret_cast<uintptr_t>(thread_storage_.get());
+    threads_ = reinterpret_cast<ThreadCounters*>((address + alignment - 1) / alignment * alignment);
+    for (int t = 0; t < n_threads_; ++t) {
+        new (&threads_[t]) ThreadCounters;
+        threads_[t].points = 0;
+        threads_[t].steps = 0;
+        threads_[t].busy_ns = 0;
+    }
+    n_processes_ = n_processes;
+    process_ = process;
+    processes_.reset(new ProcessTotals[n_processes_]);
+    for (int p = 0; p < n_processes_; ++p) {
+        processes_[p].points = 0;
+        processes_[p].steps = 0;
+        processes_[p].busy_seconds = 0;
+        processes_[p].n_threads = 0;
+    }
+    total_points_ = total_points;
+    interval_ = interval;
+    status_file_ = status_file;
+    start_time_ = chrono::steady_clock::now();
+    next_report_ = (long long)(interval_ * 1e9);
+}
+
+
+void ProgressReporter::addWork(unsigned long points, unsigned long steps, double busy_seconds) {
+#ifdef _OPENMP
+    ThreadCounters& counters = threads_[omp_get_thread_num()];
+#else
+    ThreadCounters& counters = threads_[0];
+#endif
+    // Only this thread writes the counters, the reports only need them to be atomic
+    counters.points.fetch_add(points, memory_order_relaxed);
+    counters.steps.fetch_add(steps, memory_order_relaxed);
+    counters.busy_ns.fetch_add((long long)(busy_seconds * 1e9), memory_order_relaxed);
+}
+
+
+void ProgressReporter::packTotals(vector<double>& packed) const {
+    double points = 0, steps = 0, busy_seconds = 0;
+    for (int t = 0; t < n_threads_; ++t) {
+        points += threads_[t].points.load(memory_order_relaxed);
+        steps += threads_[t].steps.load(memory_order_relaxed);
+        busy_seconds += 1e-9 * threads_[t].busy_ns.load(memory_order_relaxed);
+    }
+    packed.insert(packed.end(), {points, steps, busy_seconds, (double)n_threads_});
+}
+
+
+void ProgressReporter::setRemoteTotals(int process, const double* packed) {
+    // The totals only grow, so the latest ones replace the earlier
+    processes_[process].points = packed[0];
+    processes_[process].steps = packed[1];
+    processes_[process].busy_seconds = packed[2];
+    processes_[process].n_threads = packed[3];
+}
+
+
+double ProgressReporter::elapsed() const {
+    return chrono::duration<double>(chrono::steady_clock::now() - start_time_).count();
+}
+
+
+void ProgressReporter::poll() {
+    long long now = (long long)(elapsed() * 1e9);
+    long long due = next_report_.load(memory_order_relaxed);
+    if (now < due) {
+        return;
+    }
+    // Only the thread that moves the next report forward reports
+    if (next_report_.compare_exchange_strong(due, now + (long long)(interval_ * 1e9))) {
+        report(false);
+    }
+}
+
+
+void ProgressReporter::finish() {
+    report(true);
+}
+
+
+void ProgressReporter::report(bool finished) {
+    double time = elapsed();
+    unsigned long points = 0, steps = 0;
+    double busy_seconds = 0;
+    vector<double> thread_use(n_threads_, 0);
+    for (int t = 0; t < n_threads_; ++t) {
+        points += threads_[t].points.load(memory_order_relaxed);
+        steps += threads_[t].steps.load(memory_order_relaxed);
+        double busy = 1e-9 * threads_[t].busy_ns.load(memory_order_relaxed);
+        busy_seconds += busy;
+        if (time > 0) {
+            thread_use[t] = busy / time;
+        }
+    }
+    // The use of each process is the mean over its threads
+    vector<double> process_use(n_processes_, 0);
+    if (time > 0) {
+        process_use[process_] = busy_seconds / (time * n_threads_);
+    }
+    int n_all_threads = n_threads_;
+    for (int p = 0; p < n_processes_; ++p) {
+        int n_threads = processes_[p].n_threads;
+        if (p == process_ || n_threads == 0) {
+            continue;
+        }
+        points += processes_[p].points;
+        steps += processes_[p].steps;
+        busy_seconds += processes_[p].busy_seconds;
+        n_all_threads += n_threads;
+        if (time > 0) {
+            process_use[p] = processes_[p].busy_seconds / (time * n_threads);
+        }
+    }
+    double points_per_second = (time > 0) ? points / time : 0;
+    double steps_per_second = (time > 0) ? steps / time : 0;
+    double thread_share = (time > 0) ? busy_seconds / (time * n_all_threads) : 0;
+    double fraction = (total_points_ > 0) ? (double)points / total_points_ : 1;
+    string eta = "unknown";
+    if (finished) {
+        eta = formatDuration(0);
+    } else if (points > 0) {
+        eta = formatDuration((total_points_ - points) / points_per_second);
+    }
+
+    if (!finished) {
+        pretty_print("Finished %4.1f %% of the simulation, %.2f points/s, %.0f steps/s, "
+                     "%s left, %.0f %% thread use", 100 * fraction, points_per_second,
+                     steps_per_second, eta.c_str(), 100 * thread_share);
+    }
+    if (status_file_.empty()) {
+        return;
+    }
+
+    // The file is renamed over the old one, which replaces it at once
+    string temp_file = status_file_ + ".tmp";
+    FILE* fp = fopen(temp_file.c_str(), "w");
+    if (fp == nullptr) {
+        warning("Cannot write the status file %s!", temp_file.c_str());
+        return;
+    }
+    fprintf(fp, "state %s\n", finished ? "finished" : "running");
+    fprintf(fp, "elapsed %.3f\n", time);
+    fprintf(fp, "points %lu\n", points);
+    fprintf(fp, "points_total %lu\n", total_points_);
+    fprintf(fp, "progress %.6f\n", fraction);
+    fprintf(fp, "steps %lu\n", steps);
+    fprintf(fp, "points_per_second %.6g\n", points_per_second);
+    fprintf(fp, "steps_per_second %.6g\n", steps_per_second);
+    fprintf(fp, "eta %s\n", eta.c_str());
+    fprintf(fp, "thread_use %.4f\n", thread_share);
+    // The threads of the root process and the mean over the threads of each process
+    fprintf(fp, "root_thread_use");
+    for (double use : thread_use) {
+        fprintf(fp, " %.4f", use);
+    }
+    fprintf(fp, "\nprocess_use");
+    for (double use : process_use) {
+        fprintf(fp, " %.4f", use);
+    }
+    fprintf(fp, "\n");
+    fclose(fp);
+    if (rename(temp_file.c_str(), status_file_.c_str()) != 0) {
+        warning("Cannot replace the status file %s!", status_file_.c_str());
+    }
+}
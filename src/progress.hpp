@@ -0,0 +1,87 @@
+/*
+ * progress.hpp
+ *
+ * ProgressReporter keeps count of the scanned points and the minimisation
+ * steps of each thread and reports the progress, the throughput and the
+ * estimated time left, both to the log and to a status file.
+ *
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** \brief Progress counters of the scan threads.
+ *
+ * Each thread adds its work to counters of its own with relaxed atomics, so
+ * counting costs next to nothing. The other processes send their totals to
+ * the root process along with their results, which is the only process that
+ * reports. A report is made at most once per interval by the first thread
+ * that notices it's due, the other threads carry on scanning. The status
+ * file is replaced as a whole, so a monitor polling it never sees a partial
+ * file.
+ */
+
+class ProgressReporter {
+public:
+    // the number of values packTotals appends
+    static const int packed_size = 4;
+
+    ProgressReporter(): n_threads_(0), threads_(nullptr), n_processes_(0), process_(0), total_points_(0), interval_(0), next_report_(0) {};
+
+    // starts the clock for a run of total_points x, y points over all the processes,
+    // reporting every interval seconds to the log and the status file (empty = none).
+    // process is the number of this process.
+    void start(unsigned long total_points, int n_processes, int process, double interval,
+               const string& status_file);
+    // adds the points and steps scanned by the calling thread in busy_seconds
+    void addWork(unsigned long points, unsigned long steps, double busy_seconds);
+    // appends the totals of this process to packed for the root process
+    void packTotals(vector<double>& packed) const;
+    // stores the totals of another process unpacked from packed
+    void setRemoteTotals(int process, const double* packed);
+    // reports if the interval has passed since the last report
+    void poll();
+    // makes the final report
+    void finish();
+
+private:
+    // the counters of each thread fill a cache line of their own, so the threads don't
+    // invalidate each other's counters
+    struct alignas(64) ThreadCounters {
+        atomic<unsigned long> points;
+        atomic<unsigned long> steps;
+        atomic<long long> busy_ns;
+    };
+    struct ProcessTotals {
+        atomic<unsigned long> points;
+        atomic<unsigned long> steps;
+        atomic<double> busy_seconds;
+        atomic<int> n_threads;
+    };
+
+    // returns the seconds since the start
+    double elapsed() const;
+    // prints the progress and writes the status file
+    void report(bool finished);
+
+    int n_threads_;
+    // new doesn't align to a cache line before C++17, so the counters are placed in
+    // storage aligned by hand
+    unique_ptr<char[]> thread_storage_;
+    ThreadCounters* threads_;
+    int n_processes_;
+    int process_;
+    unique_ptr<ProcessTotals[]> processes_;  // The totals of the other processes (root only)
+    unsigned long total_points_;
+    double interval_;
+    string status_file_;
+    chrono::steady_clock::time_point start_time_;
+    atomic<long long> next_report_;  // Nanoseconds since the start
+};
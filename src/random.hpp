@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+
+#include "globals.hpp"
+
+/*
+ * Small and fast pseudo random number generator (xoshiro256+) for the thermal
+ * sampling. Every generator is seeded independently from a hash of the seed and
+ * the indices of the scan point, so the random streams don't depend on how the
+ * points are distributed over the threads and processes.
+ */
+
+// Mixes the bits of x (splitmix64 finalizer)
+inline uint64_t splitmix64(uint64_t& x) {
+    uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Combines a seed with a value to a new seed
+inline uint64_t hashSeed(uint64_t seed, uint64_t value) {
+    uint64_t x = seed ^ (value * 0xd1b54a32d192ed03ULL);
+    return splitmix64(x);
+}
+
+class Random {
+ public:
+    explicit Random(uint64_t seed): has_normal_(false), next_normal_(0) {
+        for (int i = 0; i < 4; ++i) {
+            state_[i] = splitmix64(seed);
+        }
+    }
+    // Returns a uniformly distributed 64 bit integer
+    uint64_t next() {
+        const uint64_t result = state_[0] + state_[3];
+        const uint64_t t = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= t;
+        state_[3] = rotl(state_[3], 45);
+        return result;
+    }
+    // Returns a uniformly distributed number in [0, 1)
+    double uniform() {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+    // Returns a normally distributed number with zero mean and unit variance (Box-Muller)
+    double normal() {
+        if (has_normal_) {
+            has_normal_ = false;
+            return next_normal_;
+        }
+        double u1 = 1.0 - uniform();  // In (0, 1] so that the logarithm is finite
+        double u2 = uniform();
+        double r = sqrt(-2.0 * log(u1));
+        next_normal_ = r * sin(2 * PI * u2);
+        has_normal_ = true;
+        return r * cos(2 * PI * u2);
+    }
+    // Returns a vector of three normally distributed numbers
+    Vec3d normalVec3d() {
+        double x = normal();
+        double y = normal();
+        double z = normal();
+        return Vec3d(x, y, z);
+    }
+
+ private:
+    static uint64_t rotl(const uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    uint64_t state_[4];
+    bool has_normal_;
+    double next_normal_;
+};
@@ -3,9 +3,12 @@
 #if MPI_BUILD
     #include <mpi.h>
 #endif
+#include <algorithm>
 #include <cmath>
 #include <deque>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <unordered_map>
@@ -20,7 +23,11 @@
 #include "interactions.hpp"
 #include "messages.hpp"
 #include "matrices.hpp"
+#include "npy_io.hpp"
+#include "random.hpp"
+#include "thermal.hpp"
 #include "vectors.hpp"
+#include "xsf_io.hpp"
 
 using namespace std;
 
@@ -29,176 +36,885 @@ bool Simulation::rootProcess() {
 }
 
 void Simulation::initialize() {
-    // Rotate system if z axis is not perpendicular to the surface
-    if (options_.normal == NORMAL_X) {
-        system.rotateCoordAxes("YZX");
-    } else if (options_.normal == NORMAL_Y) {
-        system.rotateCoordAxes("ZXY");
-    }
+    // Transform the system to the scan frame, where the tip approaches along -z
+    system.transformCoordinates(options_.frame);
     
     // If pbc for vdw is on, get the unit cell vectors from electrostatic potential file
     // or use the ones given in input file
     if (options_.vdw_pbc) {
         if (options_.use_external_potential) {
-            CubeReader cube_file(options_.e_potential_file);
-            Vec3i n_voxels = cube_file.getNVoxels();
-            vector<Vec3d> voxel_vectors = cube_file.getVoxelVectors();
+            unique_ptr<VolumeReader> potential_file = openVolumeFile(options_.e_potential_files[0]);
+            Vec3i n_voxels = potential_file->getNVoxels();
+            vector<Vec3d> voxel_vectors = potential_file->getVoxelVectors();
             vector<Vec3d> cell_vectors;
-            cell_vectors.push_back(n_voxels.x * voxel_vectors[0]);
-            cell_vectors.push_back(n_voxels.y * voxel_vectors[1]);
-            cell_vectors.push_back(n_voxels.z * voxel_vectors[2]);
+            cell_vectors.push_back(options_.frame.multiply(n_voxels.x * voxel_vectors[0]));
+            cell_vectors.push_back(options_.frame.multiply(n_voxels.y * voxel_vectors[1]));
+            cell_vectors.push_back(options_.frame.multiply(n_voxels.z * voxel_vectors[2]));
             system.setUnitCell(cell_vectors);
         }
         else {
             vector<Vec3d> cell_vectors;
-            cell_vectors.push_back(options_.cell_a);
-            cell_vectors.push_back(options_.cell_b);
-            cell_vectors.push_back(options_.cell_c);
+            cell_vectors.push_back(options_.frame.multiply(options_.cell_a));
+            cell_vectors.push_back(options_.frame.multiply(options_.cell_b));
+            cell_vectors.push_back(options_.frame.multiply(options_.cell_c));
             system.setUnitCell(cell_vectors);
         }
     }
     
     system.centerMolecule(options_.center);
     system.setMoleculeZ();
-    calculateTipDummyDistance();
-    buildInteractions();
+
+    // Build a separate system and interaction list for each tip. The surface
+    // is the same for all of them, only the tip and dummy atoms differ.
+    unordered_map<string, AtomParameters>& ap = interaction_parameters_.atom_parameters;
+    for (unsigned int t = 0; t < options_.tipatoms.size(); ++t) {
+        TipSetup tip;
+        tip.tipatom = options_.tipatoms[t];
+        tip.dummyatom = options_.dummyatoms[t];
+        if (ap.find(tip.dummyatom) == ap.end()) {
+            error("Parameters for atom type %s not found in parameter file!", tip.dummyatom.c_str());
+        }
+        if (ap.find(tip.tipatom) == ap.end()) {
+            error("Parameters for atom type %s not found in parameter file!", tip.tipatom.c_str());
+        }
+        if (options_.tipatoms.size() > 1) {
+            pretty_print("Building interactions for tip %s with dummy %s",
+                         tip.tipatom.c_str(), tip.dummyatom.c_str());
+        }
+        system.types_[0] = tip.dummyatom;
+        system.types_[1] = tip.tipatom;
+        system.charges_[0] = ap[tip.dummyatom].q;
+        system.charges_[1] = ap[tip.tipatom].q;
+        calculateTipDummyDistance();
+        interactions_.clear();
+        slow_interactions_.clear();
+        buildInteractions();
+        tip.interactions.swap(interactions_);
+        tip.slow_interactions.swap(slow_interactions_);
+        tip.system = system;
+        tips_.push_back(move(tip));
+        TipSetup& added = tips_.back();
+        added.system.interactions_ = &added.interactions;
+        if (system.slow_interactions_ != nullptr) {
+            added.system.slow_interactions_ = &added.slow_interactions;
+        }
+    }
+    // The sample density was only needed to build the overlap interactions
+    {
+        vector<complex<double>> released;
+        density_kspace_.swapValues(released);
+    }
+    system = tips_[0].system;
+    initVolumes();
+}
+
+string Simulation::tipOutputFolder(int tip) const {
+    if (options_.tipatoms.size() == 1) {
+        return options_.outputfolder;
+    }
+#ifdef _WIN32
+    return options_.outputfolder + options_.tipatoms[tip] + "\\";
+#else
+    return options_.outputfolder + options_.tipatoms[tip] + "/";
+#endif
 }
 
 void Simulation::run() {
-    const double report_interval = 0.1;
-    double next_report = report_interval;
-    int processed_points = 0;
     const int total_points = n_points_.x * n_points_.y;
-
-    const unsigned int buffer_size = options_.bufsize * n_points_.z;
-    vector<OutputData> output_buffer;
-    output_buffer.reserve(buffer_size);
+    const int n_tips = tips_.size();
+    const int n_branches = options_.retract ? 2 : 1;
+    initOutputSlabs();
     pretty_print("Starting simulation");
+    string status_file = (options_.status_file && rootProcess()) ?
+                         options_.outputfolder + "status.txt" : "";
+    progress_.start(total_points, n_processes_, current_process_, options_.progress_interval,
+                    status_file);
 
+    // Each x row is scanned by a single thread directly into its own slab of the
+    // result volume, so no locking is needed. Completed slabs are written in order.
 #pragma omp parallel for schedule(dynamic, 1)
     for (int i = 0; i < n_points_.x; ++i) {
-        double x = i * options_.dx;
+        unsigned long n_steps = 0;
+        unsigned long n_hysteresis = 0;
+        int n_row_points = 0;
         for (int j = 0; j < n_points_.y; ++j) {
-            double y = j * options_.dy;
-
             int current_point = i * n_points_.y + j;
-            processed_points++;
             // Check if this point is handled by this process
             if (current_point % n_processes_ != current_process_) {
                 continue;
-            } else {
-                points_per_process_[current_process_]++;
-            }
-
-            System min_system = system;  // Take a copy for each z approach
-            vector<OutputData> z_data(n_points_.z);
-            if (min_system.interactions_ == nullptr) {
-                error("System interactions are not given!");
-            }
-            if (options_.rigidgrid)
-                min_system.setTipPbc(false);
-            min_system.setDummyXY(x, y);
-            min_system.setDummyZ(options_.zhigh);
-            for (int k = 0; k < n_points_.z; ++k) {
-                int n = 0;
-                switch (options_.minimiser_type) {
-                    case STEEPEST_DESCENT:
-                        n = SDMinimisation(min_system, options_);
-                        break;
-                    case FIRE:
-                        n = FIREMinimisation(min_system, options_);
-                        break;
-                    default:
-                        error("Unimplemented minimiser type!");
+            }
+            n_row_points++;
+
+            // All the tips are scanned over the same column before moving on,
+            // so the surface data is reused while it is still in cache
+            auto column_start = chrono::steady_clock::now();
+            unsigned long column_steps = n_steps;
+            OutputData* column_data = slabRecord(i, j);
+            bool write_xyz = options_.flexible && !options_.trajectory &&
+                             current_point == total_points / 2;
+            for (int tip = 0; tip < n_tips; ++tip) {
+                scanColumn(tip, i, j, write_xyz, column_data + tip * n_branches * n_points_.z,
+                           n_steps, n_hysteresis);
+            }
+            chrono::duration<double> column_time = chrono::steady_clock::now() - column_start;
+            progress_.addWork(1, n_steps - column_steps, column_time.count());
+            if (rootProcess()) {
+                progress_.poll();
+            }
+        } // y
+#pragma omp atomic
+        n_total_ += n_steps;
+#pragma omp atomic
+        n_hysteresis_ += n_hysteresis;
+#pragma omp atomic
+        points_per_process_[current_process_] += n_row_points;
+        finishSlab(i, n_row_points);
+    } // x
+    // Write the slabs that are still missing
+    flushSlabs();
+    if (rootProcess()) {
+        progress_.finish();
+    }
+}
+
+void Simulation::scanColumn(int tip, int i, int j, bool write_xyz, OutputData* z_data,
+                            unsigned long& n_steps, unsigned long& n_hysteresis) {
+    double x = i * options_.dx;
+    double y = j * options_.dy;
+
+    System min_system = tips_[tip].system;  // Take a copy for each z approach
+    if (min_system.interactions_ == nullptr) {
+        error("System interactions are not given!");
+    }
+    if (options_.rigidgrid)
+        min_system.setTipPbc(false);
+    min_system.setDummyXY(x, y);
+    min_system.setDummyZ(options_.zhigh);
+    for (int k = 0; k < n_points_.z; ++k) {
+        int n = minimiseSystem(min_system);
+        if (write_xyz) {
+            min_system.makeXYZFile(tipOutputFolder(tip));
+        }
+        z_data[k] = min_system.getOutput(record_fields_);
+        z_data[k].indices = Vec3i(i, j, k);
+        z_data[k].minimisation_steps = n;
+        z_data[k].branch = APPROACH;
+        z_data[k].tip = tip;
+        recordTrajectory(min_system, z_data[k]);
+        if (options_.temperature > 0) {
+            sampleThermalForces(min_system, z_data[k]);
+        }
+        n_steps += n;
+        min_system.lowerTip(options_.dz);
+    } // z
+
+    // Retract back up through the same z levels continuing from the relaxed state.
+    // The turning point is shared by both branches, so it isn't minimised again.
+    if (options_.retract) {
+        min_system.raiseTip(options_.dz);
+        OutputData& turning_point = z_data[2 * n_points_.z - 1];
+        turning_point = z_data[n_points_.z - 1];
+        turning_point.branch = RETRACT;
+        for (int k = n_points_.z - 2; k >= 0; --k) {
+            min_system.raiseTip(options_.dz);
+            int n = minimiseSystem(min_system);
+            OutputData& data = z_data[n_points_.z + k];
+            data = min_system.getOutput(record_fields_);
+            data.indices = Vec3i(i, j, k);
+            data.minimisation_steps = n;
+            data.branch = RETRACT;
+            data.tip = tip;
+            recordTrajectory(min_system, data);
+            if (options_.temperature > 0) {
+                sampleThermalForces(min_system, data);
+            }
+            n_steps += n;
+            // Count the points where the branches ended up in different minima
+            if ((data.tip_force - z_data[k].tip_force).len() > options_.ftol) {
+                n_hysteresis++;
+            }
+        } // z
+    }
+}
+
+int Simulation::minimiseSystem(System& min_system) const {
+    int n = 0;
+    switch (options_.minimiser_type) {
+        case STEEPEST_DESCENT:
+            n = SDMinimisation(min_system, options_);
+            break;
+        case FIRE:
+            n = FIREMinimisation(min_system, options_);
+            break;
+        default:
+            error("Unimplemented minimiser type!");
+    }
+    return n;
+}
+
+void Simulation::sampleThermalForces(const System& min_system, OutputData& data) const {
+    // The random stream depends only on the scan point, not on which thread or
+    // process happens to handle it
+    uint64_t seed = hashSeed(options_.seed, data.tip);
+    seed = hashSeed(seed, data.branch);
+    seed = hashSeed(seed, data.indices.x);
+    seed = hashSeed(seed, data.indices.y);
+    seed = hashSeed(seed, data.indices.z);
+    thermalSampling(min_system, options_, seed, data.thermal_force, data.thermal_variance);
+}
+
+void Simulation::initVolumes() {
+    if (options_.volume_output.empty() || !rootProcess()) {
+        return;
+    }
+    const int n_branches = options_.retract ? 2 : 1;
+    volumes_.resize(tips_.size() * n_branches * N_VOLUME_FIELDS);
+    for (auto& volume : volumes_) {
+        volume.initValues(n_points_.x, n_points_.y, n_points_.z, 0.0);
+        volume.setSpacing(options_.dx, options_.dy, options_.dz);
+        volume.setOrigin(0.0, 0.0, options_.zlow);
+    }
+}
+
+void Simulation::storeVolumeData(const OutputData& data) {
+    const int n_branches = options_.retract ? 2 : 1;
+    DataGrid<double>* volumes = &volumes_[(data.tip * n_branches + data.branch) * N_VOLUME_FIELDS];
+    // The scan goes down from zhigh, the volumes go up from zlow
+    int ix = data.indices.x;
+    int iy = data.indices.y;
+    int iz = n_points_.z - 1 - data.indices.z;
+    volumes[VOLUME_FZ].at(ix, iy, iz) = data.tip_force.z;
+    volumes[VOLUME_ENERGY].at(ix, iy, iz) = data.tip_energy;
+    volumes[VOLUME_DX].at(ix, iy, iz) = data.r_vec.x;
+    volumes[VOLUME_DY].at(ix, iy, iz) = data.r_vec.y;
+    volumes[VOLUME_DZ].at(ix, iy, iz) = data.r_vec.z;
+}
+
+bool Simulation::computeFrequencyShift(const DataGrid<double>& fz, DataGrid<double>& df) const {
+    // Frequency shift with the weight function of Giessibl (Beilstein J. Nanotechnol. 3:238, 2012),
+    // df(z) = -f0 / (pi k A^2) * sum_u F(z + u) u / sqrt(A^2 - u^2) dz, with u over the
+    // z levels strictly inside the oscillation. df is given at the center of the oscillation.
+    const double dz = options_.dz;
+    const double amplitude = options_.amplitude;
+    double k = options_.k_cantilever;
+    if (options_.units == U_KCAL) {
+        k *= g_Nm_to_kcal;
+    } else if (options_.units == U_KJ) {
+        k *= g_Nm_to_kJ;
+    } else if (options_.units == U_EV) {
+        k *= g_Nm_to_eV;
+    }
+    int n_osc = ceil(amplitude / dz) - 1;
+    vector<double> weights(2 * n_osc + 1);
+    for (int m = -n_osc; m <= n_osc; ++m) {
+        double u = m * dz;
+        weights[m + n_osc] = u / sqrt(amplitude * amplitude - u * u);
+    }
+    const double factor = -options_.f0 / (PI * k * amplitude * amplitude) * dz;
+
+    const Vec3i& n_grid = fz.getNGrid();
+    int n_levels = n_grid.z - 2 * n_osc;
+    if (n_osc < 1 || n_levels < 1) {
+        return false;
+    }
+    df.initValues(n_grid.x, n_grid.y, n_levels, 0.0);
+    df.setSpacing(fz.getSpacing());
+    df.setOrigin(fz.getOrigin() + Vec3d(0, 0, n_osc * dz));
+#pragma omp parallel for
+    for (int ix = 0; ix < n_grid.x; ++ix) {
+        for (int iy = 0; iy < n_grid.y; ++iy) {
+            for (int iz = 0; iz < n_levels; ++iz) {
+                double sum = 0;
+                for (int w = 0; w < 2 * n_osc + 1; ++w) {
+                    sum += fz.at(ix, iy, iz + w) * weights[w];
                 }
-                if (options_.flexible && current_point == total_points / 2) {
-                    min_system.makeXYZFile(options_.outputfolder);
+                df.at(ix, iy, iz) = factor * sum;
+            }
+        }
+    }
+    return true;
+}
+
+// Returns the values of the volume as a C ordered (z, x, y) array
+static vector<double> zxyValues(const DataGrid<double>& volume) {
+    const Vec3i& n_grid = volume.getNGrid();
+    vector<double> values(n_grid.x * n_grid.y * n_grid.z);
+#pragma omp parallel for
+    for (int iz = 0; iz < n_grid.z; ++iz) {
+        for (int ix = 0; ix < n_grid.x; ++ix) {
+            for (int iy = 0; iy < n_grid.y; ++iy) {
+                values[(iz * n_grid.x + ix) * n_grid.y + iy] = volume.at(ix, iy, iz);
+            }
+        }
+    }
+    return values;
+}
+
+void Simulation::writeVolumes() {
+    if (volumes_.empty() || !rootProcess()) {
+        return;
+    }
+    pretty_print("Writing volume output");
+    // The surface atoms in their initial positions
+    vector<int> atom_numbers;
+    vector<Vec3d> atom_positions;
+    for (int i = 2; i < system.n_atoms_; ++i) {
+        atom_numbers.push_back(atomicNumber(system.types_[i]));
+        atom_positions.push_back(system.positions_[i]);
+    }
+
+    const int n_branches = options_.retract ? 2 : 1;
+    string extension = ".cube";
+    if (options_.volume_format == VOLUME_XSF) {
+        extension = ".xsf";
+    } else if (options_.volume_format == VOLUME_NPY) {
+        extension = ".npy";
+    }
+    for (unsigned int tip = 0; tip < tips_.size(); ++tip) {
+        for (int branch = 0; branch < n_branches; ++branch) {
+            const string prefix = (branch == RETRACT) ? "retract" : "scan";
+            const DataGrid<double>* volumes = &volumes_[(tip * n_branches + branch) * N_VOLUME_FIELDS];
+            try {
+                // All the quantities of a branch go to the same npz archive
+                unique_ptr<NpzWriter> npz_file;
+                if (options_.volume_format == VOLUME_NPZ) {
+                    string file_path = tipOutputFolder(tip) + prefix + ".npz";
+                    npz_file.reset(new NpzWriter(file_path));
+                    pretty_print("Writing %s", file_path.c_str());
                 }
-                z_data[k] = min_system.getOutput();
-                z_data[k].indices = Vec3i(i, j, k);
-                z_data[k].minimisation_steps = n;
-                n_total_ += n;
-                min_system.lowerTip(options_.dz);
-            } // z
-#pragma omp critical(output)
-        {
-            output_buffer.insert(output_buffer.end(), z_data.begin(), z_data.end());
-            if (output_buffer.size() >= buffer_size) {
-                writeOutput(output_buffer);
-                output_buffer.clear();
-            }
-
-            // Report progress every once in a while
-            double current_progress = 1.0f * processed_points / total_points;
-            while (rootProcess() && current_progress >= next_report) {
-                pretty_print("Finished %4.1f %% of the simulation",
-                             100 * next_report);
-                next_report += report_interval;
+                for (const auto& quantity : options_.volume_output) {
+                    DataGrid<double> df;
+                    const DataGrid<double>* volume = nullptr;
+                    if (quantity == "fz") {
+                        volume = &volumes[VOLUME_FZ];
+                    } else if (quantity == "energy") {
+                        volume = &volumes[VOLUME_ENERGY];
+                    } else if (quantity == "dx") {
+                        volume = &volumes[VOLUME_DX];
+                    } else if (quantity == "dy") {
+                        volume = &volumes[VOLUME_DY];
+                    } else if (quantity == "dz") {
+                        volume = &volumes[VOLUME_DZ];
+                    } else if (quantity == "df") {
+                        if (!computeFrequencyShift(volumes[VOLUME_FZ], df)) {
+                            warning("The oscillation amplitude doesn't fit the z range, skipping df volume.");
+                            continue;
+                        }
+                        volume = &df;
+                    }
+                    const Vec3i& n_grid = volume->getNGrid();
+                    vector<size_t> shape = {(size_t)n_grid.z, (size_t)n_grid.x, (size_t)n_grid.y};
+                    // The position of the first point and the spacing are in the same (z, x, y) order
+                    if (npz_file) {
+                        npz_file->addArray(quantity, shape, zxyValues(*volume));
+                        Vec3d origin = volume->getOrigin();
+                        npz_file->addArray(quantity + "_origin", {3}, {origin.z, origin.x, origin.y});
+                        continue;
+                    }
+                    string file_path = tipOutputFolder(tip) + prefix + "-" + quantity + extension;
+                    if (options_.volume_format == VOLUME_NPY) {
+                        writeNpy(file_path, shape, zxyValues(*volume));
+                    } else if (options_.volume_format == VOLUME_XSF) {
+                        XSFWriter xsf_file(file_path);
+                        xsf_file.setAtoms(atom_numbers, atom_positions);
+                        xsf_file.writeDataGrid(*volume, prefix + "_" + quantity);
+                    } else {
+                        CubeWriter cube_file(file_path);
+                        cube_file.setComment("MechAFM " + prefix + " volume of " + quantity,
+                                             "Tip " + options_.tipatoms[tip] + ", z ascending from zlow");
+                        cube_file.setAtoms(atom_numbers, atom_positions);
+                        cube_file.writeDataGrid(*volume);
+                    }
+                    pretty_print("Wrote %s", file_path.c_str());
+                }
+                if (npz_file) {
+                    Vec3d spacing = volumes[VOLUME_FZ].getSpacing();
+                    npz_file->addArray("spacing", {3}, {spacing.z, spacing.x, spacing.y});
+                }
+            } catch (const runtime_error& e) {
+                error("%s", e.what());
             }
         }
-        } // y
-    } // x
-    // Write the remaining data
-    writeOutput(output_buffer);
+    }
+}
+
+int Simulation::streamIndex(const OutputData& data) const {
+    // The files of each tip are grouped together and within them the
+    // retract branch files come after all the approach files
+    const int n_branches = options_.retract ? 2 : 1;
+    return (data.tip * n_branches + data.branch) * n_points_.z + data.indices.z;
 }
 
-void Simulation::writeOutput(vector<OutputData> output_buffer) {
+void Simulation::initOutputSlabs() {
+    const int n_branches = options_.retract ? 2 : 1;
+    records_per_point_ = tips_.size() * n_branches * n_points_.z;
+    // Quantities needed for the volumes and the hysteresis check are computed
+    // even when they aren't written
+    record_fields_ = options_.output_fields;
+    for (const auto& quantity : options_.volume_output) {
+        if (quantity == "fz" || quantity == "df") {
+            record_fields_ |= OUT_FZ;
+        } else if (quantity == "energy") {
+            record_fields_ |= OUT_ENERGY;
+        } else {
+            record_fields_ |= OUT_R_VEC;
+        }
+    }
+    if (options_.retract) {
+        record_fields_ |= OUT_FORCE;
+    }
+    slabs_.clear();
+    slabs_.resize(n_points_.x);
+    slab_allocated_.reset(new once_flag[n_points_.x]);
+    slab_points_.reset(new atomic<int>[n_points_.x]);
+    for (int i = 0; i < n_points_.x; ++i) {
+        slab_points_[i] = 0;
+    }
+    next_slab_ = 0;
+}
+
+OutputData* Simulation::slabRecord(int i, int j) {
+    // The slab can be touched first either by the thread scanning the row or
+    // by the root process receiving the row from the other processes
+    call_once(slab_allocated_[i], [this, i]() {
+        slabs_[i].resize(n_points_.y * records_per_point_);
+    });
+    return &slabs_[i][j * records_per_point_];
+}
+
+void Simulation::finishSlab(int i, int n_row_points) {
 #if MPI_BUILD
-    MPI_Status mpi_status;
-    // Send the data to the root process
+    // Other processes send their share of the row to the root process
     if (!rootProcess()) {
-        MPI_Send(static_cast<void*>(output_buffer.data()),
-                 output_buffer.size() * sizeof(OutputData),
-                 MPI_CHAR, root_process_, 0, universe);
+        if (n_row_points > 0) {
+            // The x index of the row leads the data, as the MPI tags may not reach it
+            vector<double> row_data;
+            row_data.reserve(1 + n_row_points * records_per_point_ * packedSize(record_fields_)
+                             + ProgressReporter::packed_size);
+            row_data.push_back(i);
+            for (int j = 0; j < n_points_.y; ++j) {
+                if ((i * n_points_.y + j) % n_processes_ == current_process_) {
+                    OutputData* column_data = slabRecord(i, j);
+                    for (int record = 0; record < records_per_point_; ++record) {
+                        packRecord(column_data[record], record_fields_, row_data);
+                    }
+                }
+            }
+            // MPI is used by one thread at a time (MPI_THREAD_SERIALIZED). The progress
+            // of this process is sent at the end, so the last row has the final totals.
+            lock_guard<mutex> lock(emit_mutex_);
+            progress_.packTotals(row_data);
+            MPI_Send(static_cast<void*>(row_data.data()), row_data.size(), MPI_DOUBLE,
+                     root_process_, g_slab_tag, universe);
+        }
+        vector<OutputData>().swap(slabs_[i]);
+        return;
     }
 #endif
-    // Receive the data from the daughter processes and write to file
-    if (rootProcess()) {
-        vector<OutputData> recieve_buffer(options_.bufsize * n_points_.z);
-        for (int i = 0; i < n_processes_; ++i) {
-            int data_size = 0;
-            // On the main processor we only have to copy the data
-            if (i == 0) {
-                recieve_buffer = output_buffer;
-                data_size = output_buffer.size();
-            }
+    slab_points_[i] += n_row_points;
+    emitSlabs(false);
+}
+
+void Simulation::receiveSlabs(bool wait) {
 #if MPI_BUILD
-            // For all other processors we need to receive the data
-            else {
-                MPI_Recv(static_cast<void*>(recieve_buffer.data()),
-                         recieve_buffer.size() * sizeof(OutputData),
-                         MPI_CHAR, i, 0, universe, &mpi_status);
-                MPI_Get_count(&mpi_status, MPI_CHAR, &data_size);
-                data_size /= sizeof(OutputData);
+    const int n_branches = options_.retract ? 2 : 1;
+    MPI_Status mpi_status;
+    int flag = 0;
+    while (true) {
+        if (wait) {
+            MPI_Probe(MPI_ANY_SOURCE, g_slab_tag, universe, &mpi_status);
+            flag = 1;
+            wait = false;
+        } else {
+            MPI_Iprobe(MPI_ANY_SOURCE, g_slab_tag, universe, &flag, &mpi_status);
+        }
+        if (!flag) {
+            break;
+        }
+        int data_size = 0;
+        MPI_Get_count(&mpi_status, MPI_DOUBLE, &data_size);
+        vector<double> row_data(data_size);
+        MPI_Recv(static_cast<void*>(row_data.data()), data_size, MPI_DOUBLE,
+                 mpi_status.MPI_SOURCE, g_slab_tag, universe, MPI_STATUS_IGNORE);
+        // The first value is the x index of the row. Only the quantities are sent, the
+        // indices follow from the points handled by the sender and the order of the records.
+        int i = (int)row_data[0];
+        const double* packed = row_data.data() + 1;
+        progress_.setRemoteTotals(mpi_status.MPI_SOURCE,
+                                  packed + data_size - ProgressReporter::packed_size);
+        int n_row_points = 0;
+        for (int j = 0; j < n_points_.y; ++j) {
+            if ((i * n_points_.y + j) % n_processes_ != mpi_status.MPI_SOURCE) {
+                continue;
             }
-#endif
-            // Write data to file (only the root processor can do this)
-            // PLEASE NOTE: DATA IS SENT IN STRIPED FORM, THEY ARE NOT ORDERED!
-            for (int bi = 0; bi < data_size; ++bi) {
-                int fi = recieve_buffer[bi].indices.z;
-                // The file buffer can be a gzip pipe or an ASCII file stream
-                fprintf(fstreams_[fi], "%d ", recieve_buffer[bi].indices.z);
-                fprintf(fstreams_[fi], "%d ", recieve_buffer[bi].indices.x);
-                fprintf(fstreams_[fi], "%d ", recieve_buffer[bi].indices.y);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].position.x);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].position.y);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].position.z);
-                fprintf(fstreams_[fi], "%8.4f ", recieve_buffer[bi].tip_force.x);
-                fprintf(fstreams_[fi], "%8.4f ", recieve_buffer[bi].tip_force.y);
-                fprintf(fstreams_[fi], "%8.4f ", recieve_buffer[bi].tip_force.z);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].r_vec.x);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].r_vec.y);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].r_vec.z);
-                fprintf(fstreams_[fi], "%6.3f ", recieve_buffer[bi].r);
-                fprintf(fstreams_[fi], "%8.4f ", recieve_buffer[bi].angle);
-                fprintf(fstreams_[fi], "%8.4f ", recieve_buffer[bi].tip_energy);
-                fprintf(fstreams_[fi], "%d\n", recieve_buffer[bi].minimisation_steps);
+            OutputData* column_data = slabRecord(i, j);
+            for (int record = 0; record < records_per_point_; ++record) {
+                packed = unpackRecord(packed, record_fields_, column_data[record]);
+                column_data[record].indices = Vec3i(i, j, record % n_points_.z);
+                column_data[record].branch = (record / n_points_.z) % n_branches;
+                column_data[record].tip = record / (n_points_.z * n_branches);
             }
+            n_row_points++;
+        }
+        slab_points_[i] += n_row_points;
+    }
+#else
+    (void)wait;
+#endif
+}
+
+void Simulation::emitSlabs(bool wait) {
+    if (!rootProcess()) {
+        return;
+    }
+    while (true) {
+        // Only one thread writes at a time, the others continue scanning and
+        // their slabs are picked up by the writing thread
+        if (wait) {
+            emit_mutex_.lock();
+        } else if (!emit_mutex_.try_lock()) {
+            return;
+        }
+        receiveSlabs(wait && slab_points_[next_slab_] != n_points_.y);
+        while (next_slab_ < n_points_.x && slab_points_[next_slab_] == n_points_.y) {
+            writeSlab(next_slab_);
+            vector<OutputData>().swap(slabs_[next_slab_]);
+            next_slab_++;
+        }
+        emit_mutex_.unlock();
+        // A slab may have been completed while the lock was held
+        if (next_slab_ >= n_points_.x || wait ||
+            slab_points_[next_slab_] != n_points_.y) {
+            return;
+        }
+    }
+}
+
+void Simulation::flushSlabs() {
+    if (!rootProcess()) {
+        return;
+    }
+    while (next_slab_ < n_points_.x) {
+        emitSlabs(true);
+        // The rows of the other processes keep coming in after this process is done
+        progress_.poll();
+    }
+}
+
+void Simulation::writeSlab(int i) {
+    if (!volumes_.empty()) {
+        for (const OutputData& data : slabs_[i]) {
+            storeVolumeData(data);
+        }
+    }
+    // Each record of a point goes to a different file, so the slab is written one
+    // file at a time with a single write of all the y points of the row
+    static thread_local TextBuffer buffer;
+    for (int record = 0; record < records_per_point_; ++record) {
+        FILE* stream = nullptr;
+        for (int j = 0; j < n_points_.y; ++j) {
+            const OutputData& data = slabs_[i][j * records_per_point_ + record];
+            stream = fstreams_[streamIndex(data)];
+            formatRecord(data, buffer);
+        }
+        // The file buffer can be a gzip pipe or an ASCII file stream
+        buffer.flush(stream);
+    }
+    if (stream_sink_.isOpen()) {
+        const int fields = options_.output_fields & ~OUT_INDICES;
+        vector<double> values;
+        values.reserve(slabs_[i].size() * packedSize(fields));
+        for (const OutputData& data : slabs_[i]) {
+            packRecord(data, fields, values);
+        }
+        // A consumer that went away doesn't stop the scan, the files are still written
+        try {
+            stream_sink_.writeFrame(STREAM_SLAB, i, values);
+        } catch (runtime_error& e) {
+            warning("%s, the result stream is closed", e.what());
+            stream_sink_.close();
+        }
+    }
+}
+
+void Simulation::openTrajectory() {
+    if (!options_.trajectory) {
+        return;
+    }
+    trajectory_columns_.assign(n_points_.x * n_points_.y, options_.trajectory_columns.empty());
+    for (const auto& column : options_.trajectory_columns) {
+        // The center column is the one the xyz files are written for without a trajectory
+        int point = (column.x < 0) ? (n_points_.x * n_points_.y) / 2 : column.x * n_points_.y + column.y;
+        if (column.x >= n_points_.x || column.y >= n_points_.y) {
+            error("Trajectory column %d,%d is outside of the %d x %d scan!",
+                  column.x, column.y, n_points_.x, n_points_.y);
+        }
+        trajectory_columns_[point] = true;
+    }
+    trajectory_levels_.assign(n_points_.z, options_.trajectory_levels.empty());
+    for (int level : options_.trajectory_levels) {
+        if (level >= n_points_.z) {
+            error("Trajectory level %d is outside of the %d z levels!", level, n_points_.z);
         }
+        trajectory_levels_[level] = true;
+    }
+    // Each process writes its own frames
+    string file_name = options_.outputfolder + "trajectory";
+    if (n_processes_ > 1) {
+        file_name += "-" + to_string(current_process_);
+    }
+    file_name += ".xyz";
+    pretty_print("Writing the relaxed structures to %s%s", file_name.c_str(), options_.gzip ? ".gz" : "");
+    try {
+        trajectory_.open(file_name, options_.gzip);
+    } catch (runtime_error& e) {
+        error("%s", e.what());
+    }
+}
+
+void Simulation::closeTrajectory() {
+    trajectory_.close();
+}
+
+void Simulation::recordTrajectory(const System& min_system, const OutputData& data) {
+    const Vec3i& indices = data.indices;
+    if (!trajectory_.isOpen() || !trajectory_columns_[indices.x * n_points_.y + indices.y] ||
+        !trajectory_levels_[indices.z]) {
+        return;
+    }
+    char comment[LINE_LENGTH];
+    snprintf(comment, LINE_LENGTH, "tip=%s branch=%s indices=%d,%d,%d position=%.4f,%.4f,%.4f",
+             tips_[data.tip].tipatom.c_str(), data.branch == RETRACT ? "retract" : "approach",
+             indices.x, indices.y, indices.z, data.position.x, data.position.y, data.position.z);
+    trajectory_.addFrame(tips_[data.tip].system.types_, min_system.positions_, comment);
+}
+
+void Simulation::openStream() {
+    if (options_.stream_output.empty() || !rootProcess()) {
+        return;
+    }
+    StreamHeader header;
+    header.fields = options_.output_fields & ~OUT_INDICES;
+    header.nx = n_points_.x;
+    header.ny = n_points_.y;
+    header.nz = n_points_.z;
+    header.n_tips = options_.tipatoms.size();
+    header.n_branches = options_.retract ? 2 : 1;
+    header.n_values = packedSize(header.fields);
+    header.dx = options_.dx;
+    header.dy = options_.dy;
+    header.dz = options_.dz;
+    header.zhigh = options_.zhigh;
+    pretty_print("Streaming the results to %s", options_.stream_output.c_str());
+    try {
+        stream_sink_.open(options_.stream_output);
+        stream_sink_.writeHeader(header);
+    } catch (runtime_error& e) {
+        error("%s", e.what());
     }
 }
 
+void Simulation::closeStream() {
+    if (!stream_sink_.isOpen()) {
+        return;
+    }
+    try {
+        stream_sink_.writeFrame(STREAM_END, -1, vector<double>());
+    } catch (runtime_error& e) {
+        warning("%s", e.what());
+    }
+    stream_sink_.close();
+}
+
+void Simulation::formatRecord(const OutputData& data, TextBuffer& buffer) const {
+    // Same as "%d %d %d %6.3f ... %d" with only the selected columns
+    const int fields = options_.output_fields;
+    bool first = true;
+    auto separate = [&buffer, &first]() {
+        if (!first) {
+            buffer.append(' ');
+        }
+        first = false;
+    };
+    if (fields & OUT_INDICES) {
+        separate();
+        buffer.appendInt(data.indices.z);
+        buffer.append(' ');
+        buffer.appendInt(data.indices.x);
+        buffer.append(' ');
+        buffer.appendInt(data.indices.y);
+    }
+    if (fields & OUT_POSITION) {
+        separate();
+        buffer.appendFixed(data.position.x, 6, 3);
+        buffer.append(' ');
+        buffer.appendFixed(data.position.y, 6, 3);
+        buffer.append(' ');
+        buffer.appendFixed(data.position.z, 6, 3);
+    }
+    if (fields & OUT_FX) {
+        separate();
+        buffer.appendFixed(data.tip_force.x, 8, 4);
+    }
+    if (fields & OUT_FY) {
+        separate();
+        buffer.appendFixed(data.tip_force.y, 8, 4);
+    }
+    if (fields & OUT_FZ) {
+        separate();
+        buffer.appendFixed(data.tip_force.z, 8, 4);
+    }
+    if (fields & OUT_R_VEC) {
+        separate();
+        buffer.appendFixed(data.r_vec.x, 6, 3);
+        buffer.append(' ');
+        buffer.appendFixed(data.r_vec.y, 6, 3);
+        buffer.append(' ');
+        buffer.appendFixed(data.r_vec.z, 6, 3);
+    }
+    if (fields & OUT_R) {
+        separate();
+        buffer.appendFixed(data.r, 6, 3);
+    }
+    if (fields & OUT_ANGLE) {
+        separate();
+        buffer.appendFixed(data.angle, 8, 4);
+    }
+    if (fields & OUT_ENERGY) {
+        separate();
+        buffer.appendFixed(data.tip_energy, 8, 4);
+    }
+    if (fields & OUT_STEPS) {
+        separate();
+        buffer.appendInt(data.minimisation_steps);
+    }
+    if (fields & OUT_STIFFNESS) {
+        separate();
+        buffer.appendFixed(data.stiffness.x, 8, 4);
+        buffer.append(' ');
+        buffer.appendFixed(data.stiffness.y, 8, 4);
+        buffer.append(' ');
+        buffer.appendFixed(data.stiffness.z, 8, 4);
+    }
+    if (fields & OUT_THERMAL) {
+        separate();
+        buffer.appendFixed(data.thermal_force.x, 8, 4);
+        buffer.append(' ');
+        buffer.appendFixed(data.thermal_force.y, 8, 4);
+        buffer.append(' ');
+        buffer.appendFixed(data.thermal_force.z, 8, 4);
+        buffer.append(' ');
+        buffer.appendFixed(data.thermal_variance.x, 10, 6);
+        buffer.append(' ');
+        buffer.appendFixed(data.thermal_variance.y, 10, 6);
+        buffer.append(' ');
+        buffer.appendFixed(data.thermal_variance.z, 10, 6);
+    }
+    buffer.append('\n');
+}
+
+int Simulation::packedSize(int fields) const {
+    int size = 0;
+    size += (fields & OUT_POSITION) ? 3 : 0;
+    size += (fields & OUT_FX) ? 1 : 0;
+    size += (fields & OUT_FY) ? 1 : 0;
+    size += (fields & OUT_FZ) ? 1 : 0;
+    size += (fields & OUT_R_VEC) ? 3 : 0;
+    size += (fields & OUT_R) ? 1 : 0;
+    size += (fields & OUT_ANGLE) ? 1 : 0;
+    size += (fields & OUT_ENERGY) ? 1 : 0;
+    size += (fields & OUT_STEPS) ? 1 : 0;
+    size += (fields & OUT_STIFFNESS) ? 3 : 0;
+    size += (fields & OUT_THERMAL) ? 6 : 0;
+    return size;
+}
+
+void Simulation::packRecord(const OutputData& data, int fields, vector<double>& packed) const {
+    if (fields & OUT_POSITION) {
+        packed.insert(packed.end(), {data.position.x, data.position.y, data.position.z});
+    }
+    if (fields & OUT_FX) {
+        packed.push_back(data.tip_force.x);
+    }
+    if (fields & OUT_FY) {
+        packed.push_back(data.tip_force.y);
+    }
+    if (fields & OUT_FZ) {
+        packed.push_back(data.tip_force.z);
+    }
+    if (fields & OUT_R_VEC) {
+        packed.insert(packed.end(), {data.r_vec.x, data.r_vec.y, data.r_vec.z});
+    }
+    if (fields & OUT_R) {
+        packed.push_back(data.r);
+    }
+    if (fields & OUT_ANGLE) {
+        packed.push_back(data.angle);
+    }
+    if (fields & OUT_ENERGY) {
+        packed.push_back(data.tip_energy);
+    }
+    if (fields & OUT_STEPS) {
+        packed.push_back(data.minimisation_steps);
+    }
+    if (fields & OUT_STIFFNESS) {
+        packed.insert(packed.end(), {data.stiffness.x, data.stiffness.y, data.stiffness.z});
+    }
+    if (fields & OUT_THERMAL) {
+        packed.insert(packed.end(), {data.thermal_force.x, data.thermal_force.y, data.thermal_force.z,
+                                     data.thermal_variance.x, data.thermal_variance.y,
+                                     data.thermal_variance.z});
+    }
+}
+
+const double* Simulation::unpackRecord(const double* packed, int fields, OutputData& data) const {
+    data = OutputData();
+    if (fields & OUT_POSITION) {
+        data.position = Vec3d(packed[0], packed[1], packed[2]);
+        packed += 3;
+    }
+    if (fields & OUT_FX) {
+        data.tip_force.x = *packed++;
+    }
+    if (fields & OUT_FY) {
+        data.tip_force.y = *packed++;
+    }
+    if (fields & OUT_FZ) {
+        data.tip_force.z = *packed++;
+    }
+    if (fields & OUT_R_VEC) {
+        data.r_vec = Vec3d(packed[0], packed[1], packed[2]);
+        packed += 3;
+    }
+    if (fields & OUT_R) {
+        data.r = *packed++;
+    }
+    if (fields & OUT_ANGLE) {
+        data.angle = *packed++;
+    }
+    if (fields & OUT_ENERGY) {
+        data.tip_energy = *packed++;
+    }
+    if (fields & OUT_STEPS) {
+        data.minimisation_steps = *packed++;
+    }
+    if (fields & OUT_STIFFNESS) {
+        data.stiffness = Vec3d(packed[0], packed[1], packed[2]);
+        packed += 3;
+    }
+    if (fields & OUT_THERMAL) {
+        data.thermal_force = Vec3d(packed[0], packed[1], packed[2]);
+        data.thermal_variance = Vec3d(packed[3], packed[4], packed[5]);
+        packed += 6;
+    }
+    return packed;
+}
+
 void Simulation::buildInteractions() {
+    // The frozen atoms are left out of all the explicit interactions
+    if (options_.frozen_grid && frozen_.empty()) {
+        findFrozenAtoms();
+    }
     // Grid interactions have to be build first since it currently
     // clears the interaction list.
     if (options_.rigidgrid) {
@@ -211,8 +927,21 @@ void Simulation::buildInteractions() {
         buildSurfaceSurfaceInteractions();
         buildSubstrateInteractions();
     }
+    if (options_.frozen_grid) {
+        buildFrozenGridInteractions();
+    }
     // Give the system a pointer to the interaction list
     system.interactions_ = &interactions_;
+    if (!slow_interactions_.empty()) {
+        system.slow_interactions_ = &slow_interactions_;
+        system.setSlowInterval(options_.respa_interval);
+        pretty_print("%d of %d interactions are evaluated every %d steps",
+                     (int)slow_interactions_.size(),
+                     (int)(slow_interactions_.size() + interactions_.size()),
+                     options_.respa_interval);
+    } else {
+        system.slow_interactions_ = nullptr;
+    }
 }
 
 void Simulation::calculateTipDummyDistance() {
@@ -235,7 +964,8 @@ bool Simulation::findOverwriteParameters(int atom_i1, int atom_i2, OverwritePara
     return false;
 }
 
-void Simulation::addVDWInteraction(int atom_i1, int atom_i2, Vec3d pbc_shift = Vec3d(0)) {
+void Simulation::addVDWInteraction(int atom_i1, int atom_i2, Vec3d pbc_shift = Vec3d(0),
+                                   LJTipSurfaceInteraction* tip_pairs = nullptr) {
     OverwriteParameters op;
     // Use overwrite parameters to define the interaction if they exist
     if (findOverwriteParameters(atom_i1, atom_i2, op)) {
@@ -244,7 +974,11 @@ void Simulation::addVDWInteraction(int atom_i1, int atom_i2, Vec3d pbc_shift = V
         } else {
             double es6 = 4 * op.eps * pow(op.sig, 6);
             double es12 = 4 * op.eps * pow(op.sig, 12);
-            interactions_.emplace_back(new LJInteraction(atom_i1, atom_i2, es6, es12, pbc_shift));
+            if (tip_pairs != nullptr) {
+                tip_pairs->addPair(atom_i2, es6, es12, pbc_shift);
+            } else {
+                interactions_.emplace_back(new LJInteraction(atom_i1, atom_i2, es6, es12, pbc_shift));
+            }
         }
     } else {
         unordered_map<string, AtomParameters> ap = interaction_parameters_.atom_parameters;
@@ -262,31 +996,30 @@ void Simulation::addVDWInteraction(int atom_i1, int atom_i2, Vec3d pbc_shift = V
         double m_sig = mixsig(atom1_it->second.sig, atom2_it->second.sig);
         double es6 = 4 * m_eps * pow(m_sig, 6);
         double es12 = 4 * m_eps * pow(m_sig, 12);
-        interactions_.emplace_back(new LJInteraction(atom_i1, atom_i2, es6, es12, pbc_shift));
+        if (tip_pairs != nullptr) {
+            tip_pairs->addPair(atom_i2, es6, es12, pbc_shift);
+        } else {
+            interactions_.emplace_back(new LJInteraction(atom_i1, atom_i2, es6, es12, pbc_shift));
+        }
     }
 }
 
-void Simulation::addCoulombInteraction(int atom_i1, int atom_i2) {
-    unordered_map<string, AtomParameters> ap = interaction_parameters_.atom_parameters;
-
-    double q1, q2;
+double Simulation::atomCharge(int atom_i) {
     if (options_.xyz_charges) {
-        q1 = system.charges_[atom_i1];
-        q2 = system.charges_[atom_i2];
-    } else {
-        auto atom1_it = ap.find(system.types_[atom_i1]);
-        auto atom2_it = ap.find(system.types_[atom_i2]);
-        if (atom1_it == ap.end()) {
-            error("Parameters for atom type %s not found in parameter file!",
-                            system.types_[atom_i1].c_str());
-        }
-        if (atom2_it == ap.end()) {
-            error("Parameters for atom type %s not found in parameter file!",
-                            system.types_[atom_i2].c_str());
-        }
-        q1 = atom1_it->second.q;
-        q2 = atom2_it->second.q;
+        return system.charges_[atom_i];
+    }
+    unordered_map<string, AtomParameters>& ap = interaction_parameters_.atom_parameters;
+    auto atom_it = ap.find(system.types_[atom_i]);
+    if (atom_it == ap.end()) {
+        error("Parameters for atom type %s not found in parameter file!",
+                        system.types_[atom_i].c_str());
     }
+    return atom_it->second.q;
+}
+
+void Simulation::addCoulombInteraction(int atom_i1, int atom_i2) {
+    double q1 = atomCharge(atom_i1);
+    double q2 = atomCharge(atom_i2);
     // Only add the interaction if charges aren't zero
     if (q1 != 0 && q2 != 0) {
         double qq = interaction_parameters_.qbase * q1 * q2;
@@ -295,6 +1028,8 @@ void Simulation::addCoulombInteraction(int atom_i1, int atom_i2) {
 }
 
 void Simulation::buildTipSurfaceInteractions() {
+    // The LJ interactions are evaluated together by the vectorised kernel
+    unique_ptr<LJTipSurfaceInteraction> tip_pairs(new LJTipSurfaceInteraction());
     if (options_.vdw_pbc) {
         Vec3d pbc_shift;
         Mat3d cell_matrix = system.getUnitCell();
@@ -305,45 +1040,63 @@ void Simulation::buildTipSurfaceInteractions() {
                 pbc_shift = cell_a_shift*cell_matrix.getColumn(0) + \
                             cell_b_shift*cell_matrix.getColumn(1);
                 for (int i = 2; i < system.n_atoms_; ++i) {
-                    addVDWInteraction(1, i, pbc_shift);
+                    if (isFrozen(i)) {
+                        continue;
+                    }
+                    addVDWInteraction(1, i, pbc_shift, tip_pairs.get());
                 }
             }
         }
     }
     else {
+        // With a tree the charged atoms are collected for it instead of adding pairs
+        bool use_tree = options_.coulomb && options_.coulomb_theta > 0;
+        vector<int> charged_atoms;
+        vector<double> charges;
         for (int i = 2; i < system.n_atoms_; ++i) {
-            addVDWInteraction(1, i);
-            if (options_.coulomb) {
+            if (isFrozen(i)) {
+                continue;
+            }
+            addVDWInteraction(1, i, Vec3d(0), tip_pairs.get());
+            if (use_tree) {
+                double q = atomCharge(i);
+                if (q != 0) {
+                    charged_atoms.push_back(i);
+                    charges.push_back(q);
+                }
+            } else if (options_.coulomb) {
                 addCoulombInteraction(1, i);
             } 
         }
+        double q_tip = use_tree ? atomCharge(1) : 0;
+        if (q_tip != 0 && !charged_atoms.empty()) {
+            interactions_.emplace_back(new TipTreeCoulombInteraction(system.positions_, charged_atoms,
+                    charges, system.fixed_, interaction_parameters_.qbase * q_tip, options_.coulomb_theta));
+        }
+    }
+    tip_pairs->cacheFixedAtoms(system.positions_, system.fixed_);
+    if (tip_pairs->size() > 0) {
+        interactions_.push_back(move(tip_pairs));
+    }
+    
+    // Pauli repulsion of the tip atom from the sample density
+    if (!options_.density_file.empty()) {
+        buildDensityOverlapInteraction();
     }
     
     // Interaction of tip atom with an external electrostatic potential
     if (options_.use_external_potential) {
+        // The force grid doesn't depend on the tip, so it is computed only once
+        if (e_potential_grid_) {
+            interactions_.emplace_back(new ElectrostaticPotentialInteraction(e_potential_grid_, system.charges_[1]));
+            return;
+        }
         pretty_print("Calculating energy and force on grid from external electrostatic potential.");
         DataGrid<double> electrostatic_potential;
-        CubeReader cube_file(options_.e_potential_file);
-        if (rootProcess()) {
-            cube_file.storeToDataGrid(electrostatic_potential);
-        } else {
-            const Vec3i& n_grid = cube_file.getNVoxels();
-            const vector<Vec3d> voxel_vectors = cube_file.getVoxelVectors();
-            const Vec3d& origin = cube_file.getOrigin();
-            electrostatic_potential.initValues(n_grid.x, n_grid.y, n_grid.z, 0.0);
-            electrostatic_potential.setBasis(voxel_vectors);
-            electrostatic_potential.setOrigin(origin);
-        }
-        
-#if MPI_BUILD
-        // Broadcast electrostatic potential values from root process to others
-        vector<double> tmp_values;
-        electrostatic_potential.swapValues(tmp_values);
-        MPI_Bcast(tmp_values.data(), tmp_values.size(), MPI_DOUBLE, root_process_, universe);
-        electrostatic_potential.swapValues(tmp_values);
-#endif
+        readExternalPotential(electrostatic_potential);
+        transformSampleGrid(electrostatic_potential);
         
-        // Units for potential are in Hartree units in the case of CP2k cube files
+        // The potential is read in Hartree units (as in the cube files of CP2k)
         // Hartree potential is defined for negatively charge electrons -> multiply by -1
         if (options_.units == U_EV)
             electrostatic_potential.scaleValues(-g_hartree_to_eV);
@@ -354,13 +1107,6 @@ void Simulation::buildTipSurfaceInteractions() {
         else
             error("unit conversion of Hartree potential to given units is not implemented");
         
-        // Rotate potential grid if z coordinate is not perpendicular to the surface
-        if (options_.normal == NORMAL_X) {
-            electrostatic_potential.rotateCoordAxes("ZYX");
-        } else if (options_.normal == NORMAL_Y) {
-            electrostatic_potential.rotateCoordAxes("ZXY");
-        }
-        
         // Offset the potential data by the same amount as the atomic system
         electrostatic_potential.setOrigin(electrostatic_potential.getOrigin() + system.getOffset());
         
@@ -412,11 +1158,195 @@ void Simulation::buildTipSurfaceInteractions() {
         }
         
         // Create the interaction between the tip atom and the electrostatic potential
-        interactions_.emplace_back(new ElectrostaticPotentialInteraction(electrostatic_potential, system.charges_[1], g_tip_gaussian_width));
+        ElectrostaticPotentialInteraction* e_interaction = new ElectrostaticPotentialInteraction(
+                electrostatic_potential, system.charges_[1], g_tip_gaussian_width);
+        e_potential_grid_ = e_interaction->getUnitForceGrid();
+        interactions_.emplace_back(e_interaction);
         pretty_print("Done!");
     }
 }
 
+void Simulation::readSampleGrid(const string& path, VolumeQuantity quantity, DataGrid<double>& grid) {
+    unique_ptr<VolumeReader> volume_file = openVolumeFile(path);
+    if (rootProcess()) {
+        volume_file->storeToDataGrid(grid, quantity);
+    } else {
+        const Vec3i& n_grid = volume_file->getNVoxels();
+        const vector<Vec3d> voxel_vectors = volume_file->getVoxelVectors();
+        const Vec3d& origin = volume_file->getOrigin();
+        grid.initValues(n_grid.x, n_grid.y, n_grid.z, 0.0);
+        grid.setBasis(voxel_vectors);
+        grid.setOrigin(origin);
+    }
+    
+#if MPI_BUILD
+    // Broadcast the values from root process to others
+    vector<double> tmp_values;
+    grid.swapValues(tmp_values);
+    MPI_Bcast(tmp_values.data(), tmp_values.size(), MPI_DOUBLE, root_process_, universe);
+    grid.swapValues(tmp_values);
+#endif
+}
+
+void Simulation::transformSampleGrid(DataGrid<double>& grid) const {
+    // Only the grid vectors are transformed, the lookups of the force grids built from
+    // the volume handle any basis
+    grid.transformCoordinates(options_.frame);
+}
+
+void Simulation::readExternalPotential(DataGrid<double>& potential) {
+    if (options_.e_potential_files.size() == 1 && options_.e_potential_weights[0] == 1.0 &&
+            options_.e_potential_grid == Vec3i(0)) {
+        readSampleGrid(options_.e_potential_files[0], QUANTITY_POTENTIAL, potential);
+        return;
+    }
+    
+    // The potentials are summed in k-space on the target grid, where the resampling is
+    // a copy of the common frequencies. The grids must span the same periodic cell.
+    DataGrid<dcomplex> sum_kspace, kspace, resampled;
+    Vec3i n_target = options_.e_potential_grid;
+    Vec3d cell[3];
+    Vec3d origin;
+    for (unsigned int i = 0; i < options_.e_potential_files.size(); ++i) {
+        const string& path = options_.e_potential_files[i];
+        DataGrid<double> grid;
+        readSampleGrid(path, QUANTITY_POTENTIAL, grid);
+        const Vec3i& n_grid = grid.getNGrid();
+        const Mat3d& basis = grid.getBasis();
+        const Vec3d grid_cell[3] = {n_grid.x * basis.getColumn(0), n_grid.y * basis.getColumn(1),
+                                    n_grid.z * basis.getColumn(2)};
+        if (i == 0) {
+            copy(grid_cell, grid_cell + 3, cell);
+            origin = grid.getOrigin();
+            if (n_target == Vec3i(0)) {
+                n_target = n_grid;
+            }
+            sum_kspace.initValues(n_target.x, n_target.y, n_target.z, dcomplex(0.0));
+        } else {
+            for (int b = 0; b < 3; b++) {
+                if ((grid_cell[b] - cell[b]).len() > 1.0e-4) {
+                    error("The external potential %s has a different cell than %s!",
+                          path.c_str(), options_.e_potential_files[0].c_str());
+                }
+            }
+            if ((grid.getOrigin() - origin).len() > 1.0e-4) {
+                error("The external potential %s has a different origin than %s!",
+                      path.c_str(), options_.e_potential_files[0].c_str());
+            }
+        }
+        fft_data_grid(grid, kspace);
+        resample_kspace_data_grid(kspace, n_target, resampled);
+        const double weight = options_.e_potential_weights[i];
+        for (int ind = 0; ind < n_target.x * n_target.y * n_target.z; ind++) {
+            sum_kspace.at(ind) += weight * resampled.at(ind);
+        }
+        sum_kspace.setBasis(resampled.getBasis());
+    }
+    ffti_data_grid(sum_kspace, potential);
+    potential.setOrigin(origin);
+}
+
+void Simulation::buildDensityOverlapInteraction() {
+    // tips_ holds the tips built so far, so its size is the index of the current tip
+    const string& tip_file = options_.tip_density_files[tips_.size()];
+    auto found = density_grids_.find(tip_file);
+    if (found != density_grids_.end()) {
+        interactions_.emplace_back(new DensityOverlapInteraction(found->second));
+        return;
+    }
+    pretty_print("Calculating the density overlap with the tip density %s.", tip_file.c_str());
+    
+    // The densities are read in e/bohr^3 (as in the cube files) and used in e/Å^3 in the overlap
+    const double density_scaling = pow(bohr_to_angst, -3);
+    unique_ptr<VolumeReader> sample_file = openVolumeFile(options_.density_file);
+    const Vec3i& n_grid = sample_file->getNVoxels();
+    const vector<Vec3d>& voxel_vectors = sample_file->getVoxelVectors();
+    if (density_kspace_.getNGrid() == Vec3i(0)) {
+        // Only the positive part of the density takes part in the overlap
+        DataGrid<double> sample_density;
+        readSampleGrid(options_.density_file, QUANTITY_DENSITY, sample_density);
+        transformSampleGrid(sample_density);
+        const Vec3i& n_sample = sample_density.getNGrid();
+        for (int ind = 0; ind < n_sample.x * n_sample.y * n_sample.z; ind++) {
+            double& value = sample_density.at(ind);
+            value = pow(max(density_scaling * value, 0.0), options_.pauli_b);
+        }
+        fft_data_grid(sample_density, density_kspace_);
+        // Offset the overlap grid by the same amount as the atomic system
+        density_origin_ = sample_density.getOrigin() + system.getOffset();
+    }
+    
+    // Place the tip density on the sample grid with the tip atom at the origin. The
+    // first atom of the tip cube is the tip atom, or the origin if there are no atoms.
+    unique_ptr<VolumeReader> tip_file_reader = openVolumeFile(tip_file);
+    const vector<Vec3d>& tip_vectors = tip_file_reader->getVoxelVectors();
+    for (int a = 0; a < 3; a++) {
+        if ((tip_vectors[a] - voxel_vectors[a]).len() > 1.0e-6 * voxel_vectors[a].len()) {
+            error("The voxels of the tip density %s differ from the sample density!", tip_file.c_str());
+        }
+    }
+    DataGrid<double> tip_cube;
+    tip_file_reader->storeToDataGrid(tip_cube, QUANTITY_DENSITY);
+    const Vec3i& n_tip = tip_cube.getNGrid();
+    if (n_tip.x > n_grid.x || n_tip.y > n_grid.y || n_tip.z > n_grid.z) {
+        error("The tip density %s does not fit in the grid of the sample density!", tip_file.c_str());
+    }
+    Vec3d tip_atom(0.0);
+    if (!tip_file_reader->getAtomPositions().empty()) {
+        tip_atom = tip_file_reader->getAtomPositions()[0];
+    }
+    Vec3d shift = tip_cube.getBasis().inverse().multiply(tip_cube.getOrigin() - tip_atom);
+    Vec3i index_shift(lround(shift.x), lround(shift.y), lround(shift.z));
+    DataGrid<double> tip_density(n_grid.x, n_grid.y, n_grid.z, 0.0);
+    tip_density.setBasis(voxel_vectors);
+    for (int ix = 0; ix < n_tip.x; ix++) {
+        for (int iy = 0; iy < n_tip.y; iy++) {
+            for (int iz = 0; iz < n_tip.z; iz++) {
+                tip_density.atPBC(ix + index_shift.x, iy + index_shift.y, iz + index_shift.z) +=
+                        density_scaling * tip_cube.at(ix, iy, iz);
+            }
+        }
+    }
+    transformSampleGrid(tip_density);
+    
+    // The prefactor is given in eV
+    double prefactor = options_.pauli_a;
+    if (options_.units == U_KJ) {
+        prefactor *= g_hartree_to_kJ / g_hartree_to_eV;
+    } else if (options_.units == U_KCAL) {
+        prefactor *= g_hartree_to_kcal / g_hartree_to_eV;
+    }
+    
+    DensityOverlapInteraction* overlap_interaction = new DensityOverlapInteraction(
+            density_kspace_, tip_density, density_origin_, prefactor);
+    density_grids_[tip_file] = overlap_interaction->getForceGrid();
+    interactions_.emplace_back(overlap_interaction);
+    pretty_print("Done!");
+}
+
+#if MPI_BUILD
+// Gathers the blocks of grid columns computed by each process to all the processes.
+// Process p has computed the columns column_begins[p], ..., column_begins[p + 1] - 1.
+static void gatherGridColumns(vector<Vec3d>& forces, vector<double>& energies,
+                              const vector<int>& column_begins, int n_z, MPI_Comm universe) {
+    static_assert(sizeof(Vec3d) == 3 * sizeof(double), "Vec3d is sent as three doubles");
+    int n_processes = column_begins.size() - 1;
+    vector<int> counts(n_processes), displacements(n_processes);
+    for (int p = 0; p < n_processes; ++p) {
+        displacements[p] = column_begins[p] * n_z;
+        counts[p] = (column_begins[p + 1] - column_begins[p]) * n_z;
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, static_cast<void*>(energies.data()),
+                   counts.data(), displacements.data(), MPI_DOUBLE, universe);
+    for (int p = 0; p < n_processes; ++p) {
+        displacements[p] *= 3;
+        counts[p] *= 3;
+    }
+    MPI_Allgatherv(MPI_IN_PLACE, 0, MPI_DATATYPE_NULL, static_cast<void*>(forces.data()),
+                   counts.data(), displacements.data(), MPI_DOUBLE, universe);
+}
+#endif
+
 void Simulation::buildTipGridInteractions() {
     // Check that the interaction list is empty before we begin
     if (!interactions_.empty()) {
@@ -427,70 +1357,96 @@ void Simulation::buildTipGridInteractions() {
 
     Vec3d spacing = Vec3d(options_.dx, options_.dy, options_.dz) / 2;
     Vec3i border;
-    border.x = ceil(g_force_grid_margin / spacing.x);
-    border.y = ceil(g_force_grid_margin / spacing.y);
     border.z = ceil(g_force_grid_margin / spacing.z);
     Vec3i n_grid;
-    n_grid.x = floor(options_.area.x / spacing.x) + 2*border.x + 1;
-    n_grid.y = floor(options_.area.y / spacing.y) + 2*border.y + 1;
     n_grid.z = floor((options_.zhigh - options_.zlow) / spacing.z) + 2*border.z + 1;
-    int total_points = n_grid.x * n_grid.y * n_grid.z;
     Vec3d offset;
-    offset.x = -border.x * spacing.x;
-    offset.y = -border.y * spacing.y;
     offset.z = options_.zlow - system.getTipDummyDistance() - border.z * spacing.z;
+    vector<Vec3d> basis_vectors(3, Vec3d(0));
+    basis_vectors[2].z = spacing.z;
+    if (options_.periodic_grid) {
+        // The grid covers one unit cell and is looked up periodically in the plane, so
+        // its size doesn't depend on the scan area. The in-plane cell vectors are divided
+        // to steps of at most dx / 2 and dy / 2. The cell starts where the tip is wrapped
+        // to the cell, so that the grid and the sampled positions match.
+        Vec3d cell_a = system.getUnitCell().getColumn(0);
+        Vec3d cell_b = system.getUnitCell().getColumn(1);
+        cell_a.z = 0;
+        cell_b.z = 0;
+        n_grid.x = max(1, (int)ceil(cell_a.len() / spacing.x));
+        n_grid.y = max(1, (int)ceil(cell_b.len() / spacing.y));
+        basis_vectors[0] = cell_a / n_grid.x;
+        basis_vectors[1] = cell_b / n_grid.y;
+        offset.x = system.getOffset().x;
+        offset.y = system.getOffset().y;
+    } else {
+        border.x = ceil(g_force_grid_margin / spacing.x);
+        border.y = ceil(g_force_grid_margin / spacing.y);
+        n_grid.x = floor(options_.area.x / spacing.x) + 2*border.x + 1;
+        n_grid.y = floor(options_.area.y / spacing.y) + 2*border.y + 1;
+        basis_vectors[0].x = spacing.x;
+        basis_vectors[1].y = spacing.y;
+        offset.x = -border.x * spacing.x;
+        offset.y = -border.y * spacing.y;
+    }
+    if (options_.grid_tolerance > 0) {
+        buildAdaptiveTipGrid(n_grid, basis_vectors, offset);
+        return;
+    }
+    int total_points = n_grid.x * n_grid.y * n_grid.z;
 
     pretty_print("Computing 3D force grid: %d, %d, %d (%d grid points)",
         n_grid.x, n_grid.y, n_grid.z, total_points);
+    // Each process computes a contiguous block of (x, y) columns, which are then
+    // gathered to all processes. The columns take equally long, so equal blocks balance.
+    int n_columns = n_grid.x * n_grid.y;
+    vector<int> column_begins(n_processes_ + 1);
+    for (int p = 0; p <= n_processes_; ++p) {
+        column_begins[p] = (long long)p * n_columns / n_processes_;
+    }
+    int first_column = column_begins[current_process_];
+    int last_column = column_begins[current_process_ + 1];
+
     // Initialize temporary sample vectors
     vector<Vec3d> forces;
     vector<double> energies;
     forces.assign(total_points, Vec3d(0));
     energies.assign(total_points, 0);
 #pragma omp parallel for schedule(dynamic, 1)
-    for (int i = 0; i < n_grid.x; ++i) {
-        double x = i * spacing.x + offset.x;
-        for (int j = 0; j < n_grid.y; ++j) {
-            double y = j * spacing.y + offset.y;
+    for (int column = first_column; column < last_column; ++column) {
+        int i = column / n_grid.y;
+        int j = column % n_grid.y;
+        Vec3d xy = offset + i * basis_vectors[0] + j * basis_vectors[1];
 
-            // Check if this point is handled by this process
-            int current_point = i * n_grid.y + j;
-            if (current_point % n_processes_ != current_process_) {
-                continue;
+        System temp_system = system; // Create a copy of system for each (x, y) point
+        temp_system.setTipDummyDistance(0);
+        temp_system.setDummyXY(xy.x, xy.y);
+
+        for (int k = 0; k < n_grid.z; ++k) {
+            double z = k * spacing.z + offset.z;
+            temp_system.setDummyZ(z);
+            fill(temp_system.forces_.begin(), temp_system.forces_.end(), Vec3d(0));
+            fill(temp_system.energies_.begin(), temp_system.energies_.end(), 0);
+            for (const auto& interaction : interactions_) {
+                interaction->eval(temp_system.positions_, temp_system.forces_, temp_system.energies_);
             }
-            
-            System temp_system = system; // Create a copy of system for each (x, y) point
-            temp_system.setTipDummyDistance(0);
-            temp_system.setDummyXY(x, y);
-
-            for (int k = 0; k < n_grid.z; ++k) {
-                double z = k * spacing.z + offset.z;
-                temp_system.setDummyZ(z);
-                fill(temp_system.forces_.begin(), temp_system.forces_.end(), Vec3d(0));
-                fill(temp_system.energies_.begin(), temp_system.energies_.end(), 0);
-                for (const auto& interaction : interactions_) {
-                    interaction->eval(temp_system.positions_, temp_system.forces_, temp_system.energies_);
-                }
-                int index = i * n_grid.y * n_grid.z + j * n_grid.z + k;
-                forces[index] = temp_system.forces_[1];
-                energies[index] = temp_system.energies_[1];
-            } // z
-        } // y
-    } // x
+            int index = column * n_grid.z + k;
+            forces[index] = temp_system.forces_[1];
+            energies[index] = temp_system.energies_[1];
+        } // z
+    } // x, y
 
-    // Communicate the data to all processes
+    // Communicate the blocks to all processes
 #if MPI_BUILD
-    MPI_Allreduce(MPI_IN_PLACE, static_cast<void*>(forces.data()),
-                  total_points * sizeof(Vec3d), MPI_CHAR, MPI_SUM, universe);
-    MPI_Allreduce(MPI_IN_PLACE, static_cast<void*>(energies.data()),
-                  total_points, MPI_DOUBLE, MPI_SUM, universe);
+    gatherGridColumns(forces, energies, column_begins, n_grid.z, universe);
 #endif
 
     // Initialize ForceGrid object
     ForceGrid fg;
     fg.setNGrid(n_grid);
-    fg.setSpacing(spacing);
+    fg.setBasis(basis_vectors);
     fg.setOffset(offset);
+    fg.setPeriodic(options_.periodic_grid, options_.periodic_grid, false);
     fg.swapForceValues(forces);
     fg.swapEnergyValues(energies);
 
@@ -500,6 +1456,79 @@ void Simulation::buildTipGridInteractions() {
     pretty_print("Done!");
 }
 
+void Simulation::buildAdaptiveTipGrid(const Vec3i& n_grid, const vector<Vec3d>& basis_vectors,
+                                      const Vec3d& offset) {
+    // The bricks are as large as the finest cells of g_adaptive_grid_levels levels of
+    // refinement, which are as small as the cells of the uniform grid. Along the periodic
+    // directions the bricks divide the unit cell evenly.
+    bool periodic[3] = {options_.periodic_grid, options_.periodic_grid, false};
+    const int n_points[3] = {n_grid.x, n_grid.y, n_grid.z};
+    int brick_cells = 2 << g_adaptive_grid_levels;
+    int n_bricks[3];
+    vector<Vec3d> brick_vectors(3);
+    for (int a = 0; a < 3; ++a) {
+        int n_cells = periodic[a] ? n_points[a] : n_points[a] - 1;
+        n_bricks[a] = max(1, (n_cells + brick_cells - 1) / brick_cells);
+        brick_vectors[a] = periodic[a] ? basis_vectors[a] * n_cells / n_bricks[a]
+                                       : basis_vectors[a] * brick_cells;
+    }
+    AdaptiveForceGrid grid;
+    grid.setNBricks(Vec3i(n_bricks[0], n_bricks[1], n_bricks[2]));
+    grid.setBasis(brick_vectors);
+    grid.setOffset(offset);
+    grid.setPeriodic(periodic[0], periodic[1], periodic[2]);
+    grid.setRefinement(g_adaptive_grid_levels, options_.grid_tolerance);
+    pretty_print("Computing adaptive 3D force grid: %d, %d, %d bricks of up to %d, %d, %d points",
+                 n_bricks[0], n_bricks[1], n_bricks[2], brick_cells + 1, brick_cells + 1, brick_cells + 1);
+
+    auto sampler = [this](const vector<Vec3d>& points, vector<Vec3d>& forces, vector<double>& energies) {
+        System temp_system = system;
+        temp_system.setTipDummyDistance(0);
+        for (unsigned int p = 0; p < points.size(); ++p) {
+            temp_system.setDummyXY(points[p].x, points[p].y);
+            temp_system.setDummyZ(points[p].z);
+            fill(temp_system.forces_.begin(), temp_system.forces_.end(), Vec3d(0));
+            fill(temp_system.energies_.begin(), temp_system.energies_.end(), 0);
+            for (const auto& interaction : interactions_) {
+                interaction->eval(temp_system.positions_, temp_system.forces_, temp_system.energies_);
+            }
+            forces[p] = temp_system.forces_[1];
+            energies[p] = temp_system.energies_[1];
+        }
+    };
+
+    // Each process builds a contiguous block of bricks, which are then gathered
+    vector<int> brick_begins(n_processes_ + 1);
+    for (int p = 0; p <= n_processes_; ++p) {
+        brick_begins[p] = (long long)p * grid.nBricks() / n_processes_;
+    }
+    grid.build(sampler, brick_begins[current_process_], brick_begins[current_process_ + 1]);
+#if MPI_BUILD
+    grid.gather(brick_begins, universe);
+#endif
+    // Balancing needs the levels of all the bricks, conforming the samples too
+    grid.balance(sampler, brick_begins[current_process_], brick_begins[current_process_ + 1]);
+#if MPI_BUILD
+    grid.gather(brick_begins, universe);
+#endif
+    grid.conformFaces();
+
+    long long uniform_points = (long long)n_bricks[0] * n_bricks[1] * n_bricks[2] *
+                               brick_cells * brick_cells * brick_cells;
+    vector<int> level_counts = grid.levelCounts();
+    string levels;
+    for (unsigned int level = 0; level < level_counts.size(); ++level) {
+        levels += (level > 0 ? ", " : "") + to_string(level_counts[level]);
+    }
+    pretty_print("%lu samples (%.1f%% of a uniform grid), bricks on each level: %s",
+                 (unsigned long)grid.nSamples(), 100.0 * grid.nSamples() / uniform_points, levels.c_str());
+
+    // Replace the interactions with the grid
+    interactions_.clear();
+    interactions_.emplace_back(new AdaptiveGridInteraction(grid));
+    pretty_print("Done!");
+}
+
 void Simulation::buildTipDummyInteractions() {
     // LJ / Morse
     addVDWInteraction(0, 1);
@@ -521,6 +1550,9 @@ void Simulation::buildSubstrateInteractions() {
     double rc = interaction_parameters_.substrate_rc;
     double k = interaction_parameters_.substrate_k;
     for (int i = 2; i < system.n_atoms_; ++i) {
+        if (isFrozen(i)) {
+            continue;
+        }
       interactions_.emplace_back(new SubstrateInteraction(i, eps, sig, rc, lambda));
         if (system.fixed_[i] == 2) {
             interactions_.emplace_back(new XYHarmonicInteraction(i, k,
@@ -559,27 +1591,15 @@ void Simulation::buildSurfaceSurfaceInteractions() {
     vector<unordered_set<int>> adjacent_atoms(system.n_atoms_);
 
     // Harmonic bond interactions
-    vector<pair<int, int>> bonds;  // List of all the bonds
+    vector<pair<int, int>> bonds = findBonds();  // List of all the bonds
     double bond_k = interaction_parameters_.bond_k;
-    for (int i = 2; i < system.n_atoms_; ++i) {
-        for (int j = i + 1; j < system.n_atoms_; ++j) {
-            unordered_multiset<string> test_set{system.types_[i], system.types_[j]};
-            double r0 = 0;
-            // Check if there's a possibly a bond between these atoms
-            for (const auto& pos_bond : interaction_parameters_.possible_bonds_) {
-                if (pos_bond.atoms == test_set) {
-                    r0 = pos_bond.r0;
-                }
-            }
-            double atom_d = (system.positions_[i] - system.positions_[j]).len();
-            // Check if the atoms distance is small enough to form a bond
-            if (atom_d < 1.1 * r0) {
-                bonds.emplace_back(i, j);
-                adjacent_atoms[i].insert(j);
-                adjacent_atoms[j].insert(i);
-                interactions_.emplace_back(new HarmonicInteraction(i, j, bond_k, atom_d));
-            }
-        }
+    for (const auto& bond : bonds) {
+        int i = bond.first;
+        int j = bond.second;
+        double atom_d = (system.positions_[i] - system.positions_[j]).len();
+        adjacent_atoms[i].insert(j);
+        adjacent_atoms[j].insert(i);
+        interactions_.emplace_back(new HarmonicInteraction(i, j, bond_k, atom_d));
     }
 
     // Figure out which atoms are connected to each other with bonds
@@ -678,16 +1698,264 @@ void Simulation::buildSurfaceSurfaceInteractions() {
     }
 
     // Non-bonded interactions
-    unordered_map<string, AtomParameters> ap = interaction_parameters_.atom_parameters;
+    bool use_tree = options_.coulomb && options_.coulomb_theta > 0;
     for (int i = 2; i < system.n_atoms_; ++i) {
+        if (isFrozen(i)) {
+            continue;
+        }
         for (int j = i + 1; j < system.n_atoms_; ++j) {
             // Only add non-bonded interactions if atoms aren't connected by bonds
-            if (connected_atoms[i].count(j) == 0) {
+            if (connected_atoms[i].count(j) == 0 && !isFrozen(j)) {
+                size_t n_fast = interactions_.size();
                 addVDWInteraction(i, j);
-                if (options_.coulomb) {
+                if (options_.coulomb && !use_tree) {
                     addCoulombInteraction(i, j);
                 }
+                // Far away pairs change slowly, so they go to the slow list
+                double atom_d = (system.positions_[i] - system.positions_[j]).len();
+                if (options_.respa_interval > 1 && atom_d > options_.respa_cutoff) {
+                    for (size_t k = n_fast; k < interactions_.size(); ++k) {
+                        slow_interactions_.push_back(move(interactions_[k]));
+                    }
+                    interactions_.resize(n_fast);
+                }
+            }
+        }
+    }
+
+    // The Coulomb interactions of all the charged atoms with a tree. The atoms connected
+    // by bonds form a molecule, whose atoms don't interact with each other.
+    if (use_tree) {
+        vector<int> charged_atoms, molecules;
+        vector<double> charges;
+        for (int i = 2; i < system.n_atoms_; ++i) {
+            double q = isFrozen(i) ? 0 : atomCharge(i);
+            if (q != 0) {
+                int molecule = i;
+                for (int j : connected_atoms[i]) {
+                    molecule = min(molecule, j);
+                }
+                charged_atoms.push_back(i);
+                charges.push_back(q);
+                molecules.push_back(molecule);
             }
         }
+        if (charged_atoms.size() > 1) {
+            interactions_.emplace_back(new SurfaceTreeCoulombInteraction(system.positions_, charged_atoms,
+                    charges, molecules, system.fixed_, interaction_parameters_.qbase, options_.coulomb_theta));
+        }
+    }
+}
+
+vector<pair<int, int>> Simulation::findBonds() {
+    // Pairs further apart than the longest possible bond can't be bonded, which is
+    // checked before comparing their types
+    double max_r0 = 0;
+    for (const auto& pos_bond : interaction_parameters_.possible_bonds_) {
+        max_r0 = max(max_r0, pos_bond.r0);
     }
+    vector<pair<int, int>> bonds;
+    for (int i = 2; i < system.n_atoms_; ++i) {
+        if (isFrozen(i)) {
+            continue;
+        }
+        for (int j = i + 1; j < system.n_atoms_; ++j) {
+            double atom_d = (system.positions_[i] - system.positions_[j]).len();
+            if (isFrozen(j) || atom_d >= 1.1 * max_r0) {
+                continue;
+            }
+            unordered_multiset<string> test_set{system.types_[i], system.types_[j]};
+            double r0 = 0;
+            // Check if there's a possibly a bond between these atoms
+            for (const auto& pos_bond : interaction_parameters_.possible_bonds_) {
+                if (pos_bond.atoms == test_set) {
+                    r0 = pos_bond.r0;
+                }
+            }
+            // Check if the atoms distance is small enough to form a bond
+            if (atom_d < 1.1 * r0) {
+                bonds.emplace_back(i, j);
+            }
+        }
+    }
+    return bonds;
+}
+
+void Simulation::findFrozenAtoms() {
+    vector<vector<int>> adjacent_atoms(system.n_atoms_);
+    for (const auto& bond : findBonds()) {
+        adjacent_atoms[bond.first].push_back(bond.second);
+        adjacent_atoms[bond.second].push_back(bond.first);
+    }
+    // The atoms of a molecule are frozen if none of them can move
+    frozen_.assign(system.n_atoms_, 0);
+    vector<char> visited(system.n_atoms_, 0);
+    int n_frozen = 0;
+    for (int i = 2; i < system.n_atoms_; ++i) {
+        if (visited[i]) {
+            continue;
+        }
+        vector<int> molecule{i};
+        visited[i] = 1;
+        bool moving = false;
+        for (unsigned int k = 0; k < molecule.size(); ++k) {
+            moving = moving || system.fixed_[molecule[k]] != 1;
+            for (int j : adjacent_atoms[molecule[k]]) {
+                if (!visited[j]) {
+                    visited[j] = 1;
+                    molecule.push_back(j);
+                }
+            }
+        }
+        if (!moving) {
+            for (int j : molecule) {
+                frozen_[j] = 1;
+            }
+            n_frozen += molecule.size();
+        }
+    }
+    pretty_print("%d frozen atoms are replaced by grids, %d atoms interact explicitly",
+                 n_frozen, system.n_atoms_ - 2 - n_frozen);
+}
+
+shared_ptr<const ForceGrid> Simulation::sampleFrozenGrid(const vector<unique_ptr<Interaction>>& interactions,
+                                                         int probe, const Vec3d& low, const Vec3d& high,
+                                                         const string& label) {
+    double spacing = options_.frozen_grid_spacing;
+    Vec3i n_grid;
+    n_grid.x = ceil((high.x - low.x) / spacing) + 1;
+    n_grid.y = ceil((high.y - low.y) / spacing) + 1;
+    n_grid.z = ceil((high.z - low.z) / spacing) + 1;
+    pretty_print("Computing the frozen grid of %s: %d, %d, %d (%d grid points)", label.c_str(),
+                 n_grid.x, n_grid.y, n_grid.z, n_grid.x * n_grid.y * n_grid.z);
+
+    // Each process computes a contiguous block of columns like in buildTipGridInteractions
+    int n_columns = n_grid.x * n_grid.y;
+    vector<int> column_begins(n_processes_ + 1);
+    for (int p = 0; p <= n_processes_; ++p) {
+        column_begins[p] = (long long)p * n_columns / n_processes_;
+    }
+    vector<Vec3d> forces(n_columns * n_grid.z, Vec3d(0));
+    vector<double> energies(n_columns * n_grid.z, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int column = column_begins[current_process_]; column < column_begins[current_process_ + 1]; ++column) {
+        System temp_system = system;  // Create a copy of system for each (x, y) point
+        for (int k = 0; k < n_grid.z; ++k) {
+            temp_system.positions_[probe] = low + spacing * Vec3d(column / n_grid.y, column % n_grid.y, k);
+            fill(temp_system.forces_.begin(), temp_system.forces_.end(), Vec3d(0));
+            fill(temp_system.energies_.begin(), temp_system.energies_.end(), 0);
+            for (const auto& interaction : interactions) {
+                interaction->eval(temp_system.positions_, temp_system.forces_, temp_system.energies_);
+            }
+            forces[column * n_grid.z + k] = temp_system.forces_[probe];
+            energies[column * n_grid.z + k] = temp_system.energies_[probe];
+        }
+    }
+#if MPI_BUILD
+    gatherGridColumns(forces, energies, column_begins, n_grid.z, universe);
+#endif
+
+    shared_ptr<ForceGrid> grid = make_shared<ForceGrid>();
+    grid->setNGrid(n_grid);
+    grid->setSpacing(Vec3d(spacing));
+    grid->setOffset(low);
+    grid->swapForceValues(forces);
+    grid->swapEnergyValues(energies);
+    return grid;
+}
+
+void Simulation::buildFrozenGridInteractions() {
+    // The interactions of an atom with the frozen atoms. addVDWInteraction adds them
+    // to interactions_, so the list is swapped aside meanwhile. The Coulomb interactions
+    // are computed for the charge q of the atom.
+    auto frozen_interactions = [this](int probe, bool vdw, double q) {
+        vector<unique_ptr<Interaction>> probe_interactions;
+        interactions_.swap(probe_interactions);
+        for (int j = 2; j < system.n_atoms_; ++j) {
+            if (!frozen_[j]) {
+                continue;
+            }
+            if (vdw) {
+                addVDWInteraction(probe, j);
+            }
+            double qq = interaction_parameters_.qbase * q * atomCharge(j);
+            if (qq != 0) {
+                interactions_.emplace_back(new CoulombInteraction(probe, j, qq));
+            }
+        }
+        interactions_.swap(probe_interactions);
+        return probe_interactions;
+    };
+
+    // The grids of the moving atoms are the same for all the tips, so they are built once.
+    // They cover the initial positions of the atoms of each type with a margin.
+    double margin = g_frozen_grid_margin;
+    if (frozen_grids_.empty()) {
+        unordered_map<string, pair<Vec3d, Vec3d>> type_boxes;
+        pair<Vec3d, Vec3d> charge_box;
+        bool charged = false;
+        for (int i = 2; i < system.n_atoms_; ++i) {
+            if (system.fixed_[i] == 1) {
+                continue;
+            }
+            Vec3d low = system.positions_[i] - Vec3d(margin);
+            Vec3d high = system.positions_[i] + Vec3d(margin);
+            auto box_it = type_boxes.find(system.types_[i]);
+            if (box_it == type_boxes.end()) {
+                type_boxes[system.types_[i]] = make_pair(low, high);
+            } else {
+                Vec3d& box_low = box_it->second.first;
+                Vec3d& box_high = box_it->second.second;
+                box_low = Vec3d(min(box_low.x, low.x), min(box_low.y, low.y), min(box_low.z, low.z));
+                box_high = Vec3d(max(box_high.x, high.x), max(box_high.y, high.y), max(box_high.z, high.z));
+            }
+            if (options_.coulomb && atomCharge(i) != 0) {
+                if (!charged) {
+                    charge_box = make_pair(low, high);
+                    charged = true;
+                }
+                Vec3d& box_low = charge_box.first;
+                Vec3d& box_high = charge_box.second;
+                box_low = Vec3d(min(box_low.x, low.x), min(box_low.y, low.y), min(box_low.z, low.z));
+                box_high = Vec3d(max(box_high.x, high.x), max(box_high.y, high.y), max(box_high.z, high.z));
+            }
+        }
+        for (int i = 2; i < system.n_atoms_; ++i) {
+            const string& type = system.types_[i];
+            if (system.fixed_[i] != 1 && frozen_grids_.count(type) == 0) {
+                const pair<Vec3d, Vec3d>& box = type_boxes[type];
+                frozen_grids_[type] = sampleFrozenGrid(frozen_interactions(i, true, 0), i,
+                                                       box.first, box.second, type);
+            }
+        }
+        // The Coulomb interactions are sampled for a unit charge, since the charges
+        // may differ between the atoms of the same type
+        for (int i = 2; i < system.n_atoms_ && charged; ++i) {
+            if (system.fixed_[i] != 1) {
+                frozen_coulomb_grid_ = sampleFrozenGrid(frozen_interactions(i, false, 1), i,
+                                                        charge_box.first, charge_box.second, "unit charge");
+                break;
+            }
+        }
+    }
+    for (int i = 2; i < system.n_atoms_; ++i) {
+        if (system.fixed_[i] == 1) {
+            continue;
+        }
+        interactions_.emplace_back(new FrozenGridInteraction(frozen_grids_[system.types_[i]], i, 1));
+        double q = options_.coulomb ? atomCharge(i) : 0;
+        if (q != 0) {
+            interactions_.emplace_back(new FrozenGridInteraction(frozen_coulomb_grid_, i, q));
+        }
+    }
+
+    // The grid of the tip covers the scan volume with a margin and holds both its vdW
+    // and Coulomb interactions, since the charge of the tip is known
+    double tip_d = system.getTipDummyDistance();
+    Vec3d tip_low(-margin, -margin, options_.zlow - tip_d - margin);
+    Vec3d tip_high(options_.area.x + margin, options_.area.y + margin, options_.zhigh - tip_d + margin);
+    double q_tip = options_.coulomb ? atomCharge(1) : 0;
+    string tip_label = "tip " + system.types_[1];
+    interactions_.emplace_back(new FrozenGridInteraction(
+        sampleFrozenGrid(frozen_interactions(1, true, q_tip), 1, tip_low, tip_high, tip_label), 1, 1));
 }
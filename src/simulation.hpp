@@ -3,60 +3,118 @@
 #if MPI_BUILD
     #include <mpi.h>
 #endif
+#include <atomic>
 #include <chrono>
+#include <complex>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "data_grid.hpp"
 #include "globals.hpp"
 #include "integrators.hpp"
 #include "interactions.hpp"
+#include "kernels.hpp"
 #include "minimiser.hpp"
+#include "progress.hpp"
+#include "stream_sink.hpp"
 #include "system.hpp"
+#include "text_buffer.hpp"
+#include "trajectory.hpp"
 #include "vectors.hpp"
+#include "volume_io.hpp"
 
 using namespace std;
 
 // Defines all the different minimization criteria
 enum MinimizationCriteria {MIN_E, MIN_F, MIN_EF, NOT_SET};
 
-// Defines the direction of the surface normal
-enum SurfNormal {NORMAL_X, NORMAL_Y, NORMAL_Z};
-
 // Defines the possible unit systems
 enum Units {U_KCAL, U_KJ, U_EV};
 
+// Defines the file formats of the exported volumes
+enum VolumeFormat {VOLUME_CUBE, VOLUME_XSF, VOLUME_NPY, VOLUME_NPZ};
+
+// Defines the quantities stored for the exported volumes
+enum VolumeField {VOLUME_FZ, VOLUME_ENERGY, VOLUME_DX, VOLUME_DY, VOLUME_DZ, N_VOLUME_FIELDS};
+
 // Defines a structure for all input options
 struct InputOptions {
     string inputfolder;
     string outputfolder;
     string inputfile;
+    bool campaign;  // Whether the scan is run as a part of a campaign
     string xyzfile;
     string paramfile;
-    string e_potential_file;
-    string tipatom;
-    string dummyatom;
+    vector<string> e_potential_files;  // The external potentials that are summed up
+    vector<double> e_potential_weights;  // The weight of each external potential
+    Vec3i e_potential_grid;  // Grid the external potentials are resampled to (0 = grid of the first)
+    string density_file;  // Electron density of the sample for the Pauli repulsion (empty = off)
+    vector<string> tip_density_files;  // The electron density of each tip atom
+    double pauli_a, pauli_b;  // Prefactor (eV) and exponent of the density overlap
+    string tipatom;  // The first tip atom (see tipatoms)
+    string dummyatom;  // The first dummy atom (see dummyatoms)
+    vector<string> tipatoms;  // All the tip atoms scanned in a single pass
+    vector<string> dummyatoms;  // The dummy atom for each tip atom
     string planeatom;
     Vec2d area, center;
     double dx, dy, dz;
     double zlow, zhigh;
     bool vdw_pbc;
     Vec3d cell_a, cell_b, cell_c;
-    SurfNormal normal;
+    Vec3d surface_normal;  // The normal of the surface pointing to the tip, in the xyz frame
+    Vec3d scan_direction;  // The x axis of the scan in the xyz frame (0 = automatic)
+    Mat3d frame;  // Rows are the scan x and y axes and the surface normal in the xyz frame
     Units units;
     bool coulomb;
+    double coulomb_theta;  // Accuracy of the Barnes-Hut Coulomb (0 = exact pair sums)
     bool tip_dummy_coulomb;
     bool use_external_potential;
+    bool retract;
+    bool stiffness;
+    double temperature;  // Temperature of the thermal sampling (0 = off)
+    int thermal_replicas, thermal_steps, thermal_equil;
+    double thermal_dt, friction;
+    unsigned long seed;
+    vector<string> volume_output;  // Quantities exported as volumes at the end of the run
+    VolumeFormat volume_format;
+    double amplitude, k_cantilever, f0;  // Cantilever parameters of the frequency shift
+    int respa_interval;  // Steps between evaluations of the slow interactions
+    double respa_cutoff;  // Distance beyond which surface-surface pairs are slow
+    int output_fields;  // OutputFields written to the output files
+    string stream_output;  // Target of the binary result stream (empty = off)
+    double progress_interval;  // Seconds between the progress reports
+    bool status_file;  // Writes the progress to status.txt in the output folder
+    bool trajectory;  // Write the relaxed structures to a multi-frame xyz file
+    vector<Vec2i> trajectory_columns;  // x, y indices of the recorded columns, (-1, -1) is the center (empty = all)
+    vector<int> trajectory_levels;  // z indices of the recorded structures (empty = all)
     int maxsteps;
     MinimizationCriteria minterm;
     double etol, ftol, dt;
-    int bufsize;
     bool gzip;
     bool statistics;
     bool flexible, rigidgrid;
+    bool periodic_grid;  // Builds the rigid grid over the unit cell instead of the scan area
+    double grid_tolerance;  // Force tolerance of the adaptive rigid grid (0 = uniform grid)
+    bool frozen_grid;  // Replaces the atoms of the fixed molecules by grids in flexible mode
+    double frozen_grid_spacing;
     bool xyz_charges;
     MinimiserType minimiser_type;
     IntegratorType integrator_type;
+    IsaVariant isa;  // Instruction set variant of the vectorised kernels
+};
+
+// Defines a structure for a single tip and dummy pair that is scanned over the surface.
+// The surface is shared by all the tips, only the interactions differ.
+struct TipSetup {
+    string tipatom;
+    string dummyatom;
+    System system;  // Copy of the system with this tip and dummy
+    vector<unique_ptr<Interaction>> interactions;  // The interactions of this tip and dummy
+    vector<unique_ptr<Interaction>> slow_interactions;  // The slowly varying interactions
 };
 
 class Simulation {
@@ -71,13 +129,28 @@ class Simulation {
     void run();
     // Builds all the interactions
     void buildInteractions();
+    // Returns the folder the output of the given tip is written to
+    string tipOutputFolder(int tip) const;
+    // Writes the assembled scan volumes to cube, XSF, npy or npz files
+    void writeVolumes();
+    // Opens the binary result stream and writes its header (root only)
+    void openStream();
+    // Ends and closes the binary result stream
+    void closeStream();
+    // Selects the recorded points and opens the trajectory file of this process
+    void openTrajectory();
+    // Writes the remaining frames and closes the trajectory file
+    void closeTrajectory();
 
     System system;  // Holds the system to be minimised
     vector<unique_ptr<Interaction>> interactions_; // List of all the interactions
+    vector<unique_ptr<Interaction>> slow_interactions_; // Interactions evaluated every respa_interval steps
+    deque<TipSetup> tips_;  // The tips scanned over the system (deque keeps them in place)
     InputOptions options_;  // Structure containing all relevant input options
     InteractionParameters interaction_parameters_;
     Vec3i n_points_;  // Number of points (x,y,z) to be minimised
     unsigned long n_total_;  // Total number of minimization steps used
+    unsigned long n_hysteresis_;  // Number of points where approach and retract forces differ
     vector<FILE*> fstreams_;  // Array with all the file streams
 
     // Some parallel specific global variables
@@ -95,23 +168,123 @@ class Simulation {
  private:
     // Calculates the initial distance of the tip and the dummy atoms
     void calculateTipDummyDistance();
-    // Writes the output buffer to the disk
-    void writeOutput(vector<OutputData> output_buffer);
+    // Minimises the system with the chosen minimiser and returns the number of steps used
+    int minimiseSystem(System& min_system) const;
+    // Scans a single x, y column with the given tip and stores the results of each branch
+    // and z level to z_data. Adds the minimisation steps and hysteresis points to the counters.
+    void scanColumn(int tip, int i, int j, bool write_xyz, OutputData* z_data,
+                    unsigned long& n_steps, unsigned long& n_hysteresis);
+    // Queues the relaxed structure of the point of data to the trajectory if it's selected
+    void recordTrajectory(const System& min_system, const OutputData& data);
+    // Samples the mean and variance of the tip force at finite temperature for a scan point
+    void sampleThermalForces(const System& min_system, OutputData& data) const;
+    // Allocates the volumes for the volume output
+    void initVolumes();
+    // Stores the given data to the volumes
+    void storeVolumeData(const OutputData& data);
+    // Computes the frequency shift from the z force volume. Returns false if the
+    // oscillation doesn't fit in the scanned z range.
+    bool computeFrequencyShift(const DataGrid<double>& fz, DataGrid<double>& df) const;
+    // Returns the index of the file stream the given data is written to
+    int streamIndex(const OutputData& data) const;
+    // Allocates the bookkeeping of the output slabs (one slab for each x row)
+    void initOutputSlabs();
+    // Returns the first record of the x, y column in the result slab of row i
+    OutputData* slabRecord(int i, int j);
+    // Marks n_row_points points of row i done and writes or sends the completed slabs
+    void finishSlab(int i, int n_row_points);
+    // Receives the rows sent by the other processes (waits for one row if wait is true)
+    void receiveSlabs(bool wait);
+    // Writes the completed slabs in order if no other thread is writing (or waits for it)
+    void emitSlabs(bool wait);
+    // Writes all the remaining slabs at the end of the run
+    void flushSlabs();
+    // Writes the slab of row i to the output files
+    void writeSlab(int i);
+    // Appends the text line of a single record to the buffer
+    void formatRecord(const OutputData& data, TextBuffer& buffer) const;
+    // Returns the number of values a record with the given OutputFields is packed to.
+    // The indices are never packed, they follow from the order of the records.
+    int packedSize(int fields) const;
+    // Appends the given OutputFields of a record to packed
+    void packRecord(const OutputData& data, int fields, vector<double>& packed) const;
+    // Reads the given OutputFields of a record from packed and returns the position after them
+    const double* unpackRecord(const double* packed, int fields, OutputData& data) const;
     // Add a LJ or Morse interaction between atoms 1 and 2
-    void addVDWInteraction(int atom_i1, int atom_i2, Vec3d pbc_shift);
+    // Adds a LJ or Morse interaction, LJ interactions go to tip_pairs if it's given
+    void addVDWInteraction(int atom_i1, int atom_i2, Vec3d pbc_shift,
+                           LJTipSurfaceInteraction* tip_pairs);
     // Add a Coulomb interaction between atoms 1 and 2
+    // Returns the charge of the atom from the xyz file or the parameters
+    double atomCharge(int atom_i);
     void addCoulombInteraction(int atom_i1, int atom_i2);
     // Looks for overwrite parameters for atoms 1 and 2.
     // Returns true if found and sets op if found.
     bool findOverwriteParameters(int atom_i1, int atom_i2, OverwriteParameters& op);
     // Build all the interactions of the tip atom with the surface atoms
     void buildTipSurfaceInteractions();
+    // Reads a volume given in the frame of the xyz file on the root process and sends it
+    // to the other processes
+    void readSampleGrid(const string& path, VolumeQuantity quantity, DataGrid<double>& grid);
+    // Transforms a volume read by readSampleGrid to the scan frame
+    void transformSampleGrid(DataGrid<double>& grid) const;
+    // Reads the weighted sum of the external potentials resampled to a common grid
+    void readExternalPotential(DataGrid<double>& potential);
+    // Build the Pauli repulsion of the tip atom from the density overlap
+    void buildDensityOverlapInteraction();
     // Build a grid interaction to approximate tip surface interactions
     void buildTipGridInteractions();
+    // Build an adaptive grid covering the same points as the uniform grid of n_grid points
+    void buildAdaptiveTipGrid(const Vec3i& n_grid, const vector<Vec3d>& basis_vectors,
+                              const Vec3d& offset);
     // Build the interactions between the tip and dummy atom
     void buildTipDummyInteractions();
     // Build all the interactions between the surface atoms
     void buildSurfaceSurfaceInteractions();
     // Build substrate interactions for all surface atoms
     void buildSubstrateInteractions();
+    // Returns the bonded pairs of surface atoms (i < j) that aren't frozen
+    vector<pair<int, int>> findBonds();
+    // Marks the atoms of the molecules without any moving atoms frozen
+    void findFrozenAtoms();
+    // Returns whether the atom is frozen, i.e. it only interacts through the frozen grids
+    bool isFrozen(int atom_i) const { return !frozen_.empty() && frozen_[atom_i]; }
+    // Samples the force and energy of the given interactions on atom probe over a grid
+    // spanning the box from low to high
+    shared_ptr<const ForceGrid> sampleFrozenGrid(const vector<unique_ptr<Interaction>>& interactions,
+                                                 int probe, const Vec3d& low, const Vec3d& high,
+                                                 const string& label);
+    // Build the grid interactions of the tip and the moving atoms with the frozen atoms
+    void buildFrozenGridInteractions();
+
+    // Electrostatic force grid for a unit tip charge shared by all the tips
+    shared_ptr<const ForceGrid> e_potential_grid_;
+    // FFT of the sample density to the power pauli_b, shared by all the tips
+    DataGrid<complex<double>> density_kspace_;
+    Vec3d density_origin_;
+    // Density overlap force grids by the tip density file
+    unordered_map<string, shared_ptr<const ForceGrid>> density_grids_;
+    // Whether each atom is frozen (empty if frozen_grid is off)
+    vector<char> frozen_;
+    // Frozen force grids of the moving atoms by the atom type and for a unit charge,
+    // shared by all the tips
+    unordered_map<string, shared_ptr<const ForceGrid>> frozen_grids_;
+    shared_ptr<const ForceGrid> frozen_coulomb_grid_;
+    // Scan results with z ascending for each tip, branch and VolumeField (root only)
+    vector<DataGrid<double>> volumes_;
+
+    // Result volume split in x slabs. The records of a point are stored contiguously
+    // in the order of tip, branch and z, so every record has a fixed index.
+    vector<vector<OutputData>> slabs_;
+    int records_per_point_;
+    int record_fields_;  // OutputFields computed for each record and sent to the root process
+    unique_ptr<once_flag[]> slab_allocated_;  // Each slab is allocated once when first needed
+    unique_ptr<atomic<int>[]> slab_points_;  // Number of finished points in each slab
+    atomic<int> next_slab_;  // The next slab to be written
+    ProgressReporter progress_;
+    mutex emit_mutex_;  // Held by the thread writing the slabs
+    StreamSink stream_sink_;  // Binary stream of the results (if stream_output is given)
+    TrajectoryWriter trajectory_;  // Relaxed structures of the selected points (if trajectory is on)
+    vector<char> trajectory_columns_;  // Whether each x, y column is recorded
+    vector<char> trajectory_levels_;  // Whether each z level is recorded
 };
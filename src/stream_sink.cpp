@@ -0,0 +1,122 @@
+#include "stream_sink.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#ifndef _WIN32
+    #include <csignal>
+    #include <fcntl.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <unistd.h>
+#endif
+
+using namespace std;
+
+
+int StreamSink::stdout_fd_ = -1;
+
+
+void StreamSink::detachStdout() {
+#ifndef _WIN32
+    if (stdout_fd_ < 0) {
+        stdout_fd_ = dup(STDOUT_FILENO);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+#endif
+}
+
+
+void StreamSink::open(const string& target) {
+    close();
+#ifdef _WIN32
+    throw runtime_error("Streaming output is not supported on Windows");
+#else
+    // A consumer that goes away is reported as an error of the write, not a signal
+    signal(SIGPIPE, SIG_IGN);
+    if (target == "-") {
+        // The detached stdout is used only by the stream, so it's closed with it
+        owns_fd_ = stdout_fd_ >= 0;
+        fd_ = owns_fd_ ? stdout_fd_ : STDOUT_FILENO;
+        stdout_fd_ = -1;
+    } else if (target.compare(0, 5, "unix:") == 0) {
+        string path = target.substr(5);
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            throw runtime_error("Invalid UNIX socket path " + path);
+        }
+        strcpy(address.sun_path, path.c_str());
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0 || connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            string reason = strerror(errno);
+            close();
+            throw runtime_error("Cannot connect to the UNIX socket " + path + ": " + reason);
+        }
+        owns_fd_ = true;
+    } else {
+        fd_ = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            throw runtime_error("Cannot open " + target + ": " + strerror(errno));
+        }
+        owns_fd_ = true;
+    }
+#endif
+}
+
+
+void StreamSink::writeHeader(const StreamHeader& header) {
+    const char magic[8] = "MECHAFM";
+    const uint32_t version = 1;
+    const int32_t sizes[6] = {header.nx, header.ny, header.nz,
+                              header.n_tips, header.n_branches, header.n_values};
+    const double spacing[4] = {header.dx, header.dy, header.dz, header.zhigh};
+    writeAll(magic, sizeof(magic));
+    writeAll(&version, sizeof(version));
+    writeAll(&header.fields, sizeof(header.fields));
+    writeAll(sizes, sizeof(sizes));
+    writeAll(spacing, sizeof(spacing));
+}
+
+
+void StreamSink::writeFrame(StreamFrame type, int32_t index, const vector<double>& values) {
+    const uint32_t frame_type = type;
+    const uint64_t n_values = values.size();
+    writeAll(&frame_type, sizeof(frame_type));
+    writeAll(&index, sizeof(index));
+    writeAll(&n_values, sizeof(n_values));
+    writeAll(values.data(), values.size() * sizeof(double));
+}
+
+
+void StreamSink::close() {
+#ifndef _WIN32
+    if (fd_ >= 0 && owns_fd_) {
+        ::close(fd_);
+    }
+#endif
+    fd_ = -1;
+    owns_fd_ = false;
+}
+
+
+void StreamSink::writeAll(const void* data, size_t size) {
+#ifndef _WIN32
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = write(fd_, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw runtime_error(string("Writing the stream failed: ") + strerror(errno));
+        }
+        bytes += written;
+        size -= written;
+    }
+#else
+    (void)data;
+    (void)size;
+#endif
+}
@@ -0,0 +1,69 @@
+/*
+ * stream_sink.hpp
+ *
+ * StreamSink writes the scan results as framed binary records to stdout, a file,
+ * a named pipe or a UNIX socket while the scan runs.
+ *
+ * The stream starts with a header and is followed by one frame for each completed
+ * x row of the scan, in order of x, and an end frame. All the values are in the
+ * native byte order.
+ *
+ *   header: char magic[8] = "MECHAFM", uint32 version, uint32 fields (OutputFields),
+ *           int32 nx, ny, nz, n_tips, n_branches, n_values, double dx, dy, dz, zhigh
+ *   frame:  uint32 type (STREAM_SLAB or STREAM_END), int32 x index, uint64 n_doubles,
+ *           followed by n_doubles doubles
+ *
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Defines the types of the frames following the stream header
+enum StreamFrame {STREAM_SLAB = 1, STREAM_END = 2};
+
+// Defines the header written at the beginning of the stream
+struct StreamHeader {
+    uint32_t fields;  // OutputFields of the values of each record
+    int32_t nx, ny, nz;
+    int32_t n_tips, n_branches;
+    int32_t n_values;  // Number of values of each record
+    double dx, dy, dz, zhigh;
+};
+
+/** \brief A binary stream writer.
+ *
+ * The writes block until the consumer has read the data, so a slow consumer
+ * slows down the writing instead of the data piling up in a pipe buffer.
+ * Errors, including a consumer that goes away, throw a runtime_error.
+ */
+
+class StreamSink {
+public:
+    StreamSink(): fd_(-1), owns_fd_(false) {};
+    ~StreamSink() { close(); };
+
+    // Moves stdout to a new file descriptor for the stream and sends everything else
+    // written to stdout to stderr. Must be called before the first message is flushed.
+    static void detachStdout();
+
+    // opens the target: "-" for stdout, "unix:PATH" for a UNIX socket or a file path.
+    // Opening a named pipe waits until there is a reader.
+    void open(const string& target);
+    bool isOpen() const { return fd_ >= 0; };
+    void writeHeader(const StreamHeader& header);
+    void writeFrame(StreamFrame type, int32_t index, const vector<double>& values);
+    void close();
+
+private:
+    // writes all the bytes, retrying partial and interrupted writes
+    void writeAll(const void* data, size_t size);
+
+    int fd_;
+    bool owns_fd_;
+    static int stdout_fd_;  // The original stdout after detachStdout
+};
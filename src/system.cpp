@@ -1,5 +1,6 @@
 #include "system.hpp"
 
+#include <algorithm>
 #include <cmath>
 #include <cstdio>
 
@@ -25,19 +26,60 @@ void System::initialize(int n_atoms) {
 }
 
 
-OutputData System::getOutput() const {
-    OutputData data;
+OutputData System::getOutput(int fields) const {
+    OutputData data = OutputData();  // The quantities that are not computed are zero
     data.position.x = real_tip_xy_.x;
     data.position.y = real_tip_xy_.y;
     data.position.z = positions_[0].z;
     data.r_vec = positions_[1] - positions_[0];
-    data.r = data.r_vec.len();
-    data.angle = atan2(data.r_vec.getXY().len(), data.r_vec.z) * (180.0 / PI);
-    evalTipSurfaceForces(data.tip_force, data.tip_energy);
+    if (fields & OUT_R) {
+        data.r = data.r_vec.len();
+    }
+    if (fields & OUT_ANGLE) {
+        data.angle = atan2(data.r_vec.getXY().len(), data.r_vec.z) * (180.0 / PI);
+    }
+    if (fields & (OUT_FORCE | OUT_ENERGY)) {
+        evalTipSurfaceForces(data.tip_force, data.tip_energy);
+    }
+    if (fields & OUT_STIFFNESS) {
+        Mat3d stiffness = evalTipStiffness();
+        data.stiffness = Vec3d(stiffness.at(0, 0), stiffness.at(1, 1), stiffness.at(2, 2));
+    }
     return data;
 }
 
 
+void System::evalInteractions(const vector<Vec3d>& positions, vector<Vec3d>& forces,
+                              vector<double>& energies) const {
+    for (const auto& interaction : *interactions_) {
+        interaction->eval(positions, forces, energies);
+    }
+    if (slow_interactions_ != nullptr) {
+        for (int i = 0; i < n_atoms_; ++i) {
+            forces[i] += slow_forces_[i];
+            energies[i] += slow_energies_[i];
+        }
+    }
+}
+
+
+void System::updateSlowForces(bool refresh) {
+    if (slow_interactions_ == nullptr) {
+        return;
+    }
+    if (!refresh && slow_age_ + 1 < slow_interval_ && !slow_forces_.empty()) {
+        slow_age_++;
+        return;
+    }
+    slow_forces_.assign(n_atoms_, Vec3d(0));
+    slow_energies_.assign(n_atoms_, 0);
+    for (const auto& interaction : *slow_interactions_) {
+        interaction->eval(positions_, slow_forces_, slow_energies_);
+    }
+    slow_age_ = 0;
+}
+
+
 void System::evalTipSurfaceForces(Vec3d& tip_force, double& tip_energy) const {
     vector<Vec3d> forces(n_atoms_, Vec3d(0));
     vector<double> energies(n_atoms_, 0);
@@ -51,6 +93,34 @@ void System::evalTipSurfaceForces(Vec3d& tip_force, double& tip_energy) const {
 }
 
 
+Mat3d System::evalTipStiffness() const {
+    // Hessians of the tip-surface (h_surface) and tip-dummy (h_dummy) potentials
+    // with respect to the tip position
+    Mat3d h_surface, h_dummy;
+    for (const auto& interaction : *interactions_) {
+        if (interaction->isTipSurface()) {
+            interaction->addTipHessian(positions_, h_surface);
+        } else {
+            interaction->addTipHessian(positions_, h_dummy);
+        }
+    }
+
+    // In equilibrium the tip follows the dummy as dt = (H_s + H_d)^-1 H_d dd, so the
+    // stiffness of the tip force is H_s (H_s + H_d)^-1 H_d. Relaxation of the surface
+    // atoms is neglected.
+    Mat3d h_total;
+    for (int a = 0; a < 3; ++a) {
+        for (int b = 0; b < 3; ++b) {
+            h_total.at(a, b) = h_surface.at(a, b) + h_dummy.at(a, b);
+        }
+    }
+    if (abs(h_total.determinant()) < TOLERANCE) {
+        return Mat3d(0);
+    }
+    return h_surface.multiply(h_total.inverse().multiply(h_dummy));
+}
+
+
 void System::makeXYZFile(string folder) const {
     char file_name[NAME_LENGTH];
     sprintf(file_name, "%sstate_%.1f-%.1f-%.1f.xyz", folder.c_str(), real_tip_xy_.x, real_tip_xy_.y, positions_[0].z);
@@ -65,28 +135,10 @@ void System::makeXYZFile(string folder) const {
 }
 
 
-void System::rotateCoordAxes(const string& new_coord_sequence) {
-    vector<Vec3d> new_positions;
-    new_positions.resize(positions_.size());
-    
-    if (new_coord_sequence == "ZXY") {
-        for (unsigned int ia = 0; ia < positions_.size(); ia++) {
-            new_positions[ia].x = positions_[ia].z;
-            new_positions[ia].y = positions_[ia].x;
-            new_positions[ia].z = positions_[ia].y;
-        }
-    } else if (new_coord_sequence == "YZX") {
-        for (unsigned int ia = 0; ia < positions_.size(); ia++) {
-            new_positions[ia].x = positions_[ia].y;
-            new_positions[ia].y = positions_[ia].z;
-            new_positions[ia].z = positions_[ia].x;
-        }
-    } else {
-        error("Cannot rotate coordinate axes to %s! Possible choices are ZXY and YZX.",
-              new_coord_sequence.c_str());
+void System::transformCoordinates(const Mat3d& frame) {
+    for (auto& position : positions_) {
+        position = frame.multiply(position);
     }
-    
-    positions_.swap(new_positions);
 }
 
 
@@ -12,19 +12,37 @@ using namespace std;
 
 class System {
  public:
-    System(): n_atoms_(0), interactions_(nullptr) {};
+    System(): n_atoms_(0), interactions_(nullptr), slow_interactions_(nullptr),
+              slow_interval_(1), slow_age_(0) {};
     ~System() {};
     // Initializes the state vectors for given number of surface atoms.
     // Note: n_atoms doesn't include the tip and the dummy!
     void initialize(int n_atoms);
-    // Returns the output data for the current state of the system
-    OutputData getOutput() const;
+    // Returns the output data for the current state of the system. Only the OutputFields
+    // in fields are computed, the position and r_vec are always set.
+    OutputData getOutput(int fields = OUT_ALL) const;
+    // Evaluates the interactions at the given positions and adds the forces and energies.
+    // Slow interactions are not evaluated, their latest cached values are added instead.
+    void evalInteractions(const vector<Vec3d>& positions, vector<Vec3d>& forces,
+                          vector<double>& energies) const;
+    // Reevaluates the slow interactions if they are older than the refresh interval
+    // or if refresh is true. Should be called once at the beginning of each step.
+    void updateSlowForces(bool refresh = false);
+    // Makes the next call to updateSlowForces reevaluate the slow interactions
+    void expireSlowForces() { slow_age_ = slow_interval_; }
+    // Returns whether the cached slow forces were evaluated at the current step
+    bool slowForcesFresh() const { return slow_interactions_ == nullptr || slow_age_ == 0; }
+    // Sets the interval (in steps) at which the slow interactions are reevaluated
+    void setSlowInterval(int interval) { slow_interval_ = interval; }
     // Evaluates the current force on the tip from surface atoms
     void evalTipSurfaceForces(Vec3d& force, double& energy) const;
+    // Evaluates the effective stiffness matrix of the relaxed tip-dummy system, ie.
+    // the negative derivative of the tip force with respect to the dummy position
+    Mat3d evalTipStiffness() const;
     // Writes the current atom positions to a xyz file
     void makeXYZFile(string folder = "") const;
-    // Rotates the coordinate axes from XYZ to either ZXY or YZX (affects positions only)
-    void rotateCoordAxes(const string& new_coord_sequence);
+    // Expresses the positions in the frame whose axes are the rows of frame
+    void transformCoordinates(const Mat3d& frame);
     // Centers the molecule around pos in x, y
     void centerMolecule(const Vec2d pos);
     // Set the periodic unit cell (also sets tip_pbc_ to true)
@@ -52,9 +70,17 @@ class System {
         positions_[0].z -= dz;
         positions_[1].z -= dz;
     }
+    // Raises the dummy and the tip without resetting their relative position
+    void raiseTip(double dz) {
+        positions_[0].z += dz;
+        positions_[1].z += dz;
+    }
 
     int n_atoms_;  // Count of atoms in the system including the tip and the dummy
     vector<unique_ptr<Interaction>>* interactions_;  // Pointer to the interaction list
+    // Pointer to the slowly varying interactions (far surface-surface pairs), which
+    // are evaluated only every slow_interval_ steps. nullptr if there are none.
+    vector<unique_ptr<Interaction>>* slow_interactions_;
 
     // Vectors holding the system state
     // index 0 = dummy and index 1 = tip
@@ -68,6 +94,10 @@ class System {
     vector<string> types_;
 
  private:
+    int slow_interval_;
+    int slow_age_;  // Steps since the slow forces were evaluated
+    vector<Vec3d> slow_forces_;  // Cached forces of the slow interactions
+    vector<double> slow_energies_;  // Cached energies of the slow interactions
     bool tip_pbc_;
     double tip_dummy_d_;  // Initial distance of the tip and dummy atoms
     Vec3d offset_;
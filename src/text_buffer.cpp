@@ -0,0 +1,81 @@
+#include "text_buffer.hpp"
+
+#include <cmath>
+#include <cstdint>
+
+using namespace std;
+
+
+static const double decimal_powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+static const uint64_t integer_powers[] = {1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+                                          1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL};
+
+
+void TextBuffer::appendInt(long value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    // Negate in unsigned arithmetic so that the smallest long works as well
+    unsigned long magnitude = value < 0 ? 0UL - static_cast<unsigned long>(value) : value;
+    do {
+        *--start = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0) {
+        *--start = '-';
+    }
+    buffer_.append(start, end);
+}
+
+
+void TextBuffer::appendFixed(double value, int width, int precision) {
+    if (precision >= 0 && precision <= 9 && isfinite(value)) {
+        double scaled = fabs(value) * decimal_powers[precision];
+        double whole = floor(scaled);
+        double fraction = scaled - whole;
+        // The scaling is exact to about one unit in the last place. If the fraction is
+        // closer than that to one half, the rounding is left to printf.
+        if (scaled < 1e15 && fabs(fraction - 0.5) > 1e-15 * scaled) {
+            uint64_t rounded = static_cast<uint64_t>(whole) + (fraction > 0.5 ? 1 : 0);
+            uint64_t int_part = rounded / integer_powers[precision];
+            uint64_t frac_part = rounded % integer_powers[precision];
+            char digits[32];
+            char* end = digits + sizeof(digits);
+            char* start = end;
+            for (int i = 0; i < precision; ++i) {
+                *--start = '0' + frac_part % 10;
+                frac_part /= 10;
+            }
+            if (precision > 0) {
+                *--start = '.';
+            }
+            do {
+                *--start = '0' + int_part % 10;
+                int_part /= 10;
+            } while (int_part > 0);
+            // printf keeps the sign of negative numbers that round to zero
+            if (signbit(value)) {
+                *--start = '-';
+            }
+            int length = end - start;
+            if (length < width) {
+                buffer_.append(width - length, ' ');
+            }
+            buffer_.append(start, end);
+            return;
+        }
+    }
+    int length = snprintf(nullptr, 0, "%*.*f", width, precision, value);
+    size_t offset = buffer_.size();
+    buffer_.resize(offset + length + 1);
+    snprintf(&buffer_[offset], length + 1, "%*.*f", width, precision, value);
+    buffer_.resize(offset + length);
+}
+
+
+void TextBuffer::flush(FILE* stream) {
+    if (!buffer_.empty()) {
+        fwrite(buffer_.data(), 1, buffer_.size(), stream);
+        buffer_.clear();
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * text_buffer.hpp
+ *
+ * TextBuffer collects formatted text output in memory so that whole blocks of
+ * records are written to a file at once. Integers and fixed precision numbers
+ * are converted without printf, but the result is identical to "%d" and "%W.Pf".
+ *
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+
+using namespace std;
+
+/** \brief A fixed format text output buffer.
+ *
+ * Fixed precision numbers are rounded with integer arithmetic. Values that are
+ * too close to a rounding tie for that to be exact, and values that are too large
+ * or not finite, are formatted with snprintf instead.
+ */
+
+class TextBuffer {
+public:
+    TextBuffer() {};
+
+    // appends a single character
+    void append(char c) { buffer_ += c; };
+    // appends a string as it is
+    void append(const string& text) { buffer_ += text; };
+    // appends an integer as "%d"
+    void appendInt(long value);
+    // appends a floating point number as "%<width>.<precision>f" (precision at most 9)
+    void appendFixed(double value, int width, int precision);
+
+    const char* data() const { return buffer_.data(); };
+    size_t size() const { return buffer_.size(); };
+    void clear() { buffer_.clear(); };
+    // writes the contents to the stream with a single call and clears the buffer
+    void flush(FILE* stream);
+
+private:
+    string buffer_;
+};
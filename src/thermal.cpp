@@ -0,0 +1,120 @@
+#include "thermal.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "globals.hpp"
+#include "interactions.hpp"
+#include "messages.hpp"
+#include "random.hpp"
+#include "simulation.hpp"
+
+using namespace std;
+
+// Returns the Boltzmann constant in the energy units of the simulation (per kelvin)
+double boltzmannConstant(Units units) {
+    switch (units) {
+        case U_KCAL:
+            return g_kB_kcal;
+        case U_KJ:
+            return g_kB_kJ;
+        case U_EV:
+            return g_kB_eV;
+        default:
+            error("Boltzmann constant is not implemented for the given units!");
+    }
+    return 0;
+}
+
+// Evaluates all the interactions of the system and returns the force on the tip
+// caused by the surface. The tip surface interactions are evaluated last so that
+// their share of the tip force is obtained without a second pass.
+Vec3d evalLangevinForces(System& system) {
+    fill(system.forces_.begin(), system.forces_.end(), Vec3d(0));
+    fill(system.energies_.begin(), system.energies_.end(), 0);
+    for (const auto& interaction : *system.interactions_) {
+        if (!interaction->isTipSurface()) {
+            interaction->eval(system.positions_, system.forces_, system.energies_);
+        }
+    }
+    // The dynamics can't use cached slow forces, so they are evaluated every step
+    if (system.slow_interactions_ != nullptr) {
+        for (const auto& interaction : *system.slow_interactions_) {
+            interaction->eval(system.positions_, system.forces_, system.energies_);
+        }
+    }
+    Vec3d other_force = system.forces_[1];
+    for (const auto& interaction : *system.interactions_) {
+        if (interaction->isTipSurface()) {
+            interaction->eval(system.positions_, system.forces_, system.energies_);
+        }
+    }
+    return system.forces_[1] - other_force;
+}
+
+void thermalSampling(const System& system, const InputOptions& options, uint64_t seed,
+                     Vec3d& mean_force, Vec3d& force_variance) {
+    const double kT = boltzmannConstant(options.units) * options.temperature;
+    const double dt = options.thermal_dt;
+    // Velocity scaling and noise amplitude of the Ornstein-Uhlenbeck step
+    const double c1 = exp(-options.friction * dt);
+    const double c2 = sqrt(1 - c1 * c1);
+    const int n_steps = options.thermal_equil + options.thermal_steps;
+
+    // Running mean and sum of squared deviations (Welford)
+    double mean[3] = {0, 0, 0};
+    double m2[3] = {0, 0, 0};
+    long n_samples = 0;
+    for (int r = 0; r < options.thermal_replicas; ++r) {
+        Random random(hashSeed(seed, r));
+        System replica = system;
+
+        // Start from Maxwell-Boltzmann distributed velocities
+        vector<double> sigma_v(replica.n_atoms_, 0);
+        for (int i = 0; i < replica.n_atoms_; ++i) {
+            if (replica.fixed_[i] != 1) {
+                sigma_v[i] = sqrt(kT / replica.masses_[i]);
+                replica.velocities_[i] = sigma_v[i] * random.normalVec3d();
+            } else {
+                replica.velocities_[i] = Vec3d(0);
+            }
+        }
+        Vec3d tip_force = evalLangevinForces(replica);
+
+        // BAOAB splitting of the Langevin equation
+        for (int step = 0; step < n_steps; ++step) {
+            for (int i = 0; i < replica.n_atoms_; ++i) {
+                if (replica.fixed_[i] != 1) {
+                    replica.velocities_[i] += dt/2 * replica.forces_[i] / replica.masses_[i];
+                    replica.positions_[i] += dt/2 * replica.velocities_[i];
+                    replica.velocities_[i] = c1 * replica.velocities_[i]
+                                             + c2 * sigma_v[i] * random.normalVec3d();
+                    replica.positions_[i] += dt/2 * replica.velocities_[i];
+                }
+            }
+            tip_force = evalLangevinForces(replica);
+            for (int i = 0; i < replica.n_atoms_; ++i) {
+                if (replica.fixed_[i] != 1) {
+                    replica.velocities_[i] += dt/2 * replica.forces_[i] / replica.masses_[i];
+                }
+            }
+            if (step < options.thermal_equil) {
+                continue;
+            }
+            n_samples++;
+            double sample[3] = {tip_force.x, tip_force.y, tip_force.z};
+            for (int c = 0; c < 3; ++c) {
+                double delta = sample[c] - mean[c];
+                mean[c] += delta / n_samples;
+                m2[c] += delta * (sample[c] - mean[c]);
+            }
+        } // step
+    } // replica
+
+    mean_force = Vec3d(mean[0], mean[1], mean[2]);
+    if (n_samples > 1) {
+        force_variance = Vec3d(m2[0], m2[1], m2[2]) / (n_samples - 1);
+    } else {
+        force_variance = Vec3d(0);
+    }
+}
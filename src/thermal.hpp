@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdint>
+
+#include "system.hpp"
+#include "vectors.hpp"
+
+using namespace std;
+
+struct InputOptions;
+
+// Samples the force on the tip at finite temperature with Langevin dynamics.
+// Runs options.thermal_replicas independent replicas starting from the relaxed
+// state of system and returns the mean and the variance of the tip force over
+// all the sampling steps of all the replicas.
+void thermalSampling(const System& system, const InputOptions& options, uint64_t seed,
+                     Vec3d& mean_force, Vec3d& force_variance);
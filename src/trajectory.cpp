@@ -0,0 +1,88 @@
+#include "trajectory.hpp"
+
+#include <stdexcept>
+
+#include "text_buffer.hpp"
+
+using namespace std;
+
+
+void TrajectoryWriter::open(const string& filepath, bool gzip, size_t max_queued) {
+    close();
+    gzip_ = gzip;
+    if (gzip_) {
+        string command = "gzip -6 > " + filepath + ".gz";
+        file_ = popen(command.c_str(), "w");
+    } else {
+        file_ = fopen(filepath.c_str(), "w");
+    }
+    if (file_ == nullptr) {
+        throw runtime_error("Cannot open the trajectory file " + filepath);
+    }
+    max_queued_ = max_queued;
+    closing_ = false;
+    thread_ = thread(&TrajectoryWriter::writeFrames, this);
+}
+
+
+void TrajectoryWriter::addFrame(const vector<string>& types, const vector<Vec3d>& positions,
+                                const string& comment) {
+    Frame frame = {&types, positions, comment};
+    unique_lock<mutex> lock(queue_mutex_);
+    queue_changed_.wait(lock, [this]() { return queue_.size() < max_queued_; });
+    queue_.push_back(std::move(frame));
+    queue_changed_.notify_all();
+}
+
+
+void TrajectoryWriter::close() {
+    if (file_ == nullptr) {
+        return;
+    }
+    {
+        lock_guard<mutex> lock(queue_mutex_);
+        closing_ = true;
+    }
+    queue_changed_.notify_all();
+    thread_.join();
+    if (gzip_) {
+        pclose(file_);
+    } else {
+        fclose(file_);
+    }
+    file_ = nullptr;
+}
+
+
+void TrajectoryWriter::writeFrames() {
+    TextBuffer buffer;
+    while (true) {
+        Frame frame;
+        {
+            unique_lock<mutex> lock(queue_mutex_);
+            queue_changed_.wait(lock, [this]() { return closing_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                return;
+            }
+            frame = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        queue_changed_.notify_all();
+        // Same format as System::makeXYZFile, with the comment on the second line
+        buffer.appendInt(frame.positions.size());
+        buffer.append('\n');
+        buffer.append(frame.comment);
+        buffer.append('\n');
+        for (size_t i = 0; i < frame.positions.size(); ++i) {
+            buffer.append((*frame.types)[i]);
+            buffer.append(' ');
+            buffer.appendFixed(frame.positions[i].x, 8, 4);
+            buffer.append(' ');
+            buffer.appendFixed(frame.positions[i].y, 8, 4);
+            buffer.append(' ');
+            buffer.appendFixed(frame.positions[i].z, 8, 4);
+            buffer.append('\n');
+        }
+        buffer.flush(file_);
+    }
+}
@@ -0,0 +1,62 @@
+/*
+ * trajectory.hpp
+ *
+ * TrajectoryWriter collects relaxed structures to a multi-frame xyz file. The
+ * frames are formatted and written on a background thread, so the threads
+ * scanning the surface only hand over a copy of the positions.
+ *
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "vectors.hpp"
+
+using namespace std;
+
+/** \brief A background multi-frame xyz writer.
+ *
+ * At most max_queued frames wait to be written. If the disk can't keep up,
+ * addFrame waits instead of the memory use growing without limit.
+ */
+
+class TrajectoryWriter {
+public:
+    TrajectoryWriter(): file_(nullptr), gzip_(false), max_queued_(0), closing_(false) {};
+    ~TrajectoryWriter() { close(); };
+
+    // opens the file (through gzip if asked) and starts the writer thread.
+    // Throws a runtime_error if the file can't be opened.
+    void open(const string& filepath, bool gzip, size_t max_queued = 64);
+    bool isOpen() const { return file_ != nullptr; };
+    // queues a frame, the types must stay valid until the writer is closed
+    void addFrame(const vector<string>& types, const vector<Vec3d>& positions,
+                  const string& comment);
+    // writes the queued frames and closes the file
+    void close();
+
+private:
+    struct Frame {
+        const vector<string>* types;
+        vector<Vec3d> positions;
+        string comment;
+    };
+    // formats and writes the queued frames until the writer is closed
+    void writeFrames();
+
+    FILE* file_;
+    bool gzip_;
+    size_t max_queued_;
+    bool closing_;
+    deque<Frame> queue_;
+    mutex queue_mutex_;
+    condition_variable queue_changed_;
+    thread thread_;
+};
@@ -1,8 +1,14 @@
 #include "utility.hpp"
 
 #include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 #include "globals.hpp"
 
 char* strupp(char* string) {
@@ -35,3 +41,148 @@ int isint(char* str) {
     }
     return integer;
 }
+
+const char* parseDouble(const char* begin, const char* end, double& value) {
+    // Powers of ten that are exact doubles
+    static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char* p = begin;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int n_digits = 0;  // Significant digits in the mantissa
+    int n_read = 0;  // All the digits read
+    int exponent = 0;
+    bool exact = true;
+    for (; p < end && isdigit((unsigned char)*p); ++p, ++n_read) {
+        if (n_digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            n_digits += (mantissa > 0);
+        } else {
+            exact = false;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && isdigit((unsigned char)*p); ++p, ++n_read) {
+            if (n_digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                n_digits += (mantissa > 0);
+                exponent--;
+            } else {
+                exact = false;
+            }
+        }
+    }
+    if (n_read > 0 && p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negative_exponent = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negative_exponent = (*q == '-');
+            q++;
+        }
+        if (q < end && isdigit((unsigned char)*q)) {
+            int e = 0;
+            for (; q < end && isdigit((unsigned char)*q); ++q) {
+                e = (e < 10000) ? e * 10 + (*q - '0') : e;
+            }
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+    // A mantissa and a power of ten that are both exact doubles give a correctly rounded
+    // result with a single multiplication or division. Everything else (long mantissas,
+    // large exponents, hexadecimal numbers, infinities and nans) is left to strtod.
+    bool followed_by_number = p < end && (isalnum((unsigned char)*p) || *p == '.');
+    if (n_read > 0 && exact && !followed_by_number && mantissa < (1ULL << 53) &&
+        exponent >= -22 && exponent <= 22) {
+        double result = static_cast<double>(mantissa);
+        result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+        value = negative ? -result : result;
+        return p;
+    }
+    const char* token_end = begin;
+    while (token_end < end && !isspace((unsigned char)*token_end)) {
+        token_end++;
+    }
+    std::string token(begin, token_end);
+    char* number_end;
+    value = strtod(token.c_str(), &number_end);
+    return begin + (number_end - token.c_str());
+}
+
+std::string readLine(const char*& p, const char* end) {
+    const char* line = p;
+    while (p < end && *p != '\n') {
+        p++;
+    }
+    std::string result(line, p);
+    if (p < end) {
+        p++;
+    }
+    return result;
+}
+
+size_t parseValues(const char* begin, const char* end, double* values, size_t n_values) {
+    // Split the text to chunks that start at whitespace, so no number is cut in two
+    const size_t chunk_size = 1 << 20;
+    size_t n_chunks = (end - begin) / chunk_size + 1;
+    std::vector<const char*> chunk_starts(n_chunks + 1, end);
+    chunk_starts[0] = begin;
+    for (size_t c = 1; c < n_chunks; ++c) {
+        const char* start = std::max(begin + c * chunk_size, chunk_starts[c - 1]);
+        while (start < end && !isspace((unsigned char)*start)) {
+            start++;
+        }
+        chunk_starts[c] = start;
+    }
+
+    // Count the numbers of each chunk to know where its values go
+    std::vector<size_t> chunk_offsets(n_chunks + 1, 0);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t c = 0; c < n_chunks; ++c) {
+        size_t n_tokens = 0;
+        bool in_token = false;
+        for (const char* p = chunk_starts[c]; p < chunk_starts[c + 1]; ++p) {
+            bool space = isspace((unsigned char)*p);
+            n_tokens += (!space && !in_token);
+            in_token = !space;
+        }
+        chunk_offsets[c + 1] = n_tokens;
+    }
+    for (size_t c = 0; c < n_chunks; ++c) {
+        chunk_offsets[c + 1] += chunk_offsets[c];
+    }
+
+    // Parse the numbers up to n_values. Each chunk records the index of its first token
+    // that isn't a number.
+    std::vector<size_t> first_invalid(n_chunks, n_values);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t c = 0; c < n_chunks; ++c) {
+        size_t index = chunk_offsets[c];
+        const char* p = chunk_starts[c];
+        const char* chunk_end = chunk_starts[c + 1];
+        while (index < n_values) {
+            while (p < chunk_end && isspace((unsigned char)*p)) {
+                p++;
+            }
+            if (p >= chunk_end) {
+                break;
+            }
+            const char* number_end = parseDouble(p, chunk_end, values[index]);
+            if (number_end == p || (number_end < chunk_end && !isspace((unsigned char)*number_end))) {
+                first_invalid[c] = index;
+                break;
+            }
+            p = number_end;
+            index++;
+        }
+    }
+    size_t n_read = std::min(chunk_offsets[n_chunks], n_values);
+    for (size_t c = 0; c < n_chunks; ++c) {
+        n_read = std::min(n_read, first_invalid[c]);
+    }
+    return n_read;
+}
@@ -1,8 +1,21 @@
 #pragma once
 
+#include <cstddef>
+#include <string>
+
 // Converts a string to uppercase
 char* strupp(char *string);
 // Converts a string to lowercase
 char* strlow(char *string);
 // Checks if a value is an integer
 int isint(char *str);
+// Parses a floating point number at the beginning of [begin, end) with the same result as
+// strtod. Returns the end of the number, or begin if there is no number.
+const char* parseDouble(const char* begin, const char* end, double& value);
+// Parses the first n_values whitespace separated numbers of [begin, end) to values in
+// parallel. Returns the number of values read, which is less than n_values if the text
+// ends or has something else than a number before that.
+size_t parseValues(const char* begin, const char* end, double* values, size_t n_values);
+// Returns the line starting at p without the newline and moves p to the beginning of the
+// next line
+std::string readLine(const char*& p, const char* end);
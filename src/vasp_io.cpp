@@ -0,0 +1,125 @@
+#include "vasp_io.hpp"
+
+#include <cctype>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+#include "cube_io.hpp"
+#include "globals.hpp"
+#include "utility.hpp"
+
+using namespace std;
+
+
+VaspReader::VaspReader(const string& filepath): file_(filepath), filepath_(filepath) {
+    const char* p = file_.data();
+    const char* end = p + file_.size();
+    const string format_error = "Could not read the header of the VASP file " + filepath +
+                                ". Check the format of the file.";
+
+    // The comment line, the scaling factor and the lattice vectors
+    readLine(p, end);
+    double scale;
+    if (!(istringstream(readLine(p, end)) >> scale)) {
+        throw runtime_error(format_error);
+    }
+    Vec3d lattice[3];
+    for (int i = 0; i < 3; i++) {
+        if (!(istringstream(readLine(p, end)) >> lattice[i].x >> lattice[i].y >> lattice[i].z)) {
+            throw runtime_error(format_error);
+        }
+    }
+    cell_volume_ = fabs(lattice[0].x * (lattice[1].y*lattice[2].z - lattice[1].z*lattice[2].y) +
+                        lattice[0].y * (lattice[1].z*lattice[2].x - lattice[1].x*lattice[2].z) +
+                        lattice[0].z * (lattice[1].x*lattice[2].y - lattice[1].y*lattice[2].x));
+    // A negative scaling factor is the volume of the cell
+    if (scale < 0) {
+        scale = cbrt(-scale / cell_volume_);
+    }
+    for (int i = 0; i < 3; i++) {
+        lattice[i] *= scale;
+    }
+    cell_volume_ *= scale * scale * scale;
+
+    // The element names are optional (VASP 5), the numbers of atoms are not
+    string line = readLine(p, end);
+    istringstream first_word(line);
+    string word;
+    first_word >> word;
+    if (!word.empty() && isalpha((unsigned char)word[0])) {
+        line = readLine(p, end);
+    }
+    int n_atoms = 0;
+    istringstream counts(line);
+    for (int count; counts >> count; ) {
+        n_atoms += count;
+    }
+
+    // Selective dynamics is optional, then the atom positions in either direct or cartesian
+    // coordinates
+    line = readLine(p, end);
+    if (!line.empty() && (line[0] == 'S' || line[0] == 's')) {
+        line = readLine(p, end);
+    }
+    bool cartesian = !line.empty() && (line[0] == 'C' || line[0] == 'c' || line[0] == 'K' || line[0] == 'k');
+    atom_positions_.assign(n_atoms, Vec3d(0));
+    for (int ia = 0; ia < n_atoms; ia++) {
+        Vec3d position;
+        if (!(istringstream(readLine(p, end)) >> position.x >> position.y >> position.z)) {
+            throw runtime_error(format_error);
+        }
+        if (cartesian) {
+            atom_positions_[ia] = scale * position;
+        } else {
+            atom_positions_[ia] = position.x*lattice[0] + position.y*lattice[1] + position.z*lattice[2];
+        }
+    }
+
+    // The grid follows after an empty line. Grid point (0, 0, 0) is at the corner of the cell.
+    do {
+        line = readLine(p, end);
+    } while (p < end && line.find_first_not_of(" \t\r") == string::npos);
+    if (!(istringstream(line) >> n_voxels_.x >> n_voxels_.y >> n_voxels_.z) ||
+            n_voxels_.x < 1 || n_voxels_.y < 1 || n_voxels_.z < 1) {
+        throw runtime_error(format_error);
+    }
+    voxel_vectors_[0] = lattice[0] / n_voxels_.x;
+    voxel_vectors_[1] = lattice[1] / n_voxels_.y;
+    voxel_vectors_[2] = lattice[2] / n_voxels_.z;
+    origin_ = Vec3d(0.0);
+    data_begin_ = p;
+}
+
+
+vector<double> VaspReader::readVolumetricData() {
+    const size_t n_values = (size_t)n_voxels_.x * n_voxels_.y * n_voxels_.z;
+    vector<double> file_values(n_values);
+    const char* end = file_.data() + file_.size();
+    if (parseValues(data_begin_, end, file_values.data(), n_values) < n_values) {
+        throw runtime_error("Could not read the volumetric data from the VASP file " + filepath_ +
+                            ". Check the format of the file.");
+    }
+
+    // x runs fastest in the file and z in DataGrid
+    vector<double> volumetric_data(n_values);
+#pragma omp parallel for
+    for (int ix = 0; ix < n_voxels_.x; ix++) {
+        for (int iy = 0; iy < n_voxels_.y; iy++) {
+            for (int iz = 0; iz < n_voxels_.z; iz++) {
+                volumetric_data[((size_t)ix*n_voxels_.y + iy)*n_voxels_.z + iz] =
+                        file_values[((size_t)iz*n_voxels_.y + iy)*n_voxels_.x + ix];
+            }
+        }
+    }
+    return volumetric_data;
+}
+
+
+double VaspReader::unitConversion(VolumeQuantity quantity) const {
+    if (quantity == QUANTITY_POTENTIAL) {
+        return 1.0 / g_hartree_to_eV;
+    }
+    // The charge files contain the density times the volume of the cell
+    return pow(bohr_to_angst, 3) / cell_volume_;
+}
@@ -0,0 +1,43 @@
+/*
+ * vasp_io.hpp
+ *
+ * VaspReader class represents a read access to the volumetric data of the VASP
+ * output files LOCPOT, CHGCAR, CHG, PARCHG and AECCAR, which share the format
+ * of a POSCAR structure followed by a grid of values with x running fastest.
+ *
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mapped_file.hpp"
+#include "vectors.hpp"
+#include "volume_io.hpp"
+
+using namespace std;
+
+/** \brief A VASP volumetric data file parser.
+ *
+ * The potentials of LOCPOT files are in eV and the charge files contain the
+ * density multiplied by the volume of the cell. Only the first data set is read,
+ * so for spin polarized calculations that is the total density. The file is
+ * memory mapped and the values are parsed in parallel.
+ */
+
+class VaspReader: public VolumeReader {
+public:
+    VaspReader(const string& filepath);
+
+    vector<double> readVolumetricData() override;
+
+protected:
+    double unitConversion(VolumeQuantity quantity) const override;
+
+private:
+    MappedFile file_;
+    string filepath_;
+    const char* data_begin_;  // The first value of the grid
+    double cell_volume_;  // In Å^3
+};
@@ -0,0 +1,65 @@
+#include "volume_io.hpp"
+
+#include <algorithm>
+#include <cctype>
+
+#include "cube_io.hpp"
+#include "vasp_io.hpp"
+#include "xsf_io.hpp"
+
+using namespace std;
+
+
+void VolumeReader::storeToDataGrid(DataGrid<double>& data_grid, VolumeQuantity quantity) {
+    vector<double> volumetric_data = readVolumetricData();
+    double conversion = unitConversion(quantity);
+    if (conversion != 1.0) {
+        for (auto& value : volumetric_data) {
+            value *= conversion;
+        }
+    }
+    data_grid.setNGrid(n_voxels_);
+    data_grid.setBasis(voxel_vectors_);
+    data_grid.setOrigin(origin_);
+    data_grid.swapValues(volumetric_data);
+}
+
+
+unique_ptr<VolumeReader> openVolumeFile(const string& filepath) {
+    size_t separator = filepath.find_last_of("/\\");
+    string filename = filepath.substr(separator == string::npos ? 0 : separator + 1);
+    string upper = filename;
+    transform(upper.begin(), upper.end(), upper.begin(), [](unsigned char c) { return toupper(c); });
+    auto ends_with = [&upper](const string& suffix) {
+        return upper.size() >= suffix.size() && upper.compare(upper.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    
+    if (ends_with(".XSF")) {
+        return unique_ptr<VolumeReader>(new XSFReader(filepath));
+    }
+    if (ends_with(".CUBE") || ends_with(".CUB")) {
+        return unique_ptr<VolumeReader>(new CubeReader(filepath));
+    }
+    // A VASP file is named after its contents, possibly followed by a suffix such as
+    // LOCPOT.relaxed or CHGCAR_spin, AECCAR also by its number
+    auto starts_with_name = [&upper](const string& name, bool numbered) {
+        if (upper.compare(0, name.size(), name) != 0) {
+            return false;
+        }
+        size_t next = name.size();
+        while (numbered && next < upper.size() && isdigit((unsigned char)upper[next])) {
+            ++next;
+        }
+        return next == upper.size() || upper[next] == '.' || upper[next] == '_';
+    };
+    const char* vasp_names[] = {"LOCPOT", "CHGCAR", "PARCHG", "CHG"};
+    for (const char* name : vasp_names) {
+        if (starts_with_name(name, false)) {
+            return unique_ptr<VolumeReader>(new VaspReader(filepath));
+        }
+    }
+    if (starts_with_name("AECCAR", true) || ends_with(".VASP")) {
+        return unique_ptr<VolumeReader>(new VaspReader(filepath));
+    }
+    return unique_ptr<VolumeReader>(new CubeReader(filepath));
+}
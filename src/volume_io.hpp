@@ -0,0 +1,62 @@
+/*
+ * volume_io.hpp
+ *
+ * VolumeReader class is the common interface of the readers of volumetric data
+ * files: cube files, VASP LOCPOT and CHGCAR files and XSF files. The geometry is
+ * given in Angstrom and the values are converted to the units of the CP2K cube
+ * files, Hartree for potentials and e/bohr^3 for electron densities.
+ *
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "data_grid.hpp"
+#include "vectors.hpp"
+
+using namespace std;
+
+// Defines the quantities of volumetric data, which determine the unit conversion
+enum VolumeQuantity {QUANTITY_POTENTIAL, QUANTITY_DENSITY};
+
+/** \brief A volumetric data file parser.
+ *
+ * Represents a read access to the volumetric data of a file and contains the
+ * grid of the data and the atom positions.
+ */
+
+class VolumeReader {
+public:
+    virtual ~VolumeReader() {};
+
+    const Vec3i& getNVoxels() const { return n_voxels_; };
+    const vector<Vec3d>& getVoxelVectors() const { return voxel_vectors_; };
+    const Vec3d& getOrigin() const { return origin_; };
+    // Returns the positions of the atoms in Å
+    const vector<Vec3d>& getAtomPositions() const { return atom_positions_; };
+
+    // allocates a vector and returns it after filling it with volumetric data from the file
+    // in the order of DataGrid (z runs fastest) and in the units of the file
+    virtual vector<double> readVolumetricData() = 0;
+    // stores all contents to a DataGrid object with the values in the units of the quantity
+    void storeToDataGrid(DataGrid<double>& data_grid, VolumeQuantity quantity);
+
+protected:
+    VolumeReader(): n_voxels_(Vec3i(0)), voxel_vectors_(3, Vec3d(0)), origin_(Vec3d(0)) {};
+    // returns the factor that converts the values of the file to the units of the quantity
+    virtual double unitConversion(VolumeQuantity quantity) const = 0;
+
+    Vec3i n_voxels_;
+    vector<Vec3d> voxel_vectors_;  // In Å
+    Vec3d origin_;  // In Å
+    vector<Vec3d> atom_positions_;  // In Å
+};
+
+
+// Opens a reader for the file based on its name. Files ending with .xsf are XSF files,
+// files named after the VASP outputs (LOCPOT, CHGCAR, CHG, PARCHG or AECCAR) or ending
+// with .vasp are VASP files and everything else is read as a cube file.
+unique_ptr<VolumeReader> openVolumeFile(const string& filepath);
@@ -0,0 +1,173 @@
+#include "xsf_io.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <stdexcept>
+
+#include "cube_io.hpp"
+#include "globals.hpp"
+#include "utility.hpp"
+
+using namespace std;
+
+
+XSFReader::XSFReader(const string& filepath): file_(filepath), filepath_(filepath) {
+    const char* p = file_.data();
+    const char* end = p + file_.size();
+    
+    // Read the atoms and find the first 3D data grid. The atoms are listed one per line after
+    // ATOMS, or after PRIMCOORD and a line with the number of atoms.
+    bool in_atoms = false;
+    bool found_grid = false;
+    while (p < end && !found_grid) {
+        string line = readLine(p, end);
+        istringstream words(line);
+        string keyword;
+        words >> keyword;
+        if (keyword.empty() || keyword[0] == '#') {
+            continue;
+        }
+        Vec3d position;
+        if (keyword == "ATOMS") {
+            in_atoms = true;
+        } else if (keyword == "PRIMCOORD") {
+            int n_atoms = 0;
+            istringstream(readLine(p, end)) >> n_atoms;
+            atom_positions_.clear();
+            for (int ia = 0; ia < n_atoms && p < end; ia++) {
+                if (istringstream(readLine(p, end)) >> keyword >> position.x >> position.y >> position.z) {
+                    atom_positions_.push_back(position);
+                }
+            }
+        } else if (in_atoms && (words >> position.x >> position.y >> position.z)) {
+            atom_positions_.push_back(position);
+        } else {
+            in_atoms = false;
+            found_grid = keyword.compare(0, 17, "BEGIN_DATAGRID_3D") == 0 ||
+                         keyword.compare(0, 11, "DATAGRID_3D") == 0;
+        }
+    }
+    
+    // The number of points, the origin and the spanning vectors of the grid
+    Vec3d span[3];
+    if (!found_grid ||
+            !(istringstream(readLine(p, end)) >> n_points_.x >> n_points_.y >> n_points_.z) ||
+            !(istringstream(readLine(p, end)) >> origin_.x >> origin_.y >> origin_.z) ||
+            !(istringstream(readLine(p, end)) >> span[0].x >> span[0].y >> span[0].z) ||
+            !(istringstream(readLine(p, end)) >> span[1].x >> span[1].y >> span[1].z) ||
+            !(istringstream(readLine(p, end)) >> span[2].x >> span[2].y >> span[2].z) ||
+            n_points_.x < 1 || n_points_.y < 1 || n_points_.z < 1) {
+        throw runtime_error("Could not read a 3D data grid from the XSF file " + filepath +
+                            ". Check the format of the file.");
+    }
+    
+    // The last points of each direction are the periodic images of the first ones
+    const int n_points[3] = {n_points_.x, n_points_.y, n_points_.z};
+    for (int i = 0; i < 3; i++) {
+        voxel_vectors_[i] = span[i] / max(n_points[i] - 1, 1);
+    }
+    n_voxels_ = Vec3i(max(n_points_.x - 1, 1), max(n_points_.y - 1, 1), max(n_points_.z - 1, 1));
+    data_begin_ = p;
+}
+
+
+vector<double> XSFReader::readVolumetricData() {
+    const size_t n_values = (size_t)n_points_.x * n_points_.y * n_points_.z;
+    vector<double> file_values(n_values);
+    const char* end = file_.data() + file_.size();
+    if (parseValues(data_begin_, end, file_values.data(), n_values) < n_values) {
+        throw runtime_error("Could not read the volumetric data from the XSF file " + filepath_ +
+                            ". Check the format of the file.");
+    }
+    
+    // x runs fastest in the file and z in DataGrid
+    vector<double> volumetric_data((size_t)n_voxels_.x * n_voxels_.y * n_voxels_.z);
+#pragma omp parallel for
+    for (int ix = 0; ix < n_voxels_.x; ix++) {
+        for (int iy = 0; iy < n_voxels_.y; iy++) {
+            for (int iz = 0; iz < n_voxels_.z; iz++) {
+                volumetric_data[((size_t)ix*n_voxels_.y + iy)*n_voxels_.z + iz] =
+                        file_values[((size_t)iz*n_points_.y + iy)*n_points_.x + ix];
+            }
+        }
+    }
+    return volumetric_data;
+}
+
+
+double XSFReader::unitConversion(VolumeQuantity quantity) const {
+    if (quantity == QUANTITY_POTENTIAL) {
+        return 1.0 / g_hartree_to_eV;
+    }
+    return pow(bohr_to_angst, 3);
+}
+
+
+XSFWriter::XSFWriter(const string& filepath) {
+    xsf_file_ = fopen(filepath.c_str(), "w");
+    if (xsf_file_ == NULL) {
+        throw runtime_error("Could not open the XSF file " + filepath + " for writing.");
+    }
+}
+
+
+XSFWriter::~XSFWriter() {
+    if (xsf_file_ != NULL) {
+        fclose(xsf_file_);
+    }
+}
+
+
+void XSFWriter::setAtoms(const vector<int>& atom_numbers, const vector<Vec3d>& atom_positions) {
+    atom_numbers_ = atom_numbers;
+    atom_positions_ = atom_positions;
+}
+
+
+void XSFWriter::writeDataGrid(const DataGrid<double>& data_grid, const string& name) {
+    const Vec3i& n_grid = data_grid.getNGrid();
+    const Mat3d& basis = data_grid.getBasis();
+    const Vec3d& origin = data_grid.getOrigin();
+    
+    // the atoms of a non-periodic structure
+    fprintf(xsf_file_, "ATOMS\n");
+    for (unsigned int ia = 0; ia < atom_numbers_.size(); ia++) {
+        fprintf(xsf_file_, "%5d %12.6f %12.6f %12.6f\n", atom_numbers_[ia],
+                atom_positions_[ia].x, atom_positions_[ia].y, atom_positions_[ia].z);
+    }
+    
+    // a general grid includes the points on both edges, so the spanning
+    // vectors are one voxel shorter than the number of points
+    fprintf(xsf_file_, "BEGIN_BLOCK_DATAGRID_3D\n");
+    fprintf(xsf_file_, "%s\n", name.c_str());
+    fprintf(xsf_file_, "BEGIN_DATAGRID_3D_%s\n", name.c_str());
+    fprintf(xsf_file_, "%d %d %d\n", n_grid.x, n_grid.y, n_grid.z);
+    fprintf(xsf_file_, "%12.6f %12.6f %12.6f\n", origin.x, origin.y, origin.z);
+    const int n_voxels[3] = {n_grid.x, n_grid.y, n_grid.z};
+    for (int i = 0; i < 3; i++) {
+        Vec3d span = max(n_voxels[i] - 1, 1) * basis.getColumn(i);
+        fprintf(xsf_file_, "%12.6f %12.6f %12.6f\n", span.x, span.y, span.z);
+    }
+    
+    // x runs fastest in XSF, so format the z slabs in parallel and write them in order
+    vector<string> slabs(n_grid.z);
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int iz = 0; iz < n_grid.z; iz++) {
+        char value[32];
+        string& slab = slabs[iz];
+        slab.reserve(n_grid.x * n_grid.y * 14);
+        for (int iy = 0; iy < n_grid.y; iy++) {
+            for (int ix = 0; ix < n_grid.x; ix++) {
+                snprintf(value, sizeof(value), " %12.5E", data_grid.at(ix, iy, iz));
+                slab += value;
+            }
+            slab += '\n';
+        }
+    }
+    for (const auto& slab : slabs) {
+        fwrite(slab.data(), 1, slab.size(), xsf_file_);
+    }
+    fprintf(xsf_file_, "END_DATAGRID_3D\n");
+    fprintf(xsf_file_, "END_BLOCK_DATAGRID_3D\n");
+}
@@ -0,0 +1,70 @@
+/*
+ * xsf_io.hpp
+ * 
+ * XSFReader class represents a read access to the first 3D data grid of an
+ * XCrySDen structure file (XSF) and the atom positions of the file.
+ * XSFWriter class writes a DataGrid with the atom types and positions to an
+ * XCrySDen structure file (XSF), which is read by eg. VESTA, VMD and ParaView.
+ * 
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "data_grid.hpp"
+#include "mapped_file.hpp"
+#include "vectors.hpp"
+#include "volume_io.hpp"
+
+using namespace std;
+
+/** \brief An XSF file parser.
+ *  
+ * XSF has no units for the data, so potentials are assumed to be in eV and
+ * densities in e/Å^3. The data is assumed to be periodic, so the points on the
+ * far edges of a general grid, which repeat the first points, are left out.
+ * The file is memory mapped and the values are parsed in parallel.
+ */
+
+class XSFReader: public VolumeReader {
+public:
+    XSFReader(const string& filepath);
+
+    vector<double> readVolumetricData() override;
+
+protected:
+    double unitConversion(VolumeQuantity quantity) const override;
+
+private:
+    MappedFile file_;
+    string filepath_;
+    Vec3i n_points_;  // Number of points of the general grid in the file
+    const char* data_begin_;  // The first value of the grid
+};
+
+
+/** \brief An XSF file writer.
+ *  
+ * Writes the volumetric data of a DataGrid as a general 3D data grid to an
+ * XSF file together with the atom types and positions. Lengths are written
+ * in Angstrom.
+ */
+
+class XSFWriter {
+public:
+    XSFWriter(const string& filepath);
+    ~XSFWriter();
+    
+    // sets the atoms written to the file (positions in Angstrom)
+    void setAtoms(const vector<int>& atom_numbers, const vector<Vec3d>& atom_positions);
+    // writes the atoms and the data grid with the given name to the file
+    void writeDataGrid(const DataGrid<double>& data_grid, const string& name);
+
+private:
+    FILE* xsf_file_;
+    vector<int> atom_numbers_;
+    vector<Vec3d> atom_positions_;
+};